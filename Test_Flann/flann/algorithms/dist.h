@@ -363,6 +363,82 @@ struct MaxDistance
 
 };
 
+
+
+/**
+ * Cosine distance functor, 1 - cos(a, b), for angular search.
+ * On normalized vectors it orders the neighbors as the negated inner product does,
+ * and it is half the squared Euclidean distance.
+ */
+template<class T>
+struct CosineDistance
+{
+    typedef bool is_vector_space_distance;
+
+    typedef T ElementType;
+    typedef typename Accumulator<T>::Type ResultType;
+
+    template <typename Iterator1, typename Iterator2>
+    ResultType operator()(Iterator1 a, Iterator2 b, size_t size, ResultType /*worst_dist*/ = -1) const
+    {
+        ResultType dot0 = 0, dot1 = 0, norm_a = 0, norm_b = 0;
+        size_t i = 0;
+        /* Process 2 items with each loop, with independent sums. */
+        for (; i + 2 <= size; i += 2) {
+            dot0 += a[i] * b[i];
+            dot1 += a[i + 1] * b[i + 1];
+            norm_a += a[i] * a[i] + a[i + 1] * a[i + 1];
+            norm_b += b[i] * b[i] + b[i + 1] * b[i + 1];
+        }
+        for (; i < size; ++i) {
+            dot0 += a[i] * b[i];
+            norm_a += a[i] * a[i];
+            norm_b += b[i] * b[i];
+        }
+        ResultType norms = std::sqrt(norm_a * norm_b);
+        if (norms <= 0) return 1;
+        return 1 - (dot0 + dot1) / norms;
+    }
+
+    /* This distance functor is not dimension-wise additive, which
+     * makes it an invalid kd-tree distance, not implementing the accum_dist method */
+};
+
+
+/**
+ * Inner product "distance" functor, the negated inner product, so that the largest inner products
+ * come first. It is not a metric: a vector is not its own nearest neighbor in general.
+ */
+template<class T>
+struct InnerProductDistance
+{
+    typedef bool is_vector_space_distance;
+
+    typedef T ElementType;
+    typedef typename Accumulator<T>::Type ResultType;
+
+    template <typename Iterator1, typename Iterator2>
+    ResultType operator()(Iterator1 a, Iterator2 b, size_t size, ResultType /*worst_dist*/ = -1) const
+    {
+        ResultType dot0 = 0, dot1 = 0, dot2 = 0, dot3 = 0;
+        size_t i = 0;
+        /* Process 4 items with each loop for efficiency. */
+        for (; i + 4 <= size; i += 4) {
+            dot0 += a[i] * b[i];
+            dot1 += a[i + 1] * b[i + 1];
+            dot2 += a[i + 2] * b[i + 2];
+            dot3 += a[i + 3] * b[i + 3];
+        }
+        for (; i < size; ++i) {
+            dot0 += a[i] * b[i];
+        }
+        return -((dot0 + dot1) + (dot2 + dot3));
+    }
+
+    /* This distance functor is not dimension-wise additive, which
+     * makes it an invalid kd-tree distance, not implementing the accum_dist method */
+};
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /**
@@ -32,7 +32,9 @@
 #define FLANN_KDTREE_INDEX_H_
 
 #include <algorithm>
+#include <list>
 #include <map>
+#include <random>
 #include <cassert>
 #include <cstring>
 #include <stdarg.h>
@@ -44,6 +46,7 @@
 #include "flann/util/matrix.h"
 #include "flann/util/result_set.h"
 #include "flann/util/heap.h"
+#include "flann/util/visited_set.h"
 #include "flann/util/allocator.h"
 #include "flann/util/random.h"
 #include "flann/util/saving.h"
@@ -56,10 +59,13 @@ namespace flann
 
 struct KDTreeIndexParams : public IndexParams
 {
-    KDTreeIndexParams(int trees = 4)
+    KDTreeIndexParams(int trees = 4, int leaf_max_size = 1)
     {
         (*this)["algorithm"] = FLANN_INDEX_KDTREE;
+        // number of randomized trees
         (*this)["trees"] = trees;
+        // maximum number of points in a leaf, above 1 the points of the leaves are copied in tree order
+        (*this)["leaf_max_size"] = leaf_max_size;
     }
 };
 
@@ -79,6 +85,8 @@ public:
 
     //typedef NNIndex<Distance> BaseClass;
 
+    struct SearchContext;
+
     /**
      * KDTree constructor
      *
@@ -88,9 +96,10 @@ public:
      */
     KDTreeIndex(const IndexParams& params = KDTreeIndexParams(), Distance d = Distance() ) :
 		distance_(d), last_id_(0), size_(0), size_at_build_(0), veclen_(0),
-		index_params_(params), removed_(false), removed_count_(0), data_ptr_(NULL), mean_(NULL), var_(NULL)
+		index_params_(params), removed_(false), removed_count_(0), data_ptr_(NULL)
     {
         trees_ = get_param(index_params_,"trees",4);
+        leaf_max_size_ = get_param(index_params_,"leaf_max_size",1);
     }
 
 
@@ -103,22 +112,20 @@ public:
      */
     KDTreeIndex(const Matrix<ElementType>& dataset, const IndexParams& params = KDTreeIndexParams(),
                 Distance d = Distance() ) : distance_(d), last_id_(0), size_(0), size_at_build_(0), veclen_(0),
-											index_params_(params), removed_(false), removed_count_(0), data_ptr_(NULL), 
-											mean_(NULL), var_(NULL)
+											index_params_(params), removed_(false), removed_count_(0), data_ptr_(NULL)
     {
         trees_ = get_param(index_params_,"trees",4);
+        leaf_max_size_ = get_param(index_params_,"leaf_max_size",1);
 
         setDataset(dataset);
     }
 
     KDTreeIndex(const KDTreeIndex& other) :distance_(d), last_id_(0), size_(0), size_at_build_(0), veclen_(0),
 			index_params_(params), removed_(false), removed_count_(0), data_ptr_(NULL),
-    		trees_(other.trees_)
+    		trees_(other.trees_), leaf_max_size_(other.leaf_max_size_), tree_nodes_(other.tree_nodes_),
+    		tree_bounds_(other.tree_bounds_), root_bbox_(other.root_bbox_),
+    		vind_(other.vind_), leaf_points_(other.leaf_points_)
     {
-        tree_roots_.resize(other.tree_roots_.size());
-        for (size_t i=0;i<tree_roots_.size();++i) {
-        	copyTree(tree_roots_[i], other.tree_roots_[i]);
-        }
     }
 
     KDTreeIndex& operator=(KDTreeIndex other)
@@ -165,9 +172,18 @@ public:
             buildIndex();
         }
         else {
+            BuildContext context(veclen_, (unsigned int)rand_int());
             for (size_t i=old_size;i<size_;++i) {
+                for (size_t k = 0; k < veclen_; ++k) {
+                    root_bbox_[k].low = std::min(root_bbox_[k].low, DistanceType(points_[i][k]));
+                    root_bbox_[k].high = std::max(root_bbox_[k].high, DistanceType(points_[i][k]));
+                }
                 for (int j = 0; j < trees_; j++) {
-                    addPointToTree(tree_roots_[j], i);
+                    addPointToTree(context, tree_nodes_[j], tree_bounds_[j], int(i));
+                }
+                // Each tree holds every point once: the other rows are the leaves left behind by addPointToTree
+                if (leaf_max_size_>1 && vind_.size() > 2*trees_*(i+1)) {
+                    compactLeaves();
                 }
             }
         }        
@@ -187,20 +203,24 @@ public:
     	ar & *static_cast<NNIndex<Distance>*>(this);
 
     	ar & trees_;
-
-    	if (Archive::is_loading::value) {
-    		tree_roots_.resize(trees_);
-    	}
-    	for (size_t i=0;i<tree_roots_.size();++i) {
-    		if (Archive::is_loading::value) {
-    			tree_roots_[i] = new(pool_) Node();
-    		}
-    		ar & *tree_roots_[i];
-    	}
+    	ar & leaf_max_size_;
+    	ar & tree_nodes_;
+    	ar & tree_bounds_;
+    	ar & root_bbox_;
+    	ar & vind_;
 
     	if (Archive::is_loading::value) {
             index_params_["algorithm"] = getType();
             index_params_["trees"] = trees_;
+            index_params_["leaf_max_size"] = leaf_max_size_;
+            leaf_points_.clear();
+            if (leaf_max_size_>1) {
+                leaf_points_.reserve(vind_.size()*veclen_);
+                for (size_t i = 0; i < vind_.size(); ++i) {
+                    leaf_points_.insert(leaf_points_.end(), points_[vind_[i]], points_[vind_[i]]+veclen_);
+                }
+                if (vind_.size() > trees_*size_) compactLeaves();
+            }
     	}
     }
 
@@ -225,7 +245,13 @@ public:
      */
     int usedMemory() const
     {
-        return int(pool_.usedMemory+pool_.wastedMemory+size_*sizeof(int));  // pool memory and vind array memory
+        size_t nodes = 0;
+        for (size_t i = 0; i < tree_nodes_.size(); ++i) {
+            nodes += tree_nodes_[i].size();
+        }
+        // tree memory with the split bounds, bounding box, vind array and leaf points memory
+        return int(nodes*(sizeof(FlatNode)+sizeof(Interval))+root_bbox_.size()*sizeof(Interval)
+                   +vind_.size()*sizeof(int)+leaf_points_.size()*sizeof(ElementType));
     }
 
 	/*inline function copy from NN_Index*/
@@ -268,10 +294,11 @@ public:
 #pragma omp parallel num_threads(params.cores)
 			{
 				KNNResultSet2<DistanceType> resultSet(knn);
+				SearchContext context(*this, params, knn);
 #pragma omp for schedule(static) reduction(+:count)
 				for (int i = 0; i < (int)queries.rows; i++) {
 					resultSet.clear();
-					findNeighbors(resultSet, queries[i], params);
+					findNeighbors(resultSet, queries[i], params, context);
 					size_t n = std::min(resultSet.size(), knn);
 					resultSet.copy(indices[i], dists[i], n, params.sorted);
 					indices_to_ids(indices[i], indices[i], n);
@@ -283,10 +310,11 @@ public:
 #pragma omp parallel num_threads(params.cores)
 			{
 				KNNSimpleResultSet<DistanceType> resultSet(knn);
+				SearchContext context(*this, params, knn);
 #pragma omp for schedule(static) reduction(+:count)
 				for (int i = 0; i < (int)queries.rows; i++) {
 					resultSet.clear();
-					findNeighbors(resultSet, queries[i], params);
+					findNeighbors(resultSet, queries[i], params, context);
 					size_t n = std::min(resultSet.size(), knn);
 					resultSet.copy(indices[i], dists[i], n, params.sorted);
 					indices_to_ids(indices[i], indices[i], n);
@@ -360,10 +388,11 @@ public:
 #pragma omp parallel num_threads(params.cores)
 			{
 				KNNResultSet2<DistanceType> resultSet(knn);
+				SearchContext context(*this, params, knn);
 #pragma omp for schedule(static) reduction(+:count)
 				for (int i = 0; i < (int)queries.rows; i++) {
 					resultSet.clear();
-					findNeighbors(resultSet, queries[i], params);
+					findNeighbors(resultSet, queries[i], params, context);
 					size_t n = std::min(resultSet.size(), knn);
 					indices[i].resize(n);
 					dists[i].resize(n);
@@ -379,10 +408,11 @@ public:
 #pragma omp parallel num_threads(params.cores)
 			{
 				KNNSimpleResultSet<DistanceType> resultSet(knn);
+				SearchContext context(*this, params, knn);
 #pragma omp for schedule(static) reduction(+:count)
 				for (int i = 0; i < (int)queries.rows; i++) {
 					resultSet.clear();
-					findNeighbors(resultSet, queries[i], params);
+					findNeighbors(resultSet, queries[i], params, context);
 					size_t n = std::min(resultSet.size(), knn);
 					indices[i].resize(n);
 					dists[i].resize(n);
@@ -435,24 +465,37 @@ public:
      *     maxCheck = the maximum number of restarts (in a best-bin-first manner)
      */
     void findNeighbors(ResultSet<DistanceType>& result, const ElementType* vec, const SearchParams& searchParams) const
+    {
+        SearchContext context(*this, searchParams);
+        findNeighbors(result, vec, searchParams, context);
+    }
+
+    /**
+     * Same as above, but using the scratch memory of the caller: the search then does not allocate.
+     *
+     * Params:
+     *     context = scratch memory created for this index and these search parameters, owned by the calling thread
+     */
+    void findNeighbors(ResultSet<DistanceType>& result, const ElementType* vec, const SearchParams& searchParams,
+                       SearchContext& context) const
     {
         int maxChecks = searchParams.checks;
         float epsError = 1+searchParams.eps;
 
         if (maxChecks==FLANN_CHECKS_UNLIMITED) {
         	if (removed_) {
-        		getExactNeighbors<true>(result, vec, epsError);
+        		getExactNeighbors<true>(result, vec, epsError, context);
         	}
         	else {
-        		getExactNeighbors<false>(result, vec, epsError);
+        		getExactNeighbors<false>(result, vec, epsError, context);
         	}
         }
         else {
         	if (removed_) {
-        		getNeighbors<true>(result, vec, maxChecks, epsError);
+        		getNeighbors<true>(result, vec, maxChecks, epsError, context);
         	}
         	else {
-        		getNeighbors<false>(result, vec, maxChecks, epsError);
+        		getNeighbors<false>(result, vec, maxChecks, epsError, context);
         	}
         }
     }
@@ -464,25 +507,38 @@ protected:
      */
     void buildIndexImpl()
     {
-        // Create a permutable array of indices to the input vectors.
-    	std::vector<int> ind(size_);
-        for (size_t i = 0; i < size_; ++i) {
-            ind[i] = int(i);
+        // One generator per tree, so that the trees can be built in any order and by any thread
+        std::vector<unsigned int> seeds(trees_);
+        std::mt19937 seed_gen((unsigned int)rand_int());
+        for (int i = 0; i < trees_; ++i) {
+            seeds[i] = seed_gen();
         }
 
-        mean_ = new DistanceType[veclen_];
-        var_ = new DistanceType[veclen_];
-
-        tree_roots_.resize(trees_);
+        tree_nodes_.resize(trees_);
+        tree_bounds_.resize(trees_);
+        computeBoundingBox();
+        if (leaf_max_size_>1) {
+            // Each tree has every point in exactly one leaf, the leaves of tree i take positions [i*size_, (i+1)*size_)
+            vind_.resize(trees_*size_);
+            leaf_points_.resize(trees_*size_*veclen_);
+        }
         /* Construct the randomized trees. */
-        for (int i = 0; i < trees_; i++) {
-            /* Randomize the order of vectors to allow for unbiased sampling. */
-            std::random_shuffle(ind.begin(), ind.end());
-            tree_roots_[i] = divideTree(&ind[0], int(size_) );
-
+#pragma omp parallel
+        {
+            std::vector<int> ind(size_);
+#pragma omp for schedule(dynamic)
+            for (int i = 0; i < trees_; i++) {
+                // Create a permutable array of indices to the input vectors.
+                for (size_t j = 0; j < size_; ++j) {
+                    ind[j] = int(j);
+                }
+                BuildContext context(veclen_, seeds[i]);
+                /* Randomize the order of vectors to allow for unbiased sampling. */
+                std::shuffle(ind.begin(), ind.end(), context.gen_);
+                size_t leaf_pos = i*size_;
+                flattenTree(divideTree(context, &ind[0], int(size_) ), tree_nodes_[i], tree_bounds_[i], leaf_pos);
+            }
         }
-        delete[] mean_;
-        delete[] var_;
     }
 
 	/*Copy from NN_Index*/
@@ -550,11 +606,11 @@ protected:
 
 	void freeIndex()
 	{
-		for (size_t i = 0; i<tree_roots_.size(); ++i) {
-			// using placement new, so call destructor explicitly
-			if (tree_roots_[i] != NULL) tree_roots_[i]->~Node();
-		}
-		pool_.free();
+		tree_nodes_.clear();
+		tree_bounds_.clear();
+		root_bbox_.clear();
+		vind_.clear();
+		leaf_points_.clear();
 	}
 
 	/*---------------------NN_Index Parameters --------------------------*/
@@ -624,10 +680,13 @@ protected:
 private:
 
     /*--------------------- Internal Data Structures --------------------------*/
+    /**
+     * Node of a tree while it is built, before it is flattened
+     */
     struct Node
     {
     	/**
-         * Dimension used for subdivision.
+         * Dimension used for subdivision, or number of points of a leaf.
          */
         int divfeat;
         /**
@@ -635,56 +694,145 @@ private:
          */
         DistanceType divval;
         /**
-         * Point data
+         * Highest value of the first child and lowest value of the second child in the dimension used for subdivision.
          */
-        ElementType* point;
+        DistanceType divlow, divhigh;
         /**
          * The child nodes.
          */
         Node* child1, * child2;
+        /**
+         * Indices of the points of a leaf.
+         */
+        int* ind;
+    };
+    typedef Node* NodePtr;
 
-        ~Node() {
-        	if (child1!=NULL) child1->~Node();
-        	if (child2!=NULL) child2->~Node();
+    /**
+     * Node of a flattened tree, 12 bytes for float distances
+     * The nodes of a tree are stored in one array, the two children of an inner node next to each other
+     * and followed by their subtrees, so that a descent reads a few small nodes close to each other
+     * instead of chasing pointers across the pool.
+     */
+    struct FlatNode
+    {
+        /**
+         * Dimension used for subdivision, or minus the number of points of a leaf.
+         */
+        int divfeat;
+        /**
+         * The values used for subdivision.
+         */
+        DistanceType divval;
+        /**
+         * Offset from this node to its first child (the second one follows it), or position of
+         * the points of a leaf (see leafPoint()).
+         */
+        unsigned int child;
+
+        template<typename Archive>
+        void serialize(Archive& ar)
+        {
+            ar & divfeat;
+            ar & divval;
+            ar & child;
         }
+    };
+    typedef BranchStruct<const FlatNode*, DistanceType> BranchSt;
 
-    private:
-    	template<typename Archive>
-    	void serialize(Archive& ar)
-    	{
-    		typedef KDTreeIndex<Distance> Index;
-    		Index* obj = static_cast<Index*>(ar.getObject());
-
-    		ar & divfeat;
-    		ar & divval;
-
-    		bool leaf_node = false;
-    		if (Archive::is_saving::value) {
-    			leaf_node = ((child1==NULL) && (child2==NULL));
-    		}
-    		ar & leaf_node;
-
-    		if (leaf_node) {
-    			if (Archive::is_loading::value) {
-    				point = obj->points_[divfeat];
-    			}
-    		}
-
-    		if (!leaf_node) {
-				if (Archive::is_loading::value) {
-					child1 = new(obj->pool_) Node();
-					child2 = new(obj->pool_) Node();
-				}
-    			ar & *child1;
-    			ar & *child2;
-    		}
-    	}
-    	friend struct serialization::access;
+    /**
+     * Range of values in one dimension.
+     * For the inner nodes of a tree, kept in an array parallel to its nodes, low is the highest value of the first
+     * child and high the lowest value of the second child in the dimension used for subdivision: with the bounding
+     * box of the dataset, they give the bounding box of every node.
+     */
+    struct Interval
+    {
+        DistanceType low, high;
+
+        template<typename Archive>
+        void serialize(Archive& ar)
+        {
+            ar & low;
+            ar & high;
+        }
+    };
+
+    /**
+     * State of the construction of a tree, or of a subtree built by a separate task
+     */
+    struct BuildContext
+    {
+        BuildContext(size_t veclen, unsigned int seed) : gen_(seed), mean_(veclen), var_(veclen)
+        {
+        }
+
+        /**
+         * Creates the context of a subtree built by a separate task, seeded from this one
+         */
+        BuildContext& spawn()
+        {
+            children_.emplace_back(mean_.size(), (unsigned int)gen_());
+            return children_.back();
+        }
+
+        /** Generator of the shuffle and of the split dimensions */
+        std::mt19937 gen_;
+        /** Scratch of meanSplit */
+        std::vector<DistanceType> mean_;
+        std::vector<DistanceType> var_;
+        /** Allocator of the nodes, which live until the tree is flattened */
+        PooledAllocator pool_;
+        /** Contexts of the subtrees built by separate tasks */
+        std::list<BuildContext> children_;
     };
-    typedef Node* NodePtr;
-    typedef BranchStruct<NodePtr, DistanceType> BranchSt;
     typedef BranchSt* Branch;
 
+public:
+    /**
+     * Scratch memory of a search, so that queries do not allocate
+     * A context can be reused for any number of queries on the index it was created for, with a check
+     * budget and a number of neighbors no larger than the ones it was created for, but only by one thread at a time.
+     */
+    struct SearchContext
+    {
+        /**
+         * Params:
+         *     knn = the number of neighbors the queries ask for, 0 if it is not known
+         */
+        SearchContext(const KDTreeIndex& index, const SearchParams& params, size_t knn = 0) :
+            heap_(index.heapCapacity(params.checks, knn)), checked_(index.size_), dists_(index.veclen_)
+        {
+        }
+
+        /** Branches not taken yet, only the closest ones the check budget can reach being kept */
+        BoundedHeap<BranchSt> heap_;
+        /** Points whose distance to the query was already computed */
+        VisitedSet checked_;
+        /** Distance from the query to the bounding box of the current node in each dimension, for the exact search */
+        std::vector<DistanceType> dists_;
+    };
+
+private:
+    /**
+     * Most branches a search can take from the heap. The search goes on until it has checked maxCheck points
+     * and found knn neighbors, so it checks fewer than max(maxCheck, knn) points before its last branch. Each
+     * branch taken leads to a leaf holding at least one point, which is checked then or was checked from
+     * another tree, and no two branches of a tree lead to the same leaf: the heap does not need more than
+     * max(maxCheck, knn) + 1 branches per tree. This does not hold when knn is not known, nor when points are
+     * removed, as the leaves of removed points are reached without any check: the heap then gets one slot
+     * per point. The exact search does not use the heap.
+     */
+    size_t heapCapacity(int maxCheck, size_t knn) const
+    {
+        if (maxCheck==FLANN_CHECKS_UNLIMITED) return 1;
+        size_t capacity = size_;
+        if (maxCheck >= 0 && knn > 0 && !removed_) {
+            capacity = std::min(capacity, size_t(trees_) * (std::max(size_t(maxCheck), knn) + 1));
+        }
+        return std::max(capacity, size_t(1));
+    }
+
 	/*Copy from NN_Index*/
 	void setDataset(const Matrix<ElementType>& dataset)
 	{
@@ -703,51 +851,131 @@ private:
 		}
 	}//END_SETDATA
 
-	virtual void copyTree(NodePtr& dst, const NodePtr& src)
+    /**
+     * Computes the bounding box of the dataset, from which the exact search starts
+     */
+    void computeBoundingBox()
     {
-    	dst = new(pool_) Node();
-    	dst->divfeat = src->divfeat;
-    	dst->divval = src->divval;
-    	if (src->child1==NULL && src->child2==NULL) {
-    		dst->point = points_[dst->divfeat];
-    		dst->child1 = NULL;
-    		dst->child2 = NULL;
-    	}
-    	else {
-    		copyTree(dst->child1, src->child1);
-    		copyTree(dst->child2, src->child2);
-    	}
+        root_bbox_.resize(veclen_);
+        if (size_==0) return;
+        for (size_t k = 0; k < veclen_; ++k) {
+            root_bbox_[k].low = root_bbox_[k].high = DistanceType(points_[0][k]);
+        }
+        for (size_t i = 1; i < size_; ++i) {
+            for (size_t k = 0; k < veclen_; ++k) {
+                root_bbox_[k].low = std::min(root_bbox_[k].low, DistanceType(points_[i][k]));
+                root_bbox_[k].high = std::max(root_bbox_[k].high, DistanceType(points_[i][k]));
+            }
+        }
+    }
+
+    /**
+     * Flattens a tree, the root first
+     * @param root the root of the tree
+     * @param nodes the nodes of the flattened tree
+     * @param bounds the split bounds of the nodes, in the same order
+     * @param leaf_pos position in vind_ of the points of the first leaf
+     */
+    void flattenTree(NodePtr root, std::vector<FlatNode>& nodes, std::vector<Interval>& bounds, size_t& leaf_pos)
+    {
+        nodes.clear();
+        nodes.reserve(2*size_/leaf_max_size_);
+        nodes.resize(1);
+        bounds.clear();
+        bounds.reserve(nodes.capacity());
+        bounds.resize(1);
+        flattenNode(root, 0, nodes, bounds, leaf_pos);
+    }
+
+    /**
+     * Writes a node at a given position and lays its subtree out in depth-first order: the two children
+     * are appended next to each other, followed by the subtree of the first child, then by the one of the second.
+     * The points of the leaves are written to vind_ and leaf_points_ in the same order, from leaf_pos.
+     */
+    void flattenNode(NodePtr node, size_t pos, std::vector<FlatNode>& nodes, std::vector<Interval>& bounds, size_t& leaf_pos)
+    {
+        if ((node->child1==NULL) && (node->child2==NULL)) {
+            nodes[pos].divfeat = -node->divfeat;
+            nodes[pos].divval = 0;
+            bounds[pos].low = bounds[pos].high = 0;
+            if (leaf_max_size_>1) {
+                nodes[pos].child = (unsigned int)leaf_pos;
+                for (int i = 0; i < node->divfeat; ++i, ++leaf_pos) {
+                    vind_[leaf_pos] = node->ind[i];
+                    std::copy(points_[node->ind[i]], points_[node->ind[i]]+veclen_, &leaf_points_[leaf_pos*veclen_]);
+                }
+            }
+            else {
+                nodes[pos].child = *node->ind;
+            }
+        }
+        else {
+            size_t first = nodes.size();
+            nodes.resize(first+2);
+            bounds.resize(first+2);
+            nodes[pos].divfeat = node->divfeat;
+            nodes[pos].divval = node->divval;
+            nodes[pos].child = (unsigned int)(first - pos);
+            bounds[pos].low = node->divlow;
+            bounds[pos].high = node->divhigh;
+            flattenNode(node->child1, first, nodes, bounds, leaf_pos);
+            flattenNode(node->child2, first+1, nodes, bounds, leaf_pos);
+        }
     }
 
     /**
      * Create a tree node that subdivides the list of vecs from vind[first]
      * to vind[last].  The routine is called recursively on each sublist.
      * Place a pointer to this new tree node in the location pTree.
+     * Above TASK_MIN_SIZE vecs, the first sublist is divided by a separate task.
      *
      * Params: pTree = the new node to create
      *                  first = index of the first vector
      *                  last = index of the last vector
      */
-    NodePtr divideTree(int* ind, int count)
+    NodePtr divideTree(BuildContext& context, int* ind, int count)
     {
-        NodePtr node = new(pool_) Node(); // allocate memory
+        NodePtr node = new(context.pool_) Node(); // allocate memory
 
         /* If too few exemplars remain, then make this a leaf node. */
-        if (count == 1) {
+        if (count <= leaf_max_size_) {
             node->child1 = node->child2 = NULL;    /* Mark as leaf node. */
-            node->divfeat = *ind;    /* Store index of this vec. */
-            node->point = points_[*ind];
+            node->divfeat = count;    /* Store the indices of the vecs. */
+            node->ind = ind;
         }
         else {
             int idx;
             int cutfeat;
             DistanceType cutval;
-            meanSplit(ind, count, idx, cutfeat, cutval);
+            meanSplit(context, ind, count, idx, cutfeat, cutval);
 
             node->divfeat = cutfeat;
             node->divval = cutval;
-            node->child1 = divideTree(ind, idx);
-            node->child2 = divideTree(ind+idx, count-idx);
+            // The split may separate equal values, so the bounds of the children are not derived from cutval
+            node->divlow = DistanceType(points_[ind[0]][cutfeat]);
+            for (int i = 1; i < idx; ++i) {
+                node->divlow = std::max(node->divlow, DistanceType(points_[ind[i]][cutfeat]));
+            }
+            node->divhigh = DistanceType(points_[ind[idx]][cutfeat]);
+            for (int i = idx+1; i < count; ++i) {
+                node->divhigh = std::min(node->divhigh, DistanceType(points_[ind[i]][cutfeat]));
+            }
+            if (count < TASK_MIN_SIZE) {
+                node->child1 = divideTree(context, ind, idx);
+                node->child2 = divideTree(context, ind+idx, count-idx);
+            }
+            else {
+                // The context is spawned even without tasks, so that the trees do not depend on the OpenMP version
+                BuildContext* child_context = &context.spawn();
+#if defined(_OPENMP) && _OPENMP >= 200805
+#pragma omp task
+#endif
+                node->child1 = divideTree(*child_context, ind, idx);
+                node->child2 = divideTree(context, ind+idx, count-idx);
+#if defined(_OPENMP) && _OPENMP >= 200805
+#pragma omp taskwait
+#endif
+            }
         }
 
         return node;
@@ -759,37 +987,41 @@ private:
      * Make a random choice among those with the highest variance, and use
      * its variance as the threshold value.
      */
-    void meanSplit(int* ind, int count, int& index, int& cutfeat, DistanceType& cutval)
+    void meanSplit(BuildContext& context, int* ind, int count, int& index, int& cutfeat, DistanceType& cutval)
     {
-        memset(mean_,0,veclen_*sizeof(DistanceType));
-        memset(var_,0,veclen_*sizeof(DistanceType));
+        DistanceType* mean = &context.mean_[0];
+        DistanceType* var = &context.var_[0];
+        std::fill(mean, mean+veclen_, DistanceType(0));
+        std::fill(var, var+veclen_, DistanceType(0));
 
         /* Compute mean values.  Only the first SAMPLE_MEAN values need to be
             sampled to get a good estimate.
+            The loops over the dimensions have no dependency between iterations,
+            so that compilers vectorize them.
          */
         int cnt = std::min((int)SAMPLE_MEAN+1, count);
         for (int j = 0; j < cnt; ++j) {
-            ElementType* v = points_[ind[j]];
+            const ElementType* v = points_[ind[j]];
             for (size_t k=0; k<veclen_; ++k) {
-                mean_[k] += v[k];
+                mean[k] += v[k];
             }
         }
         DistanceType div_factor = DistanceType(1)/cnt;
         for (size_t k=0; k<veclen_; ++k) {
-            mean_[k] *= div_factor;
+            mean[k] *= div_factor;
         }
 
         /* Compute variances (no need to divide by count). */
         for (int j = 0; j < cnt; ++j) {
-            ElementType* v = points_[ind[j]];
+            const ElementType* v = points_[ind[j]];
             for (size_t k=0; k<veclen_; ++k) {
-                DistanceType dist = v[k] - mean_[k];
-                var_[k] += dist * dist;
+                DistanceType dist = v[k] - mean[k];
+                var[k] += dist * dist;
             }
         }
         /* Select one of the highest variance indices at random. */
-        cutfeat = selectDivision(var_);
-        cutval = mean_[cutfeat];
+        cutfeat = selectDivision(context, var);
+        cutval = mean[cutfeat];
 
         int lim1, lim2;
         planeSplit(ind, count, cutfeat, cutval, lim1, lim2);
@@ -809,7 +1041,7 @@ private:
      * Select the top RAND_DIM largest values from v and return the index of
      * one of these selected at random.
      */
-    int selectDivision(DistanceType* v)
+    int selectDivision(BuildContext& context, DistanceType* v)
     {
         int num = 0;
         size_t topind[RAND_DIM];
@@ -833,7 +1065,7 @@ private:
             }
         }
         /* Select a random integer in range [0,num-1], and return that index. */
-        int rnd = rand_int(num);
+        int rnd = std::uniform_int_distribution<int>(0, num-1)(context.gen_);
         return (int)topind[rnd];
     }
 
@@ -870,20 +1102,29 @@ private:
     }
 
     /**
-     * Performs an exact nearest neighbor search. The exact search performs a full
-     * traversal of the tree.
+     * Performs an exact nearest neighbor search. The exact search traverses the first tree, skipping
+     * the nodes whose bounding box is farther than the current worst neighbor. The other trees are
+     * only descended once, so that the points of their leaves give a first bound for the pruning.
      */
     template<bool with_removed>
-    void getExactNeighbors(ResultSet<DistanceType>& result, const ElementType* vec, float epsError) const
+    void getExactNeighbors(ResultSet<DistanceType>& result, const ElementType* vec, float epsError,
+                           SearchContext& context) const
     {
-        //		checkID -= 1;  /* Set a different unique ID for each search. */
+        if (trees_==0 || size_==0) return;
+        context.checked_.clear();
 
-        if (trees_ > 1) {
-            fprintf(stderr,"It doesn't make any sense to use more than one tree for exact search");
-        }
-        if (trees_>0) {
-            searchLevelExact<with_removed>(result, vec, tree_roots_[0], 0.0, epsError);
+        for (int i = 1; i < trees_; ++i) {
+            const FlatNode* node = &tree_nodes_[i][0];
+            while (node->divfeat >= 0) {
+                node += node->child + ((vec[node->divfeat]<node->divval) ? 0 : 1);
+            }
+            checkLeafExact<with_removed>(result, vec, node, context);
         }
+
+        DistanceType* dists = &context.dists_[0];
+        DistanceType mindist = computeInitialDistances(vec, dists);
+        searchLevelExact<with_removed>(result, vec, &tree_nodes_[0][0], &tree_bounds_[0][0], 0, mindist, dists,
+                                       epsError, context);
     }
 
     /**
@@ -892,186 +1133,276 @@ private:
      * the tree.
      */
     template<bool with_removed>
-    void getNeighbors(ResultSet<DistanceType>& result, const ElementType* vec, int maxCheck, float epsError) const
+    void getNeighbors(ResultSet<DistanceType>& result, const ElementType* vec, int maxCheck, float epsError,
+                      SearchContext& context) const
     {
         int i;
         BranchSt branch;
 
         int checkCount = 0;
-        Heap<BranchSt>* heap = new Heap<BranchSt>((int)size_);
-        DynamicBitset checked(size_);
+        context.heap_.clear();
+        context.checked_.clear();
 
         /* Search once through each tree down to root. */
         for (i = 0; i < trees_; ++i) {
-            searchLevel<with_removed>(result, vec, tree_roots_[i], 0, checkCount, maxCheck, epsError, heap, checked);
+            searchLevel<with_removed>(result, vec, &tree_nodes_[i][0], 0, checkCount, maxCheck, epsError, context);
         }
 
         /* Keep searching other branches from heap until finished. */
-        while ( heap->popMin(branch) && (checkCount < maxCheck || !result.full() )) {
-            searchLevel<with_removed>(result, vec, branch.node, branch.mindist, checkCount, maxCheck, epsError, heap, checked);
+        while ( context.heap_.popMin(branch) && (checkCount < maxCheck || !result.full() )) {
+            searchLevel<with_removed>(result, vec, branch.node, branch.mindist, checkCount, maxCheck, epsError, context);
         }
-
-        delete heap;
-
     }
 
     /**
      *  Search starting from a given node of the tree.  Based on any mismatches at
      *  higher levels, all exemplars below this level must have a distance of
      *  at least "mindistsq".
+     *  The descent is iterative, the children of the next node being prefetched while
+     *  the current one is processed.
      */
     template<bool with_removed>
-    void searchLevel(ResultSet<DistanceType>& result_set, const ElementType* vec, NodePtr node, DistanceType mindist, int& checkCount, int maxCheck,
-                     float epsError, Heap<BranchSt>* heap, DynamicBitset& checked) const
+    void searchLevel(ResultSet<DistanceType>& result_set, const ElementType* vec, const FlatNode* node, DistanceType mindist, int& checkCount, int maxCheck,
+                     float epsError, SearchContext& context) const
     {
         if (result_set.worstDist()<mindist) {
             //			printf("Ignoring branch, too far\n");
             return;
         }
 
-        /* If this is a leaf node, then do check and return. */
-        if ((node->child1 == NULL)&&(node->child2 == NULL)) {
+        while (node->divfeat >= 0) {
+            /* Which child branch should be taken first? */
+            ElementType val = vec[node->divfeat];
+            DistanceType diff = val - node->divval;
+            const FlatNode* bestChild = node + node->child + ((diff < 0) ? 0 : 1);
+            const FlatNode* otherChild = node + node->child + ((diff < 0) ? 1 : 0);
+            if (bestChild->divfeat >= 0) FLANN_PREFETCH(bestChild + bestChild->child);
+
+            /* Create a branch record for the branch not taken.  Add distance
+                of this feature boundary (we don't attempt to correct for any
+                use of this feature in a parent node, which is unlikely to
+                happen and would have only a small effect).  Don't bother
+                adding more branches to heap after halfway point, as cost of
+                adding exceeds their value.
+             */
+
+            DistanceType new_distsq = mindist + distance_.accum_dist(val, node->divval, node->divfeat);
+            //		if (2 * checkCount < maxCheck  ||  !result.full()) {
+            if ((new_distsq*epsError < result_set.worstDist())||  !result_set.full()) {
+                context.heap_.insert( BranchSt(otherChild, new_distsq) );
+            }
 
-            int index = node->divfeat;
+            /* Search next level down. */
+            node = bestChild;
+        }
+
+        /* This is a leaf node, check its points and return. */
+        if ((checkCount>=maxCheck)&& result_set.full()) return;
+        size_t first = node->child;
+        size_t last = first - node->divfeat;
+        for (size_t i = first; i < last; ++i) {
+            int index = pointIndex(i);
             if (with_removed) {
-            	if (removed_points_.test(index)) return;
+            	if (removed_points_.test(index)) continue;
             }
             /*  Do not check same node more than once when searching multiple trees. */
-            if ( checked.test(index) || ((checkCount>=maxCheck)&& result_set.full()) ) return;
-            checked.set(index);
+            if (context.checked_.test(index)) continue;
+            context.checked_.set(index);
             checkCount++;
 
 			time_t time_begin = clock();
-            DistanceType dist = distance_(node->point, vec, veclen_);
+            DistanceType dist = distance_(leafPoint(i), vec, veclen_);
 			time_t time_end = clock();
 			flann::distance_cal_time += time_end - time_begin;
 			count_calculate_distance_++;
 
             result_set.addPoint(dist,index);
-            return;
         }
+    }
 
-        /* Which child branch should be taken first? */
-        ElementType val = vec[node->divfeat];
-        DistanceType diff = val - node->divval;
-        NodePtr bestChild = (diff < 0) ? node->child1 : node->child2;
-        NodePtr otherChild = (diff < 0) ? node->child2 : node->child1;
-
-        /* Create a branch record for the branch not taken.  Add distance
-            of this feature boundary (we don't attempt to correct for any
-            use of this feature in a parent node, which is unlikely to
-            happen and would have only a small effect).  Don't bother
-            adding more branches to heap after halfway point, as cost of
-            adding exceeds their value.
-         */
+    /**
+     * Returns the index of the point at a given position of a leaf: a position in vind_ when
+     * the leaves have several points, the index itself otherwise.
+     */
+    inline int pointIndex(size_t pos) const
+    {
+        return (leaf_max_size_>1) ? vind_[pos] : int(pos);
+    }
 
-        DistanceType new_distsq = mindist + distance_.accum_dist(val, node->divval, node->divfeat);
-        //		if (2 * checkCount < maxCheck  ||  !result.full()) {
-        if ((new_distsq*epsError < result_set.worstDist())||  !result_set.full()) {
-            heap->insert( BranchSt(otherChild, new_distsq) );
-        }
+    /**
+     * Returns the point at a given position of a leaf, read from the copy of the leaf points
+     * when the leaves have several points.
+     */
+    inline const ElementType* leafPoint(size_t pos) const
+    {
+        return (leaf_max_size_>1) ? &leaf_points_[pos*veclen_] : points_[pos];
+    }
 
-        /* Call recursively to search next level down. */
-        searchLevel<with_removed>(result_set, vec, bestChild, mindist, checkCount, maxCheck, epsError, heap, checked);
+    /**
+     * Computes the distance from a query to the bounding box of the dataset, and the
+     * contribution of each dimension to it.
+     */
+    DistanceType computeInitialDistances(const ElementType* vec, DistanceType* dists) const
+    {
+        DistanceType distsq = 0;
+        for (size_t i = 0; i < veclen_; ++i) {
+            dists[i] = 0;
+            if (vec[i] < root_bbox_[i].low) {
+                dists[i] = distance_.accum_dist(vec[i], root_bbox_[i].low, (int)i);
+            }
+            else if (vec[i] > root_bbox_[i].high) {
+                dists[i] = distance_.accum_dist(vec[i], root_bbox_[i].high, (int)i);
+            }
+            distsq += dists[i];
+        }
+        return distsq;
     }
 
     /**
-     * Performs an exact search in the tree starting from a node.
+     * Adds the points of a leaf to the result set, skipping the points already checked.
      */
     template<bool with_removed>
-    void searchLevelExact(ResultSet<DistanceType>& result_set, const ElementType* vec, const NodePtr node, DistanceType mindist, const float epsError) const
+    void checkLeafExact(ResultSet<DistanceType>& result_set, const ElementType* vec, const FlatNode* node,
+                        SearchContext& context) const
     {
-        /* If this is a leaf node, then do check and return. */
-        if ((node->child1 == NULL)&&(node->child2 == NULL)) {
-            int index = node->divfeat;
+        size_t first = node->child;
+        size_t last = first - node->divfeat;
+        for (size_t i = first; i < last; ++i) {
+            int index = pointIndex(i);
             if (with_removed) {
-            	if (removed_points_.test(index)) return; // ignore removed points
+            	if (removed_points_.test(index)) continue; // ignore removed points
             }
+            if (context.checked_.test(index)) continue;
+            context.checked_.set(index);
 
-            DistanceType dist = distance_(node->point, vec, veclen_);
-			throw;
+            DistanceType dist = distance_(leafPoint(i), vec, veclen_);
             result_set.addPoint(dist,index);
+        }
+    }
+
+    /**
+     * Performs an exact search in the tree starting from a node.
+     * mindist is the distance from the query to the bounding box of the node and dists[i] the contribution
+     * of dimension i to it. Only the dimension used for subdivision changes between a node and its children,
+     * so the distance to the box of the farther child is updated in constant time (Arya and Mount).
+     */
+    template<bool with_removed>
+    void searchLevelExact(ResultSet<DistanceType>& result_set, const ElementType* vec, const FlatNode* nodes,
+                          const Interval* bounds, size_t pos, DistanceType mindist, DistanceType* dists,
+                          const float epsError, SearchContext& context) const
+    {
+        const FlatNode* node = nodes + pos;
 
+        /* If this is a leaf node, then do check and return. */
+        if (node->divfeat < 0) {
+            checkLeafExact<with_removed>(result_set, vec, node, context);
             return;
         }
 
-        /* Which child branch should be taken first? */
-        ElementType val = vec[node->divfeat];
-        DistanceType diff = val - node->divval;
-        NodePtr bestChild = (diff < 0) ? node->child1 : node->child2;
-        NodePtr otherChild = (diff < 0) ? node->child2 : node->child1;
-
-        /* Create a branch record for the branch not taken.  Add distance
-            of this feature boundary (we don't attempt to correct for any
-            use of this feature in a parent node, which is unlikely to
-            happen and would have only a small effect).  Don't bother
-            adding more branches to heap after halfway point, as cost of
-            adding exceeds their value.
+        /* Which child branch should be taken first? The one whose box is closer in the
+            dimension used for subdivision, the query being possibly inside both boxes
+            when the split separated equal values.
          */
-
-        DistanceType new_distsq = mindist + distance_.accum_dist(val, node->divval, node->divfeat);
+        int idx = node->divfeat;
+        ElementType val = vec[idx];
+        DistanceType cut1 = (val > bounds[pos].low) ? distance_.accum_dist(val, bounds[pos].low, idx) : 0;
+        DistanceType cut2 = (val < bounds[pos].high) ? distance_.accum_dist(val, bounds[pos].high, idx) : 0;
+        size_t bestChild = pos + node->child;
+        size_t otherChild = bestChild + 1;
+        DistanceType cut_dist = cut2;
+        if ((cut2 < cut1) || ((cut2 == cut1) && (val >= node->divval))) {
+            std::swap(bestChild, otherChild);
+            cut_dist = cut1;
+        }
 
         /* Call recursively to search next level down. */
-        searchLevelExact<with_removed>(result_set, vec, bestChild, mindist, epsError);
+        searchLevelExact<with_removed>(result_set, vec, nodes, bounds, bestChild, mindist, dists, epsError, context);
 
+        /* The box of the other child is within the box of this node, so it is at least as far in this dimension. */
+        DistanceType dst = dists[idx];
+        if (cut_dist > dst) {
+            mindist = mindist + cut_dist - dst;
+            dists[idx] = cut_dist;
+        }
         if (mindist*epsError<=result_set.worstDist()) {
-            searchLevelExact<with_removed>(result_set, vec, otherChild, new_distsq, epsError);
+            searchLevelExact<with_removed>(result_set, vec, nodes, bounds, otherChild, mindist, dists, epsError, context);
         }
+        dists[idx] = dst;
     }
-    
-    void addPointToTree(NodePtr node, int ind)
+
+    /**
+     * Adds a point to a flattened tree: the leaf it falls in is rebuilt with the new point, at the end of
+     * the tree and of vind_, and split if it gets more than leaf_max_size_ points. The split bounds of the
+     * nodes above the leaf are widened to contain the point.
+     */
+    void addPointToTree(BuildContext& context, std::vector<FlatNode>& nodes, std::vector<Interval>& bounds, int ind)
     {
         ElementType* point = points_[ind];
-        
-        if ((node->child1==NULL) && (node->child2==NULL)) {
-            ElementType* leaf_point = node->point;
-            ElementType max_span = 0;
-            size_t div_feat = 0;
-            for (size_t i=0;i<veclen_;++i) {
-                ElementType span = abs(point[i]-leaf_point[i]);
-                if (span > max_span) {
-                    max_span = span;
-                    div_feat = i;
-                }
-            }
-            NodePtr left = new(pool_) Node();
-            left->child1 = left->child2 = NULL;
-            NodePtr right = new(pool_) Node();
-            right->child1 = right->child2 = NULL;
-
-            if (point[div_feat]<leaf_point[div_feat]) {
-                left->divfeat = ind;
-                left->point = point;
-                right->divfeat = node->divfeat;
-                right->point = node->point;
+
+        size_t node = 0;
+        while (nodes[node].divfeat >= 0) {
+            DistanceType val = DistanceType(point[nodes[node].divfeat]);
+            if (val<nodes[node].divval) {
+                bounds[node].low = std::max(bounds[node].low, val);
+                node += nodes[node].child;
             }
             else {
-                left->divfeat = node->divfeat;
-                left->point = node->point;
-                right->divfeat = ind;
-                right->point = point;
+                bounds[node].high = std::min(bounds[node].high, val);
+                node += nodes[node].child + 1;
             }
-            node->divfeat = div_feat;
-            node->divval = (point[div_feat]+leaf_point[div_feat])/2;
-            node->child1 = left;
-            node->child2 = right;            
         }
-        else {
-            if (point[node->divfeat]<node->divval) {
-                addPointToTree(node->child1,ind);
-            }
-            else {
-                addPointToTree(node->child2,ind);                
+
+        std::vector<int> leaf_ind;
+        for (size_t i = nodes[node].child; i < nodes[node].child-nodes[node].divfeat; ++i) {
+            leaf_ind.push_back(pointIndex(i));
+        }
+        leaf_ind.push_back(ind);
+        size_t leaf_pos = vind_.size();
+        if (leaf_max_size_>1) {
+            vind_.resize(leaf_pos+leaf_ind.size());
+            leaf_points_.resize(vind_.size()*veclen_);
+        }
+        flattenNode(divideTree(context, &leaf_ind[0], int(leaf_ind.size())), node, nodes, bounds, leaf_pos);
+        context.pool_.free();
+        context.children_.clear();
+    }
+
+    /**
+     * Moves the points of the leaves of all the trees to consecutive positions of vind_ and leaf_points_,
+     * dropping the copies of the leaves rebuilt by addPointToTree.
+     */
+    void compactLeaves()
+    {
+        std::vector<int> vind;
+        std::vector<ElementType> leaf_points;
+        vind.reserve(trees_*size_);
+        leaf_points.reserve(trees_*size_*veclen_);
+        for (int i = 0; i < trees_; ++i) {
+            std::vector<FlatNode>& nodes = tree_nodes_[i];
+            for (size_t j = 0; j < nodes.size(); ++j) {
+                if (nodes[j].divfeat >= 0) continue;
+                size_t first = nodes[j].child;
+                size_t count = size_t(-nodes[j].divfeat);
+                nodes[j].child = (unsigned int)vind.size();
+                vind.insert(vind.end(), vind_.begin()+first, vind_.begin()+first+count);
+                leaf_points.insert(leaf_points.end(), leaf_points_.begin()+first*veclen_,
+                                   leaf_points_.begin()+(first+count)*veclen_);
             }
         }
+        vind_.swap(vind);
+        leaf_points_.swap(leaf_points);
     }
 private:
     void swap(KDTreeIndex& other)
     {
     	BaseClass::swap(other);
     	std::swap(trees_, other.trees_);
-    	std::swap(tree_roots_, other.tree_roots_);
-    	std::swap(pool_, other.pool_);
+    	std::swap(leaf_max_size_, other.leaf_max_size_);
+    	std::swap(tree_nodes_, other.tree_nodes_);
+    	std::swap(tree_bounds_, other.tree_bounds_);
+    	std::swap(root_bbox_, other.root_bbox_);
+    	std::swap(vind_, other.vind_);
+    	std::swap(leaf_points_, other.leaf_points_);
     }
 
 private:
@@ -1084,6 +1415,10 @@ private:
          * A value of 100 seems to perform as well as using all values.
          */
         SAMPLE_MEAN = 100,
+        /**
+         * Subtrees of at least TASK_MIN_SIZE points are built by separate tasks
+         */
+        TASK_MIN_SIZE = 10000,
         /**
          * Top random dimensions to consider
          *
@@ -1100,22 +1435,38 @@ private:
      */
     int trees_;
 
-    DistanceType* mean_;
-    DistanceType* var_;
+    /**
+     * Maximum number of points in a leaf
+     */
+    int leaf_max_size_;
 
     /**
-     * Array of k-d trees used to find neighbours.
+     * Array of flattened k-d trees used to find neighbours.
      */
-    std::vector<NodePtr> tree_roots_;
+    std::vector<std::vector<FlatNode> > tree_nodes_;
 
     /**
-     * Pooled memory allocator.
-     *
-     * Using a pooled memory allocator is more efficient
-     * than allocating memory directly when there is a large
-     * number small of memory allocations.
+     * Split bounds of the nodes of each tree, in the order of tree_nodes_. Used by the exact search.
+     */
+    std::vector<std::vector<Interval> > tree_bounds_;
+
+    /**
+     * Bounding box of the dataset
+     */
+    std::vector<Interval> root_bbox_;
+
+    /**
+     * Indices of the points of the leaves, in the order of the leaves of all the trees.
+     * Only used when leaf_max_size_ is above 1. Points added to the index leave the previous
+     * copy of their leaf behind, until compactLeaves() drops them.
+     */
+    std::vector<int> vind_;
+
+    /**
+     * Copy of the points in the order of vind_, so that the points of a leaf are scanned
+     * contiguously. Only used when leaf_max_size_ is above 1.
      */
-    PooledAllocator pool_;
+    std::vector<ElementType> leaf_points_;
 
     //USING_BASECLASS_SYMBOLS
 };  
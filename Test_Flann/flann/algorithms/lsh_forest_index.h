@@ -0,0 +1,639 @@
+/***********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ * Copyright 2008-2009  Marius Muja (mariusm@cs.ubc.ca). All rights reserved.
+ * Copyright 2008-2009  David G. Lowe (lowe@cs.ubc.ca). All rights reserved.
+ *
+ * THE BSD LICENSE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *************************************************************************/
+
+#ifndef FLANN_LSH_FOREST_INDEX_H_
+#define FLANN_LSH_FOREST_INDEX_H_
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "flann/general.h"
+#include "flann/util/matrix.h"
+#include "flann/util/result_set.h"
+#include "flann/util/lsh_table.h"
+#include "flann/util/lsh_projection.h"
+#include "flann/util/lsh_prefix_tree.h"
+#include "flann/util/visited_set.h"
+#include "flann/util/context_pool.h"
+#include "flann/util/saving.h"
+
+namespace flann
+{
+
+struct LshForestIndexParams : public IndexParams
+{
+    LshForestIndexParams(unsigned int tree_number = 10, unsigned int max_depth = 16, float bucket_width = 1000,
+                         unsigned int candidates = 0, int random_seed = -1)
+    {
+        (*this)["algorithm"] = FLANN_INDEX_LSH_FOREST;
+        // The number of prefix trees
+        (*this)["tree_number"] = tree_number;
+        // The number of components of the labels, the depth of the trees (at most 64)
+        (*this)["max_depth"] = max_depth;
+        // Width W of the buckets of the hash functions
+        (*this)["bucket_width"] = bucket_width;
+        // Candidates after which a query stops walking up the trees (0 for 10 per tree)
+        (*this)["candidates"] = candidates;
+        // Seed of the random hash functions (-1 to draw one)
+        (*this)["random_seed"] = random_seed;
+    }
+};
+
+
+/**
+ * LSH Forest index (Bawa et al.)
+ *
+ * Instead of hashing the points with keys of a fixed size, each tree sorts them by the variable-length
+ * prefixes of their labels. A query descends every tree to the longest prefix it shares with a point,
+ * then all the trees are walked up in sync, one level at a time, until the query has enough candidates.
+ * The key size then adapts to the density around each query.
+ */
+template<typename Distance>
+class LshForestIndex
+{
+public:
+    typedef typename Distance::ElementType ElementType;
+    typedef typename Distance::ResultType DistanceType;
+
+    /**
+     * Scratch memory of a search, so that queries do not allocate
+     * A context can be reused for any number of queries on the index it was created for,
+     * but only by one thread at a time.
+     */
+    struct SearchContext
+    {
+        SearchContext(const LshForestIndex& index) :
+            projections_(index.projections_.size()), labels_(index.tree_number_), depths_(index.tree_number_),
+            first_(index.tree_number_), last_(index.tree_number_), checked_(index.size_)
+        {
+        }
+
+        /** Projections of the query on the functions of all the trees */
+        std::vector<float> projections_;
+        /** Label of the query in each tree, and the depth it reaches there */
+        std::vector<lsh::BucketKey> labels_;
+        std::vector<unsigned int> depths_;
+        /** Range of the points of each tree already compared to the query */
+        std::vector<size_t> first_;
+        std::vector<size_t> last_;
+        /** Points whose distance to the query was already computed */
+        VisitedSet checked_;
+        /** Number of distances computed for the query, and the most that can be */
+        size_t checks_;
+        size_t max_checks_;
+    };
+
+    /** Constructor
+     * @param params parameters passed to the LSH Forest algorithm
+     * @param d the distance used
+     */
+    LshForestIndex(const IndexParams& params = LshForestIndexParams(), Distance d = Distance()) :
+		distance_(d), last_id_(0), size_(0), size_at_build_(0), veclen_(0),
+		index_params_(params), removed_(false), removed_count_(0), data_ptr_(NULL)
+    {
+        tree_number_ = get_param<unsigned int>(index_params_,"tree_number",10);
+        max_depth_ = get_param<unsigned int>(index_params_,"max_depth",16);
+        bucket_width_ = get_param<float>(index_params_,"bucket_width",1000);
+        candidates_ = get_param<unsigned int>(index_params_,"candidates",0);
+        random_seed_ = get_param<int>(index_params_,"random_seed",-1);
+    }
+
+
+    /** Constructor
+     * @param input_data dataset with the input features
+     * @param params parameters passed to the LSH Forest algorithm
+     * @param d the distance used
+     */
+    LshForestIndex(const Matrix<ElementType>& input_data, const IndexParams& params = LshForestIndexParams(), Distance d = Distance()) :
+		distance_(d), last_id_(0), size_(0), size_at_build_(0), veclen_(0),
+		index_params_(params), removed_(false), removed_count_(0), data_ptr_(NULL)
+    {
+        tree_number_ = get_param<unsigned int>(index_params_,"tree_number",10);
+        max_depth_ = get_param<unsigned int>(index_params_,"max_depth",16);
+        bucket_width_ = get_param<float>(index_params_,"bucket_width",1000);
+        candidates_ = get_param<unsigned int>(index_params_,"candidates",0);
+        random_seed_ = get_param<int>(index_params_,"random_seed",-1);
+
+        setDataset(input_data);
+    }
+
+    LshForestIndex(const LshForestIndex& other) :
+		distance_(other.distance_), last_id_(other.last_id_), size_(other.size_), size_at_build_(other.size_at_build_),
+		veclen_(other.veclen_), index_params_(other.index_params_), removed_(other.removed_),
+		removed_points_(other.removed_points_), removed_count_(other.removed_count_), ids_(other.ids_),
+		points_(other.points_), data_ptr_(NULL),
+    	trees_(other.trees_),
+    	projections_(other.projections_),
+    	tree_number_(other.tree_number_),
+    	max_depth_(other.max_depth_),
+    	bucket_width_(other.bucket_width_),
+    	candidates_(other.candidates_),
+    	random_seed_(other.random_seed_)
+    {
+    }
+
+    LshForestIndex& operator=(LshForestIndex other)
+    {
+    	this->swap(other);
+    	return *this;
+    }
+
+    virtual ~LshForestIndex()
+    {
+    	freeIndex();
+    }
+
+	LshForestIndex* clone() const
+    {
+    	return new LshForestIndex(*this);
+    }
+
+	/*Copy from NN_Index*/
+	void buildIndex()
+	{
+		freeIndex();
+
+		cleanRemovedPoints();
+
+		buildIndexImpl();
+
+		size_at_build_ = size_;
+	}
+
+    flann_algorithm_t getType() const
+    {
+        return FLANN_INDEX_LSH_FOREST;
+    }
+
+    template<typename Archive>
+    void serialize(Archive& ar)
+    {
+    	ar.setObject(this);
+
+    	ar & tree_number_;
+    	ar & max_depth_;
+    	ar & bucket_width_;
+    	ar & candidates_;
+    	ar & random_seed_;
+
+    	ar & projections_;
+    	ar & trees_;
+
+    	if (Archive::is_loading::value) {
+            index_params_["algorithm"] = getType();
+            index_params_["tree_number"] = tree_number_;
+            index_params_["max_depth"] = max_depth_;
+            index_params_["bucket_width"] = bucket_width_;
+            index_params_["candidates"] = candidates_;
+            index_params_["random_seed"] = random_seed_;
+    	}
+    }
+
+    void saveIndex(FILE* stream)
+    {
+    	serialization::SaveArchive sa(stream);
+    	sa & *this;
+    }
+
+    void loadIndex(FILE* stream)
+    {
+    	freeIndex();
+    	serialization::LoadArchive la(stream);
+    	la & *this;
+    }
+
+    /**
+     * Computes the index memory usage
+     * Returns: memory used by the index
+     */
+    int usedMemory() const
+    {
+        return int(tree_number_ * size_ * (sizeof(lsh::BucketKey) + sizeof(lsh::FeatureIndex)) +
+                   projections_.size() * veclen_ * sizeof(float));
+    }
+
+	/*inline function copy from NN_Index*/
+	inline size_t veclen() const
+	{
+		return veclen_;
+	}
+
+	/*copy from NN_Index*/
+	IndexParams getParameters() const
+	{
+		return index_params_;
+	}
+
+    /**
+     * \brief Perform k-nearest neighbor search
+     * \param[in] queries The query points for which to find the nearest neighbors
+     * \param[out] indices The indices of the nearest neighbors found
+     * \param[out] dists Distances to the nearest neighbors found
+     * \param[in] knn Number of nearest neighbors to return
+     * \param[in] params Search parameters
+     */
+    int knnSearch(const Matrix<ElementType>& queries,
+						Matrix<size_t>& indices,
+    					Matrix<DistanceType>& dists,
+    					size_t knn,
+    					const SearchParams& params) const
+    {
+        assert(queries.cols == veclen_);
+        assert(indices.rows >= queries.rows);
+        assert(dists.rows >= queries.rows);
+        assert(indices.cols >= knn);
+        assert(dists.cols >= knn);
+
+        int count = 0;
+        if (params.use_heap==FLANN_True) {
+#pragma omp parallel num_threads(params.cores)
+        	{
+        		KNNResultSet2<DistanceType> resultSet(knn);
+        		PooledContext<SearchContext, LshForestIndex> context(contexts_, *this);
+#pragma omp for schedule(static) reduction(+:count)
+        		for (int i = 0; i < (int)queries.rows; i++) {
+        			resultSet.clear();
+        			findNeighbors(resultSet, queries[i], params, context.get());
+        			size_t n = std::min(resultSet.size(), knn);
+        			resultSet.copy(indices[i], dists[i], n, params.sorted);
+        			indices_to_ids(indices[i], indices[i], n);
+        			count += n;
+        		}
+        	}
+        }
+        else {
+#pragma omp parallel num_threads(params.cores)
+        	{
+        		KNNSimpleResultSet<DistanceType> resultSet(knn);
+        		PooledContext<SearchContext, LshForestIndex> context(contexts_, *this);
+#pragma omp for schedule(static) reduction(+:count)
+        		for (int i = 0; i < (int)queries.rows; i++) {
+        			resultSet.clear();
+        			findNeighbors(resultSet, queries[i], params, context.get());
+        			size_t n = std::min(resultSet.size(), knn);
+        			resultSet.copy(indices[i], dists[i], n, params.sorted);
+        			indices_to_ids(indices[i], indices[i], n);
+        			count += n;
+        		}
+        	}
+        }
+
+        return count;
+    }
+
+	/*Copy from above for size_t to int*/
+	int knnSearch(const Matrix<ElementType>& queries,
+		Matrix<int>& indices,
+		Matrix<DistanceType>& dists,
+		size_t knn,
+		const SearchParams& params) const
+	{
+		flann::Matrix<size_t> indices_(new size_t[indices.rows*indices.cols], indices.rows, indices.cols);
+
+		int result = knnSearch(queries, indices_, dists, knn, params);
+
+		for (size_t i = 0; i<indices.rows; ++i) {
+			for (size_t j = 0; j<indices.cols; ++j) {
+				indices[i][j] = indices_[i][j];
+			}
+		}
+		delete[] indices_.ptr();
+		return result;
+	}
+
+    /**
+     * Find set of nearest neighbors to vec. Their indices are stored inside
+     * the result object.
+     *
+     * Params:
+     *     result = the result object in which the indices of the nearest-neighbors are stored
+     *     vec = the vector for which to search the nearest neighbors
+     *     searchParams = checks caps the number of distances computed (FLANN_CHECKS_UNLIMITED for none)
+     */
+    void findNeighbors(ResultSet<DistanceType>& result, const ElementType* vec, const SearchParams& searchParams) const
+    {
+        PooledContext<SearchContext, LshForestIndex> context(contexts_, *this);
+        findNeighbors(result, vec, searchParams, context.get());
+    }
+
+    /**
+     * Same as above, but using the scratch memory of the caller instead of a context of the index's pool.
+     *
+     * Params:
+     *     context = scratch memory created for this index, owned by the calling thread
+     */
+    void findNeighbors(ResultSet<DistanceType>& result, const ElementType* vec, const SearchParams& searchParams,
+                       SearchContext& context) const
+    {
+        context.checks_ = 0;
+        context.max_checks_ = (searchParams.checks < 0) ? std::numeric_limits<size_t>::max() : searchParams.checks;
+        getNeighbors(vec, result, context);
+    }
+
+protected:
+
+    /**
+     * Builds the index
+     */
+    void buildIndexImpl()
+    {
+        if (max_depth_ == 0 || max_depth_ > 64) {
+            throw FLANNException("The depth of an LSH Forest must be between 1 and 64");
+        }
+        trees_.resize(tree_number_);
+        projections_ = lsh::ProjectionBank(veclen_, tree_number_ * max_depth_);
+
+        // One generator per tree, so that the trees can be built in any order and by any thread
+        std::vector<unsigned int> seeds(tree_number_);
+        if (random_seed_ < 0) {
+            std::random_device rd;
+            for (size_t i = 0; i < seeds.size(); ++i) seeds[i] = rd();
+        }
+        else {
+            std::mt19937 seed_gen((unsigned int)random_seed_);
+            for (size_t i = 0; i < seeds.size(); ++i) seeds[i] = seed_gen();
+        }
+
+#pragma omp parallel
+        {
+            std::vector<std::pair<lsh::BucketKey, lsh::FeatureIndex> > labels(size_);
+            std::vector<float> projections(kBuildBlockSize * max_depth_);
+#pragma omp for schedule(dynamic)
+            for (int i = 0; i < (int)tree_number_; ++i) {
+                std::mt19937 gen(seeds[i]);
+                // Each level has its own offset, the levels being used separately
+                projections_.randomize(i * max_depth_, max_depth_, bucket_width_, gen, false);
+                lsh::PrefixTree& tree = trees_[i];
+                tree = lsh::PrefixTree(max_depth_);
+
+                for (size_t first = 0; first < size_; first += kBuildBlockSize) {
+                    size_t count = std::min(size_t(kBuildBlockSize), size_ - first);
+                    projections_.projectBlock(&points_[first], count, i * max_depth_, max_depth_, &projections[0]);
+                    for (size_t j = 0; j < count; ++j) {
+                        labels[first + j] = std::make_pair(tree.getLabel(&projections[j * max_depth_]), lsh::FeatureIndex(first + j));
+                    }
+                }
+                tree.build(labels);
+            }
+        }
+    }
+
+	/*Copy from NN_Index*/
+	void cleanRemovedPoints()
+	{
+		if (!removed_) return;
+
+		size_t last_idx = 0;
+		for (size_t i = 0; i<size_; ++i) {
+			if (!removed_points_.test(i)) {
+				points_[last_idx] = points_[i];
+				ids_[last_idx] = ids_[i];
+				removed_points_.reset(last_idx);
+				++last_idx;
+			}
+		}
+		points_.resize(last_idx);
+		ids_.resize(last_idx);
+		removed_points_.resize(last_idx);
+		size_ = last_idx;
+		removed_count_ = 0;
+	}//END_CleanRemovedPoints
+
+	/*Copy from NN_Index*/
+	void indices_to_ids(const size_t* in, size_t* out, size_t size) const
+	{
+		if (removed_) {
+			for (size_t i = 0; i<size; ++i) {
+				out[i] = ids_[in[i]];
+			}
+		}
+	}
+
+    void freeIndex()
+    {
+        // The contexts are sized for the index being freed
+        contexts_.clear();
+    }
+
+	/*---------------------NN_Index Parameters --------------------------*/
+
+	/**
+	* The distance functor
+	*/
+	Distance distance_;
+
+	/**
+	* Each index point has an associated ID. IDs are assigned sequentially in
+	* increasing order. This indicates the ID assigned to the last point added to the
+	* index.
+	*/
+	size_t last_id_;
+
+	/**
+	* Number of points in the index (and database)
+	*/
+	size_t size_;
+
+	/**
+	* Number of features in the dataset when the index was last built.
+	*/
+	size_t size_at_build_;
+
+	/**
+	* Size of one point in the index (and database)
+	*/
+	size_t veclen_;
+
+	/**
+	* Parameters of the index.
+	*/
+	IndexParams index_params_;
+
+	/**
+	* Flag indicating if at least a point was removed from the index
+	*/
+	bool removed_;
+
+	/**
+	* Array used to mark points removed from the index
+	*/
+	DynamicBitset removed_points_;
+
+	/**
+	* Number of points removed from the index
+	*/
+	size_t removed_count_;
+
+	/**
+	* Array of point IDs, returned by nearest-neighbour operations
+	*/
+	std::vector<size_t> ids_;
+
+	/**
+	* Point data
+	*/
+	std::vector<ElementType*> points_;
+
+	/**
+	* Pointer to dataset memory if allocated by this index, otherwise NULL
+	*/
+	ElementType* data_ptr_;
+
+private:
+
+	/*Copy from NN_Index*/
+	void setDataset(const Matrix<ElementType>& dataset)
+	{
+		size_ = dataset.rows;
+		veclen_ = dataset.cols;
+		last_id_ = 0;
+
+		ids_.clear();
+		removed_points_.clear();
+		removed_ = false;
+		removed_count_ = 0;
+
+		points_.resize(size_);
+		for (size_t i = 0; i<size_; ++i) {
+			points_[i] = dataset[i];
+		}
+	}//END_SETDATA
+
+    /** Performs the approximate nearest-neighbor search.
+     * Synchronous ascent: starting from the deepest level any tree reached, the points below the node of
+     * the query at the current level are added from every tree, then the search moves one level up, until
+     * the query has candidates_ candidates (10 per tree if 0) at the end of a level.
+     * @param vec the feature to analyze
+     * @param result the result set receiving the candidates
+     * @param context the scratch memory of the query
+     */
+	void getNeighbors(const ElementType* vec, ResultSet<DistanceType>& result, SearchContext& context) const
+    {
+		context.checked_.clear();
+		size_t enough = (candidates_ > 0) ? candidates_ : 10 * tree_number_;
+
+		// Project the query against the functions of all the trees in one pass, then descend each tree
+		projections_.project(vec, &context.projections_[0]);
+		unsigned int depth = 0;
+		for (unsigned int i = 0; i < tree_number_; ++i) {
+			context.labels_[i] = trees_[i].getLabel(&context.projections_[i * max_depth_]);
+			context.depths_[i] = trees_[i].descend(context.labels_[i], context.first_[i]);
+			context.last_[i] = context.first_[i];
+			depth = std::max(depth, context.depths_[i]);
+		}
+
+		for (;; --depth) {
+			for (unsigned int i = 0; i < tree_number_; ++i) {
+				// A tree whose query node is not that deep has no point at this level
+				if (context.depths_[i] < depth) continue;
+				size_t first, last;
+				trees_[i].getRange(context.labels_[i], depth, first, last);
+				// The node contains the one of the previous level: only the points around it are new
+				if (!addRange(i, first, context.first_[i], vec, result, context) ||
+				    !addRange(i, context.last_[i], last, vec, result, context)) return;
+				context.first_[i] = first;
+				context.last_[i] = last;
+			}
+			if (depth == 0 || context.checks_ >= enough) return;
+		}
+    }
+
+    /** Compares the query to the points of a range of a tree
+     * @return false if the search is to stop
+     */
+    bool addRange(unsigned int tree, size_t first, size_t last, const ElementType* vec, ResultSet<DistanceType>& result,
+                  SearchContext& context) const
+    {
+		for (size_t position = first; position < last; ++position) {
+			lsh::FeatureIndex index = trees_[tree].getIndex(position);
+			if (!context.checked_.insert(index)) continue;
+			if (removed_ && removed_points_.test(index)) continue;
+			if (context.checks_ >= context.max_checks_) return false;
+			++context.checks_;
+
+			DistanceType dist = distance_(vec, points_[index], veclen_);
+			result.addPoint(dist, index);
+		}
+		return true;
+    }
+
+    void swap(LshForestIndex& other)
+    {
+    	std::swap(distance_, other.distance_);
+    	std::swap(last_id_, other.last_id_);
+    	std::swap(size_, other.size_);
+    	std::swap(size_at_build_, other.size_at_build_);
+    	std::swap(veclen_, other.veclen_);
+    	std::swap(index_params_, other.index_params_);
+    	std::swap(removed_, other.removed_);
+    	std::swap(removed_points_, other.removed_points_);
+    	std::swap(removed_count_, other.removed_count_);
+    	std::swap(ids_, other.ids_);
+    	std::swap(points_, other.points_);
+    	std::swap(data_ptr_, other.data_ptr_);
+    	std::swap(trees_, other.trees_);
+    	std::swap(projections_, other.projections_);
+    	std::swap(tree_number_, other.tree_number_);
+    	std::swap(max_depth_, other.max_depth_);
+    	std::swap(bucket_width_, other.bucket_width_);
+    	std::swap(candidates_, other.candidates_);
+    	std::swap(random_seed_, other.random_seed_);
+    	contexts_.swap(other.contexts_);
+    }
+
+    /** The prefix trees */
+    std::vector<lsh::PrefixTree> trees_;
+
+    /** The hash functions of all the trees, those of tree i being rows [i*max_depth_, (i+1)*max_depth_) */
+    lsh::ProjectionBank projections_;
+
+    /** Number of features projected at once when building the trees */
+    static const size_t kBuildBlockSize = 256;
+
+    /** Number of trees */
+    unsigned int tree_number_;
+    /** Number of levels of the trees */
+    unsigned int max_depth_;
+    /** Width W of the buckets of the hash functions */
+    float bucket_width_;
+    /** Candidates after which the search stops walking up the trees, 0 for 10 per tree */
+    unsigned int candidates_;
+    /** Seed of the hash functions, -1 if it is drawn at build time */
+    int random_seed_;
+
+    /** Search contexts kept between the search calls, one per thread that searched at the same time */
+    mutable ContextPool<SearchContext> contexts_;
+};
+}
+
+#endif //FLANN_LSH_FOREST_INDEX_H_
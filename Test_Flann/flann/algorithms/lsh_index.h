@@ -38,8 +38,11 @@
 #include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <functional>
+#include <limits>
 #include <map>
 #include <vector>
+#include <sstream>
 #include <ctime>
 
 #include "flann/general.h"
@@ -48,6 +51,11 @@
 #include "flann/util/result_set.h"
 #include "flann/util/heap.h"
 #include "flann/util/lsh_table.h"
+#include "flann/util/lsh_projection.h"
+#include "flann/util/lsh_tuning.h"
+#include "flann/util/logger.h"
+#include "flann/util/visited_set.h"
+#include "flann/util/context_pool.h"
 #include "flann/util/allocator.h"
 #include "flann/util/random.h"
 #include "flann/util/saving.h"
@@ -57,15 +65,58 @@ namespace flann
 
 struct LshIndexParams : public IndexParams
 {
-    LshIndexParams(unsigned int table_number = 12, unsigned int key_size = 20, unsigned int multi_probe_level = 2)
+    LshIndexParams(unsigned int table_number = 12, unsigned int key_size = 20, unsigned int multi_probe_level = 2,
+                   int probe_number = -1, bool global_probing = false,
+                   unsigned int bucket_size_limit = 0, unsigned int split_key_size = 4, bool compress_buckets = false,
+                   int random_seed = -1, flann_lsh_projection_t projection = FLANN_LSH_PROJECTION_GAUSSIAN,
+                   unsigned int shared_functions = 0, flann_lsh_precision_t projection_precision = FLANN_LSH_PRECISION_FLOAT32,
+                   float bucket_width = 1000, bool shared_bias = true, float target_recall = 0.9f, int candidate_budget = -1,
+                   unsigned int resolution_number = 1, float resolution_factor = 2, unsigned int min_candidates = 0,
+                   bool sorted_layout = false, unsigned int kmeans_cells = 0)
     {
         (* this)["algorithm"] = FLANN_INDEX_LSH;
         // The number of hash tables to use
         (*this)["table_number"] = table_number;
-        // The length of the key in the hash tables
+        // The length of the key in the hash tables (the number of bits sampled, for binary features)
         (*this)["key_size"] = key_size;
-        // Number of levels to use in multi-probe (0 for standard LSH)
+        // Number of levels to use in multi-probe (0 for standard LSH), i.e. how many components a probe can perturb
         (*this)["multi_probe_level"] = multi_probe_level;
+        // Number of additional buckets probed per table (-1 for key_size)
+        (*this)["probe_number"] = probe_number;
+        // Order the probes of all the tables together instead of table by table
+        (*this)["global_probing"] = global_probing;
+        // Buckets with more points are split by a second level of hashing (0 for no limit)
+        (*this)["bucket_size_limit"] = bucket_size_limit;
+        // Number of hash functions of the second level
+        (*this)["split_key_size"] = split_key_size;
+        // Store the point indices of the buckets delta-encoded
+        (*this)["compress_buckets"] = compress_buckets;
+        // Seed of the random hash functions (-1 to draw one)
+        (*this)["random_seed"] = random_seed;
+        // Dense Gaussian projections, the cheaper sparse or Hadamard ones, or PCA or ITQ ones learned from the data
+        // (all for L2), or cross-polytope functions for angular distances (to pair with CosineDistance)
+        (*this)["projection"] = projection;
+        // Number of k-means cells whose residuals are hashed, the cell being part of the key (0 for none)
+        (*this)["kmeans_cells"] = kmeans_cells;
+        // Number m of shared half-keys the keys of the tables are pairs of (0 for independent tables)
+        (*this)["shared_functions"] = shared_functions;
+        // Precision of the weights the dense projection reads, fp32 being used near the bucket boundaries
+        (*this)["projection_precision"] = projection_precision;
+        // Width W of the buckets (0 to estimate W, key_size and table_number, the latter two being upper bounds)
+        (*this)["bucket_width"] = bucket_width;
+        // All the functions of a table share one offset (false for one offset per function)
+        (*this)["shared_bias"] = shared_bias;
+        // Fraction of the 10 nearest neighbors the estimated parameters should find without multi-probe
+        (*this)["target_recall"] = target_recall;
+        // Most candidates per query the estimated parameters can give (-1 for no limit)
+        (*this)["candidate_budget"] = candidate_budget;
+        // Number of groups of table_number tables, the bucket width of each group being resolution_factor times the previous one
+        (*this)["resolution_number"] = resolution_number;
+        (*this)["resolution_factor"] = resolution_factor;
+        // A query moves on to a coarser group while it has fewer candidates than this, or than the neighbors asked for
+        (*this)["min_candidates"] = min_candidates;
+        // Store the buckets sorted by the Z-order of their keys, a query with an empty bucket then taking the nearest one
+        (*this)["sorted_layout"] = sorted_layout;
     }
 };
 
@@ -86,6 +137,82 @@ public:
 
     //typedef NNIndex<Distance> BaseClass;
 
+    /**
+     * Scratch memory of a search, so that queries do not allocate
+     * A context can be reused for any number of queries on the index it was created for,
+     * but only by one thread at a time.
+     */
+    struct SearchContext
+    {
+        SearchContext(const LshIndex& index) :
+            key_(index.tables_.size() * index.key_size_), bucket_keys_(index.tables_.size()),
+            perturbations_(2 * index.tables_.size() * index.key_size_), split_key_(index.split_key_size_),
+            sub_keys_(index.tables_.size()), sub_key_ready_(index.tables_.size()), checked_(index.size_),
+            transform_(index.projections_.workspaceSize()),
+            half_keys_(index.shared_functions_ > 0 ? index.projections_.size() : 0),
+            cross_polytope_probes_(index.projection_ == FLANN_LSH_PROJECTION_CROSS_POLYTOPE ? 2 * index.tables_.size() * index.key_size_ : 0)
+        {
+            size_t max_bucket_size = 0;
+            for (size_t i = 0; i < index.tables_.size(); ++i) {
+                max_bucket_size = std::max(max_bucket_size, index.tables_[i].maxBucketSize());
+            }
+            bucket_.resize(max_bucket_size);
+        }
+
+        /** A perturbation set of the query-directed probing
+         * The set is its largest perturbation (in the sorted order) added to its prefix set.
+         */
+        struct ProbeSet
+        {
+            /** Sum of the squared distances of the perturbations to their bucket boundaries */
+            float score_;
+            /** Table the set applies to */
+            unsigned int table_;
+            /** Position of the largest perturbation in the sorted perturbations of the table */
+            unsigned int last_;
+            /** Number of perturbations in the set */
+            unsigned int size_;
+            /** Index of the set without its largest perturbation, -1 if it is empty */
+            int prefix_;
+        };
+
+        /** Projections of the query on the hash functions of all the tables */
+        std::vector<float> key_;
+        /** Bucket of the query in each table */
+        std::vector<lsh::BucketKey> bucket_keys_;
+        /** Distances of the query to the bucket boundaries of each table, sorted table by table */
+        std::vector<std::pair<float, int> > perturbations_;
+        /** All the perturbation sets generated for the query */
+        std::vector<ProbeSet> probe_sets_;
+        /** Min-heap of the scores of the sets not probed yet, with their index in probe_sets_ */
+        std::vector<std::pair<float, int> > probe_heap_;
+        /** Projections of the query on the second-level functions of a table */
+        std::vector<float> split_key_;
+        /** Sub-key of the query in each table, computed when it first reaches a heavy bucket of the table */
+        std::vector<lsh::BucketKey> sub_keys_;
+        std::vector<unsigned char> sub_key_ready_;
+        /** Points whose distance to the query was already computed */
+        VisitedSet checked_;
+        /** The points of the current bucket, when the buckets are compressed */
+        std::vector<lsh::FeatureIndex> bucket_;
+        /** The query transformed by the structured projections */
+        std::vector<float> transform_;
+        /** Projections of the query on the shared half-keys */
+        std::vector<float> half_keys_;
+        /** The two runner-up vertices of each cross-polytope function of each table */
+        std::vector<lsh::CrossPolytopeProbe> cross_polytope_probes_;
+        /** Number of distances computed for the query, and the most that can be */
+        size_t checks_;
+        size_t max_checks_;
+        /** Number of buckets in a row that did not improve the result, and the most that can */
+        size_t unimproved_buckets_;
+        size_t max_unimproved_buckets_;
+        /** Most distances computed in one bucket */
+        size_t max_bucket_checks_;
+        /** Hash of the query, the position from which the buckets with more points than that are read */
+        size_t bucket_rotation_;
+    };
+
     /** Constructor
      * @param params parameters passed to the LSH algorithm
      * @param d the distance used
@@ -97,8 +224,25 @@ public:
         table_number_ = get_param<unsigned int>(index_params_,"table_number",12);
         key_size_ = get_param<unsigned int>(index_params_,"key_size",20);
         multi_probe_level_ = get_param<unsigned int>(index_params_,"multi_probe_level",2);
-
-        fill_xor_mask(0, key_size_, multi_probe_level_, xor_masks_);
+        // Resolved at build time, as its default depends on the key size, which can be estimated
+        probe_number_ = 0;
+        global_probing_ = get_param<bool>(index_params_,"global_probing",false);
+        bucket_size_limit_ = get_param<unsigned int>(index_params_,"bucket_size_limit",0);
+        split_key_size_ = get_param<unsigned int>(index_params_,"split_key_size",4);
+        compress_buckets_ = get_param<bool>(index_params_,"compress_buckets",false);
+        random_seed_ = get_param<int>(index_params_,"random_seed",-1);
+        projection_ = get_param<flann_lsh_projection_t>(index_params_,"projection",FLANN_LSH_PROJECTION_GAUSSIAN);
+        shared_functions_ = get_param<unsigned int>(index_params_,"shared_functions",0);
+        projection_precision_ = get_param<flann_lsh_precision_t>(index_params_,"projection_precision",FLANN_LSH_PRECISION_FLOAT32);
+        bucket_width_ = get_param<float>(index_params_,"bucket_width",1000);
+        shared_bias_ = get_param<bool>(index_params_,"shared_bias",true);
+        target_recall_ = get_param<float>(index_params_,"target_recall",0.9f);
+        candidate_budget_ = get_param<int>(index_params_,"candidate_budget",-1);
+        resolution_number_ = get_param<unsigned int>(index_params_,"resolution_number",1);
+        resolution_factor_ = get_param<float>(index_params_,"resolution_factor",2);
+        min_candidates_ = get_param<unsigned int>(index_params_,"min_candidates",0);
+        sorted_layout_ = get_param<bool>(index_params_,"sorted_layout",false);
+        kmeans_cells_ = get_param<unsigned int>(index_params_,"kmeans_cells",0);
     }
 
 
@@ -114,20 +258,49 @@ public:
         table_number_ = get_param<unsigned int>(index_params_,"table_number",12);
         key_size_ = get_param<unsigned int>(index_params_,"key_size",20);
         multi_probe_level_ = get_param<unsigned int>(index_params_,"multi_probe_level",2);
-
-		//change form size_t to int 
-		std::vector<int> zero_mask_(key_size_, 0);
-//        fill_xor_mask(zero_mask_, key_size_, multi_probe_level_, xor_masks_);
+        // Resolved at build time, as its default depends on the key size, which can be estimated
+        probe_number_ = 0;
+        global_probing_ = get_param<bool>(index_params_,"global_probing",false);
+        bucket_size_limit_ = get_param<unsigned int>(index_params_,"bucket_size_limit",0);
+        split_key_size_ = get_param<unsigned int>(index_params_,"split_key_size",4);
+        compress_buckets_ = get_param<bool>(index_params_,"compress_buckets",false);
+        random_seed_ = get_param<int>(index_params_,"random_seed",-1);
+        projection_ = get_param<flann_lsh_projection_t>(index_params_,"projection",FLANN_LSH_PROJECTION_GAUSSIAN);
+        shared_functions_ = get_param<unsigned int>(index_params_,"shared_functions",0);
+        projection_precision_ = get_param<flann_lsh_precision_t>(index_params_,"projection_precision",FLANN_LSH_PRECISION_FLOAT32);
+        bucket_width_ = get_param<float>(index_params_,"bucket_width",1000);
+        shared_bias_ = get_param<bool>(index_params_,"shared_bias",true);
+        target_recall_ = get_param<float>(index_params_,"target_recall",0.9f);
+        candidate_budget_ = get_param<int>(index_params_,"candidate_budget",-1);
+        resolution_number_ = get_param<unsigned int>(index_params_,"resolution_number",1);
+        resolution_factor_ = get_param<float>(index_params_,"resolution_factor",2);
+        min_candidates_ = get_param<unsigned int>(index_params_,"min_candidates",0);
+        sorted_layout_ = get_param<bool>(index_params_,"sorted_layout",false);
+        kmeans_cells_ = get_param<unsigned int>(index_params_,"kmeans_cells",0);
 
         setDataset(input_data);
     }
 
     LshIndex(const LshIndex& other) : BaseClass(other),
     	tables_(other.tables_),
+    	projections_(other.projections_),
+    	split_projections_(other.split_projections_),
+    	bucket_width_(other.bucket_width_),
     	table_number_(other.table_number_),
     	key_size_(other.key_size_),
     	multi_probe_level_(other.multi_probe_level_),
-    	xor_masks_(other.xor_masks_)
+    	probe_number_(other.probe_number_),
+    	global_probing_(other.global_probing_),
+    	bucket_size_limit_(other.bucket_size_limit_),
+    	split_key_size_(other.split_key_size_),
+    	compress_buckets_(other.compress_buckets_),
+    	random_seed_(other.random_seed_), projection_(other.projection_),
+    	shared_functions_(other.shared_functions_), table_halves_(other.table_halves_),
+    	projection_precision_(other.projection_precision_), shared_bias_(other.shared_bias_),
+    	target_recall_(other.target_recall_), candidate_budget_(other.candidate_budget_),
+    	resolution_number_(other.resolution_number_), resolution_factor_(other.resolution_factor_),
+    	min_candidates_(other.min_candidates_), sorted_layout_(other.sorted_layout_),
+    	kmeans_cells_(other.kmeans_cells_), xor_masks_(other.xor_masks_)
     {
     }
     
@@ -161,24 +334,22 @@ public:
 		size_at_build_ = size_;
 	}
 
+    /**
+     * Adds points to the index
+     * The tables are frozen once built, so the points added since the last build are scanned linearly by
+     * every query until there are enough of them for the tables to be rebuilt.
+     * @param points the new points
+     * @param rebuild_threshold the tables are rebuilt once the index has this many times the points it was
+     *        built with (1 or less for never)
+     */
     void addPoints(const Matrix<ElementType>& points, float rebuild_threshold = 2)
     {
         assert(points.cols==veclen_);
-        size_t old_size = size_;
-
         extendDataset(points);
-        
+
         if (rebuild_threshold>1 && size_at_build_*rebuild_threshold<size_) {
             buildIndex();
         }
-        else {
-            for (unsigned int i = 0; i < table_number_; ++i) {
-                lsh::LshTable<ElementType>& table = tables_[i];                
-                for (size_t i=old_size;i<size_;++i) {
-                    table.add(i, points_[i]);
-                }            
-            }
-        }
     }
 
 
@@ -198,8 +369,29 @@ public:
     	ar & table_number_;
     	ar & key_size_;
     	ar & multi_probe_level_;
-
+    	ar & probe_number_;
+    	ar & global_probing_;
+    	ar & bucket_size_limit_;
+    	ar & split_key_size_;
+    	ar & compress_buckets_;
+    	ar & random_seed_;
+    	ar & projection_;
+    	ar & shared_functions_;
+    	ar & table_halves_;
+    	ar & projection_precision_;
+    	ar & shared_bias_;
+    	ar & target_recall_;
+    	ar & candidate_budget_;
+    	ar & resolution_number_;
+    	ar & resolution_factor_;
+    	ar & min_candidates_;
+    	ar & sorted_layout_;
+    	ar & kmeans_cells_;
     	ar & xor_masks_;
+
+    	ar & bucket_width_;
+    	ar & projections_;
+    	ar & split_projections_;
     	ar & tables_;
 
     	if (Archive::is_loading::value) {
@@ -207,6 +399,24 @@ public:
             index_params_["table_number"] = table_number_;
             index_params_["key_size"] = key_size_;
             index_params_["multi_probe_level"] = multi_probe_level_;
+            index_params_["probe_number"] = (int)probe_number_;
+            index_params_["global_probing"] = global_probing_;
+            index_params_["bucket_size_limit"] = bucket_size_limit_;
+            index_params_["split_key_size"] = split_key_size_;
+            index_params_["compress_buckets"] = compress_buckets_;
+            index_params_["random_seed"] = random_seed_;
+            index_params_["projection"] = projection_;
+            index_params_["shared_functions"] = shared_functions_;
+            index_params_["projection_precision"] = projection_precision_;
+            index_params_["bucket_width"] = bucket_width_;
+            index_params_["shared_bias"] = shared_bias_;
+            index_params_["target_recall"] = target_recall_;
+            index_params_["candidate_budget"] = candidate_budget_;
+            index_params_["resolution_number"] = resolution_number_;
+            index_params_["resolution_factor"] = resolution_factor_;
+            index_params_["min_candidates"] = min_candidates_;
+            index_params_["sorted_layout"] = sorted_layout_;
+            index_params_["kmeans_cells"] = kmeans_cells_;
     	}
     }
 
@@ -218,6 +428,7 @@ public:
 
     void loadIndex(FILE* stream)
     {
+    	freeIndex();
     	serialization::LoadArchive la(stream);
     	la & *this;
     }
@@ -238,6 +449,12 @@ public:
 		return veclen_;
 	}
 
+	/*copy from NN_Index: the parameters, with those estimated at build time*/
+	IndexParams getParameters() const
+	{
+		return index_params_;
+	}
+
     /**
      * \brief Perform k-nearest neighbor search
      * \param[in] queries The query points for which to find the nearest neighbors
@@ -262,11 +479,12 @@ public:
         if (params.use_heap==FLANN_True) {
 #pragma omp parallel num_threads(params.cores)
         	{
-        		KNNUniqueResultSet<DistanceType> resultSet(knn);
+        		KNNResultSet2<DistanceType> resultSet(knn);
+        		PooledContext<SearchContext, LshIndex> context(contexts_, *this);
 #pragma omp for schedule(static) reduction(+:count)
         		for (int i = 0; i < (int)queries.rows; i++) {
         			resultSet.clear();
-        			findNeighbors(resultSet, queries[i], params);
+        			findNeighbors(resultSet, queries[i], params, context.get());
         			size_t n = std::min(resultSet.size(), knn);
         			resultSet.copy(indices[i], dists[i], n, params.sorted);
         			indices_to_ids(indices[i], indices[i], n);
@@ -277,13 +495,12 @@ public:
         else {
 #pragma omp parallel num_threads(params.cores)
         	{
-        		//KNNResultSet<DistanceType> resultSet(knn);
-				params.cores;
-				KNNUniqueResultSet<DistanceType> resultSet(knn);
+        		KNNSimpleResultSet<DistanceType> resultSet(knn);
+        		PooledContext<SearchContext, LshIndex> context(contexts_, *this);
 #pragma omp for schedule(static) reduction(+:count)
         		for (int i = 0; i < (int)queries.rows; i++) {
         			resultSet.clear();
-        			findNeighbors(resultSet, queries[i], params);
+        			findNeighbors(resultSet, queries[i], params, context.get());
         			size_t n = std::min(resultSet.size(), knn);
         			resultSet.copy(indices[i], dists[i], n, params.sorted);
         			indices_to_ids(indices[i], indices[i], n);
@@ -337,11 +554,12 @@ public:
 		if (params.use_heap==FLANN_True) {
 #pragma omp parallel num_threads(params.cores)
 			{
-				KNNUniqueResultSet<DistanceType> resultSet(knn);
+				KNNResultSet2<DistanceType> resultSet(knn);
+				PooledContext<SearchContext, LshIndex> context(contexts_, *this);
 #pragma omp for schedule(static) reduction(+:count)
 				for (int i = 0; i < (int)queries.rows; i++) {
 					resultSet.clear();
-					findNeighbors(resultSet, queries[i], params);
+					findNeighbors(resultSet, queries[i], params, context.get());
 					size_t n = std::min(resultSet.size(), knn);
 					indices[i].resize(n);
 					dists[i].resize(n);
@@ -356,11 +574,12 @@ public:
 		else {
 #pragma omp parallel num_threads(params.cores)
 			{
-				KNNUniqueResultSet<DistanceType> resultSet(knn);
+				KNNSimpleResultSet<DistanceType> resultSet(knn);
+				PooledContext<SearchContext, LshIndex> context(contexts_, *this);
 #pragma omp for schedule(static) reduction(+:count)
 				for (int i = 0; i < (int)queries.rows; i++) {
 					resultSet.clear();
-					findNeighbors(resultSet, queries[i], params);
+					findNeighbors(resultSet, queries[i], params, context.get());
 					size_t n = std::min(resultSet.size(), knn);
 					indices[i].resize(n);
 					dists[i].resize(n);
@@ -383,12 +602,33 @@ public:
      * Params:
      *     result = the result object in which the indices of the nearest-neighbors are stored
      *     vec = the vector for which to search the nearest neighbors
-     *     maxCheck = the maximum number of restarts (in a best-bin-first manner)
+     *     searchParams = checks caps the number of distances computed (FLANN_CHECKS_UNLIMITED for none), and
+     *                    max_unimproved_buckets stops the search when that many buckets in a row did not improve it
+     */
+    void findNeighbors(ResultSet<DistanceType>& result, const ElementType* vec, const SearchParams& searchParams) const
+    {
+        PooledContext<SearchContext, LshIndex> context(contexts_, *this);
+        findNeighbors(result, vec, searchParams, context.get());
+    }
+
+    /**
+     * Same as above, but using the scratch memory of the caller instead of a context of the index's pool.
+     *
+     * Params:
+     *     context = scratch memory created for this index, owned by the calling thread
      */
-    //void findNeighbors(ResultSet<DistanceType>& result, const ElementType* vec, const SearchParams& /*searchParams*/) const
-	void findNeighbors(KNNUniqueResultSet<DistanceType>& result, const ElementType* vec, const SearchParams& /*searchParams*/) const
+    void findNeighbors(ResultSet<DistanceType>& result, const ElementType* vec, const SearchParams& searchParams,
+                       SearchContext& context) const
     {
-        getNeighbors(vec, result); 
+        context.checks_ = 0;
+        context.max_checks_ = (searchParams.checks < 0) ? std::numeric_limits<size_t>::max() : searchParams.checks;
+        context.unimproved_buckets_ = 0;
+        context.max_unimproved_buckets_ = (searchParams.max_unimproved_buckets < 0) ?
+                                          std::numeric_limits<size_t>::max() : searchParams.max_unimproved_buckets;
+        context.max_bucket_checks_ = (searchParams.max_bucket_checks < 0) ?
+                                     std::numeric_limits<size_t>::max() : searchParams.max_bucket_checks;
+        context.bucket_rotation_ = (context.max_bucket_checks_ == std::numeric_limits<size_t>::max()) ? 0 : hashQuery(vec);
+        getNeighbors(vec, result, context);
     }
 
 protected:
@@ -398,21 +638,314 @@ protected:
      */
     void buildIndexImpl()
     {
-        tables_.resize(table_number_);
-        std::vector<std::pair<size_t,ElementType*> > features;
-        features.reserve(points_.size());
-        for (size_t i=0;i<points_.size();++i) {
-			features.push_back(std::make_pair(i, points_[i]));
+        buildTables(static_cast<ElementType*>(NULL));
+    }
+
+    /** Builds the E2LSH tables of float features
+     */
+    void buildTables(float*)
+    {
+        if (projection_ == FLANN_LSH_PROJECTION_CROSS_POLYTOPE && (bucket_width_ <= 0 || shared_functions_ > 0)) {
+            throw FLANNException("The cross-polytope LSH functions can neither be estimated nor share half-keys");
         }
-        for (unsigned int i = 0; i < table_number_; ++i) {
-            lsh::LshTable<ElementType>& table = tables_[i];
-            table = lsh::LshTable<ElementType>(veclen_, key_size_);
-
-            // Add the features to the table
-            table.add(features);
-			//int a = table.features_in_a_bucket();
-			buckets_total_num += table.usedMemory();
+        if (bucket_width_ <= 0) estimateParameters();
+        probe_number_ = probeNumber();
+
+        if (resolution_number_ == 0) {
+            throw FLANNException("An LSH index needs at least one group of tables");
         }
+        // Checked here as the tables are set up in a parallel region, which no exception can leave
+        if (sorted_layout_ && lsh::LshTable<ElementType>::packedKeyBits(key_size_) == 0) {
+            throw FLANNException("The sorted LSH table layout needs keys of at most 16 components");
+        }
+        if (projection_ == FLANN_LSH_PROJECTION_CROSS_POLYTOPE) {
+            // A cross-polytope component is one of 2*padded vertex ids, which must fit its packed key field
+            unsigned int vertex_bits = 1;
+            for (size_t padded = 1; padded < veclen_; padded <<= 1) ++vertex_bits;
+            unsigned int key_bits = lsh::LshTable<ElementType>::packedKeyBits(key_size_);
+            if (key_bits > 0 && key_bits < vertex_bits) {
+                std::ostringstream message;
+                message << "The cross-polytope LSH keys of " << veclen_ << "-d features need at most "
+                        << 64 / vertex_bits << " or more than 16 components";
+                throw FLANNException(message.str());
+            }
+        }
+        unsigned int total_tables = table_number_ * resolution_number_;
+        tables_.resize(total_tables);
+        size_t function_number = total_tables * key_size_;
+        unsigned int half_size = key_size_ / 2;
+        if (shared_functions_ > 0) {
+            if (key_size_ % 2 != 0) {
+                throw FLANNException("The key size must be even for the tables to share half-keys");
+            }
+            if (shared_functions_ * (shared_functions_ - 1) / 2 < table_number_) {
+                throw FLANNException("Not enough shared half-keys for a distinct pair per table");
+            }
+            // Table i of a group gets the i-th pair (a, b), a < b, in lexicographic order, of the half-keys of the group
+            table_halves_.clear();
+            for (unsigned int group = 0; group < resolution_number_; ++group) {
+                unsigned int pairs = 0;
+                for (unsigned int a = 0; a < shared_functions_ && pairs < table_number_; ++a) {
+                    for (unsigned int b = a + 1; b < shared_functions_ && pairs < table_number_; ++b, ++pairs) {
+                        table_halves_.push_back(group * shared_functions_ + a);
+                        table_halves_.push_back(group * shared_functions_ + b);
+                    }
+                }
+            }
+            function_number = resolution_number_ * shared_functions_ * half_size;
+        }
+        projections_ = lsh::ProjectionBank(veclen_, function_number, projection_, projection_precision_);
+        split_projections_ = lsh::ProjectionBank(veclen_, total_tables * split_key_size_);
+
+        std::vector<unsigned int> seeds = drawSeeds(total_tables + 1);
+        // The transform shared by the functions of all the tables, if any, and the shared half-keys
+        std::mt19937 shared_gen(seeds[total_tables]);
+        projections_.randomizeTransform(shared_gen);
+        std::vector<unsigned int> cells;
+        if (projection_ == FLANN_LSH_PROJECTION_PCA || projection_ == FLANN_LSH_PROJECTION_ITQ || kmeans_cells_ > 0) {
+            trainProjections(shared_functions_ > 0 ? half_size : key_size_, shared_gen);
+            if (kmeans_cells_ > 0) {
+                // The cell of each point, found once for all the tables
+                cells.resize(size_);
+#pragma omp parallel for schedule(static)
+                for (int j = 0; j < (int)size_; ++j) cells[j] = projections_.nearestCell(points_[j]);
+            }
+        }
+        const unsigned int* point_cells = cells.empty() ? NULL : &cells[0];
+        std::vector<float> half_keys;
+        if (shared_functions_ > 0) {
+            for (unsigned int h = 0; h < resolution_number_ * shared_functions_; ++h) {
+                projections_.randomize(h * half_size, half_size, bucketWidth(h / shared_functions_), shared_gen, shared_bias_);
+            }
+            // The points are projected on the half-keys once for all the tables
+            half_keys.resize(size_ * projections_.size());
+#pragma omp parallel for schedule(static)
+            for (int block = 0; block < (int)((size_ + kBuildBlockSize - 1) / kBuildBlockSize); ++block) {
+                size_t first = block * kBuildBlockSize;
+                size_t count = std::min(size_t(kBuildBlockSize), size_ - first);
+                projections_.projectBlock(&points_[first], count, &half_keys[first * projections_.size()],
+                                          point_cells ? point_cells + first : NULL);
+            }
+        }
+
+#pragma omp parallel
+        {
+            std::vector<std::pair<lsh::BucketKey, lsh::FeatureIndex> > features(size_);
+            std::vector<float> projections(kBuildBlockSize * key_size_);
+            std::vector<float> split_key(split_key_size_);
+#pragma omp for schedule(dynamic)
+            for (int i = 0; i < (int)total_tables; ++i) {
+                std::mt19937 gen(seeds[i]);
+                float width = bucketWidth(i / table_number_);
+                if (shared_functions_ == 0) projections_.randomize(i * key_size_, key_size_, width, gen, shared_bias_);
+                split_projections_.randomize(i * split_key_size_, split_key_size_, width, gen);
+                lsh::LshTable<ElementType>& table = tables_[i];
+                table = lsh::LshTable<ElementType>(veclen_, key_size_, gen);
+                if (sorted_layout_) table.useSortedLayout();
+
+                if (shared_functions_ > 0) {
+                    for (size_t j = 0; j < size_; ++j) {
+                        assembleKey(i, &half_keys[j * projections_.size()], &projections[0]);
+                        features[j] = std::make_pair(table.getBucketKey(&projections[0]), lsh::FeatureIndex(j));
+                    }
+                }
+                else {
+                    // Project the features by blocks against the functions of the table
+                    for (size_t first = 0; first < size_; first += kBuildBlockSize) {
+                        size_t count = std::min(size_t(kBuildBlockSize), size_ - first);
+                        projections_.projectBlock(&points_[first], count, i * key_size_, key_size_, &projections[0],
+                                                  point_cells ? point_cells + first : NULL);
+                        for (size_t j = 0; j < count; ++j) {
+                            features[first + j] = std::make_pair(table.getBucketKey(&projections[j * key_size_]), lsh::FeatureIndex(first + j));
+                        }
+                    }
+                }
+
+                // Sort-based bulk load of the table, which leaves it frozen
+                table.load(features);
+                if (bucket_size_limit_ > 0) splitBuckets(i, split_key);
+                if (compress_buckets_) table.compress();
+            }
+        }
+
+        for (unsigned int i = 0; i < total_tables; ++i) {
+			//int a = tables_[i].features_in_a_bucket();
+			buckets_total_num += tables_[i].usedMemory();
+        }
+    }
+
+    /** Builds the bit-sampling tables of binary features, for the Hamming distance
+     * The key of a feature in a table is key_size_ of its bits, sampled at random, and the multi-probe
+     * flips the bits of the key of the query. The projections and their parameters do not apply, nor does
+     * the splitting of the heavy buckets, which needs projections.
+     */
+    void buildTables(unsigned char*)
+    {
+        if (resolution_number_ == 0) {
+            throw FLANNException("An LSH index needs at least one group of tables");
+        }
+        // Checked here as the tables are set up in a parallel region, which no exception can leave. The
+        // sampled bits are packed one per component, so the sorted layout takes any of these keys.
+        if (key_size_ == 0 || key_size_ > 64 || key_size_ > veclen_ * CHAR_BIT) {
+            throw FLANNException("A bit-sampling LSH key needs between 1 and 64 bits, and no more than the features have");
+        }
+        probe_number_ = probeNumber();
+        unsigned int total_tables = table_number_ * resolution_number_;
+        tables_.resize(total_tables);
+        std::vector<unsigned int> seeds = drawSeeds(total_tables);
+
+#pragma omp parallel
+        {
+            std::vector<std::pair<lsh::BucketKey, lsh::FeatureIndex> > features(size_);
+#pragma omp for schedule(dynamic)
+            for (int i = 0; i < (int)total_tables; ++i) {
+                std::mt19937 gen(seeds[i]);
+                lsh::LshTable<ElementType>& table = tables_[i];
+                table = lsh::LshTable<ElementType>(veclen_, key_size_, gen);
+                if (sorted_layout_) table.useSortedLayout();
+                for (size_t j = 0; j < size_; ++j) {
+                    features[j] = std::make_pair(table.getSampledKey(points_[j]), lsh::FeatureIndex(j));
+                }
+                table.load(features);
+                if (compress_buckets_) table.compress();
+            }
+        }
+
+        xor_masks_.clear();
+        if (multi_probe_level_ > 0) {
+            for (unsigned int level = 0; level <= std::min(multi_probe_level_, key_size_); ++level) {
+                addXorMasks(0, 0, level);
+            }
+        }
+
+        for (unsigned int i = 0; i < total_tables; ++i) {
+			buckets_total_num += tables_[i].usedMemory();
+        }
+    }
+
+    /** One generator per table, so that the tables can be built in any order and by any thread
+     * @param count the number of seeds
+     * @return the seeds, drawn from random_seed_ if it is set
+     */
+    std::vector<unsigned int> drawSeeds(size_t count) const
+    {
+        std::vector<unsigned int> seeds(count);
+        if (random_seed_ < 0) {
+            std::random_device rd;
+            for (size_t i = 0; i < seeds.size(); ++i) seeds[i] = rd();
+        }
+        else {
+            std::mt19937 seed_gen((unsigned int)random_seed_);
+            for (size_t i = 0; i < seeds.size(); ++i) seeds[i] = seed_gen();
+        }
+        return seeds;
+    }
+
+    /** Appends the xor masks of the multi-probe with a given number of bits, the bits below lowest_bit
+     * being those of mask. Only the 1 + probe_number_ masks that can be used are kept.
+     * @param mask the bits already set
+     * @param lowest_bit the lowest bit that can still be set
+     * @param bits the number of bits left to set
+     */
+    void addXorMasks(lsh::BucketKey mask, unsigned int lowest_bit, unsigned int bits)
+    {
+        if (xor_masks_.size() > probe_number_) return;
+        if (bits == 0) {
+            xor_masks_.push_back(mask);
+            return;
+        }
+        for (unsigned int bit = lowest_bit; bit + bits <= key_size_; ++bit) {
+            addXorMasks(mask | (lsh::BucketKey(1) << bit), bit + 1, bits - 1);
+        }
+    }
+
+    /** Trains the learned functions and the k-means cells on a random sample of the points
+     * @param components the number of functions drawn together, those of a table or of a shared half-key
+     * @param gen the random generator
+     */
+    template<typename Generator>
+    void trainProjections(unsigned int components, Generator& gen)
+    {
+        size_t sample_size = std::min(size_, size_t(kLearningSampleSize));
+        std::vector<size_t> order(size_);
+        for (size_t j = 0; j < size_; ++j) order[j] = j;
+        std::vector<const float*> sample(sample_size);
+        for (size_t j = 0; j < sample_size; ++j) {
+            std::uniform_int_distribution<size_t> pick(j, size_ - 1);
+            std::swap(order[j], order[pick(gen)]);
+            sample[j] = points_[order[j]];
+        }
+        projections_.train(&sample[0], sample_size, components, kmeans_cells_, gen);
+    }
+
+    /** @return the bucket width of a group of tables
+     */
+    inline float bucketWidth(unsigned int group) const
+    {
+        return bucket_width_ * std::pow(resolution_factor_, (float)group);
+    }
+
+    /** Chooses the bucket width, key size and number of tables from a sample of the dataset, key_size_
+     * and table_number_ being the largest values considered
+     */
+    void estimateParameters()
+    {
+        unsigned int max_table_number = table_number_;
+        if (shared_functions_ > 0) {
+            max_table_number = std::min(max_table_number, shared_functions_ * (shared_functions_ - 1) / 2);
+        }
+        std::mt19937 gen(random_seed_ < 0 ? std::random_device()() : (unsigned int)random_seed_);
+        lsh::LshParameters parameters = lsh::estimateParameters(points_, veclen_, target_recall_, candidate_budget_,
+                                                                key_size_, shared_functions_ > 0 ? 2 : 1, max_table_number, gen);
+        if (parameters.width_ <= 0) {
+            throw FLANNException("No LSH parameters fit the candidate budget");
+        }
+        bucket_width_ = parameters.width_;
+        key_size_ = parameters.key_size_;
+        table_number_ = parameters.table_number_;
+        Logger::info("LSH parameters: W = %g, k = %u, L = %u, expected recall %g with %g candidates\n",
+                     bucket_width_, key_size_, table_number_, parameters.recall_, parameters.candidates_);
+
+        index_params_["bucket_width"] = bucket_width_;
+        index_params_["key_size"] = key_size_;
+        index_params_["table_number"] = table_number_;
+        index_params_["probe_number"] = (int)probeNumber();
+    }
+
+    /** @return the number of buckets probed per table: the probe_number parameter, or the key size if it is -1
+     */
+    unsigned int probeNumber() const
+    {
+        int probe_number = get_param<int>(index_params_,"probe_number",-1);
+        return (probe_number < 0) ? key_size_ : (unsigned int)probe_number;
+    }
+
+    /** Puts together the key projections of a table from the projections on its two shared half-keys
+     * @param table the table
+     * @param half_keys the projections on all the shared half-keys
+     * @param key the key_size_ projections of the table
+     */
+    inline void assembleKey(unsigned int table, const float* half_keys, float* key) const
+    {
+        unsigned int half_size = key_size_ / 2;
+        std::copy(half_keys + table_halves_[2 * table] * half_size, half_keys + (table_halves_[2 * table] + 1) * half_size, key);
+        std::copy(half_keys + table_halves_[2 * table + 1] * half_size, half_keys + (table_halves_[2 * table + 1] + 1) * half_size, key + half_size);
+    }
+
+    /** Splits the heavy buckets of a table with its second-level hash functions
+     * @param table the table
+     * @param split_key buffer for the projections of a point on the second-level functions
+     */
+    void splitBuckets(unsigned int table, std::vector<float>& split_key)
+    {
+        const lsh::LshTable<ElementType>& lsh_table = tables_[table];
+        const lsh::ProjectionBank& split_projections = split_projections_;
+        const std::vector<ElementType*>& points = points_;
+        size_t first = table * split_key_size_, count = split_key_size_;
+        tables_[table].splitBuckets(bucket_size_limit_, split_key_size_, [&](lsh::FeatureIndex index) {
+            split_projections.project(points[index], first, count, &split_key[0]);
+            return lsh_table.getSubKey(&split_key[0]);
+        });
     }
 
 	/*Copy from NN_Index*/
@@ -480,7 +1013,8 @@ protected:
 
     void freeIndex()
     {
-        /* nothing to do here */
+        // The contexts are sized for the index being freed
+        contexts_.clear();
     }
 
 	/*---------------------NN_Index Parameters --------------------------*/
@@ -567,229 +1101,345 @@ private:
 		}
 	}//END_SETDATA
 
-    /** Defines the comparator on score and index
+	/*Copy from NN_Index*/
+	void extendDataset(const Matrix<ElementType>& new_points)
+	{
+		size_t new_size = size_ + new_points.rows;
+		if (removed_) {
+			removed_points_.resize(new_size);
+			ids_.resize(new_size);
+		}
+		points_.resize(new_size);
+		for (size_t i = size_; i<new_size; ++i) {
+			points_[i] = new_points[i - size_];
+			if (removed_) {
+				ids_[i] = last_id_++;
+				removed_points_.reset(i);
+			}
+		}
+		size_ = new_size;
+	}
+
+    /** Performs the approximate nearest-neighbor search.
+     * The bucket of the query is checked in every table, then the multi-probe buckets. With several
+     * resolutions, the tables of the next coarser group are only searched while the query has too few candidates.
+     * Each point is compared to the query at most once, however many of the probed buckets hold it.
+     * The points added since the tables were built are all compared to the query first.
+     * @param vec the feature to analyze
+     * @param result the result set receiving the candidates
+     * @param context the scratch memory of the query
      */
-    typedef std::pair<float, unsigned int> ScoreIndexPair;
-    struct SortScoreIndexPairOnSecond
+	void getNeighbors(const ElementType* vec, ResultSet<DistanceType>& result, SearchContext& context) const
     {
-        bool operator()(const ScoreIndexPair& left, const ScoreIndexPair& right) const
-        {
-            return left.second < right.second;
-        }
-    };
-
-    /** Fills the different xor masks to use when getting the neighbors in multi-probe LSH
-     * @param key the key we build neighbors from
-     * @param lowest_index the lowest index of the bit set
-     * @param level the multi-probe level we are at
-     * @param xor_masks all the xor mask
-     */
-	/*Original version*/
-	/*
-    void fill_xor_mask(lsh::BucketKey key, int lowest_index, unsigned int level,
-                       std::vector<lsh::BucketKey>& xor_masks)
-    {
-        xor_masks.push_back(key);
-        if (level == 0) return;
-        for (int index = lowest_index - 1; index >= 0; --index) {
-            // Create a new key
-            lsh::BucketKey new_key = key | (1 << index);
-            fill_xor_mask(new_key, index, level - 1, xor_masks);
-        }
+		context.checked_.clear();
+		std::fill(context.sub_key_ready_.begin(), context.sub_key_ready_.end(), 0);
+		addPendingPoints(vec, result);
+
+		// From the finest group of tables to the coarsest, until the query has enough candidates
+		for (unsigned int group = 0; group < resolution_number_; ++group) {
+			if (group > 0 && result.full() && context.checks_ >= min_candidates_) return;
+			if (!searchGroup(group, vec, result, context)) return;
+		}
     }
-	*/
 
-	/*
-	void fill_xor_mask(lsh::BucketKey key, int lowest_index, unsigned int level,
-		std::vector<lsh::BucketKey>& xor_masks)
+    /** FNV-1a hash of the bytes of a query
+     */
+	size_t hashQuery(const ElementType* vec) const
 	{
-		xor_masks.push_back(key);
-		if (level == 0) return;
-
-		for (int index = 0; index < key_size_; index++)
-		{
-			lsh::BucketKey tmpkey = key;
-			tmpkey[index] = 1;
-			xor_masks.push_back(tmpkey);
+		const unsigned char* bytes = reinterpret_cast<const unsigned char*>(vec);
+		uint64_t hash = 14695981039346656037ULL;
+		for (size_t i = 0; i < veclen_ * sizeof(ElementType); ++i) {
+			hash = (hash ^ bytes[i]) * 1099511628211ULL;
 		}
+		return size_t(hash);
+	}
 
-		for (int index = 0; index < key_size_; index++)
-		{
-			lsh::BucketKey tmpkey = key;
-			tmpkey[index] = -1;
-			xor_masks.push_back(tmpkey);
+    /** Computes the distance of the query to the points added since the tables were built, which are in no bucket
+     * They are not counted in the checks of the query, as no bucket leads to them.
+     * @param vec the query
+     * @param result the result set receiving the candidates
+     */
+	void addPendingPoints(const ElementType* vec, ResultSet<DistanceType>& result) const
+	{
+		for (size_t i = size_at_build_; i < size_; ++i) {
+			if (removed_ && removed_points_.test(i)) continue;
+			result.addPoint(distance_(vec, points_[i], veclen_), i);
 		}
-		
 	}
-	*/
 
-    /** Performs the approximate nearest-neighbor search.
-     * @param vec the feature to analyze
-     * @param do_radius flag indicating if we check the radius too
-     * @param radius the radius if it is a radius search
-     * @param do_k flag indicating if we limit the number of nn
-     * @param k_nn the number of nearest neighbors
-     * @param checked_average used for debugging
-     */
-    void getNeighbors(const ElementType* vec, bool do_radius, float radius, bool do_k, unsigned int k_nn,
-                      float& checked_average)
-    {
-        static std::vector<ScoreIndexPair> score_index_heap;
-
-        if (do_k) {
-            unsigned int worst_score = std::numeric_limits<unsigned int>::max();
-            typename std::vector<lsh::LshTable<ElementType> >::const_iterator table = tables_.begin();
-            typename std::vector<lsh::LshTable<ElementType> >::const_iterator table_end = tables_.end();
-            for (; table != table_end; ++table) {
-                size_t key = table->getKey(vec);
-                std::vector<lsh::BucketKey>::const_iterator xor_mask = xor_masks_.begin();
-                std::vector<lsh::BucketKey>::const_iterator xor_mask_end = xor_masks_.end();
-                for (; xor_mask != xor_mask_end; ++xor_mask) {
-                    size_t sub_key = key ^ (*xor_mask);
-                    const lsh::Bucket* bucket = table->getBucketFromKey(sub_key);
-                    if (bucket == 0) continue;
-
-                    // Go over each descriptor index
-                    std::vector<lsh::FeatureIndex>::const_iterator training_index = bucket->begin();
-                    std::vector<lsh::FeatureIndex>::const_iterator last_training_index = bucket->end();
-                    DistanceType hamming_distance;
-
-                    // Process the rest of the candidates
-                    for (; training_index < last_training_index; ++training_index) {
-                    	if (removed_ && removed_points_.test(*training_index)) continue;
-                        hamming_distance = distance_(vec, points_[*training_index].point, veclen_);
-
-                        if (hamming_distance < worst_score) {
-                            // Insert the new element
-                            score_index_heap.push_back(ScoreIndexPair(hamming_distance, training_index));
-                            std::push_heap(score_index_heap.begin(), score_index_heap.end());
-
-                            if (score_index_heap.size() > (unsigned int)k_nn) {
-                                // Remove the highest distance value as we have too many elements
-                                std::pop_heap(score_index_heap.begin(), score_index_heap.end());
-                                score_index_heap.pop_back();
-                                // Keep track of the worst score
-                                worst_score = score_index_heap.front().first;
-                            }
-                        }
-                    }
-                }
-            }
-        }
-        else {
-            typename std::vector<lsh::LshTable<ElementType> >::const_iterator table = tables_.begin();
-            typename std::vector<lsh::LshTable<ElementType> >::const_iterator table_end = tables_.end();
-            for (; table != table_end; ++table) {
-                size_t key = table->getKey(vec);
-                std::vector<lsh::BucketKey>::const_iterator xor_mask = xor_masks_.begin();
-                std::vector<lsh::BucketKey>::const_iterator xor_mask_end = xor_masks_.end();
-                for (; xor_mask != xor_mask_end; ++xor_mask) {
-                    size_t sub_key = key ^ (*xor_mask);
-                    const lsh::Bucket* bucket = table->getBucketFromKey(sub_key);
-                    if (bucket == 0) continue;
-
-                    // Go over each descriptor index
-                    std::vector<lsh::FeatureIndex>::const_iterator training_index = bucket->begin();
-                    std::vector<lsh::FeatureIndex>::const_iterator last_training_index = bucket->end();
-                    DistanceType hamming_distance;
-
-                    // Process the rest of the candidates
-                    for (; training_index < last_training_index; ++training_index) {
-                    	if (removed_ && removed_points_.test(*training_index)) continue;
-                        // Compute the Hamming distance
-                        hamming_distance = distance_(vec, points_[*training_index].point, veclen_);
-                        if (hamming_distance < radius) score_index_heap.push_back(ScoreIndexPair(hamming_distance, training_index));
-                    }
-                }
-            }
-        }
+    /** Searches the tables of one group, their buckets then the multi-probe ones
+     * @return false if the search is to stop
+     */
+	bool searchGroup(unsigned int group, const float* vec, ResultSet<DistanceType>& result, SearchContext& context) const
+    {
+		unsigned int first = group * table_number_;
+		unsigned int last = first + table_number_;
+
+		// Project the query against the functions of all the tables of the group in one pass
+		float* transform = context.transform_.empty() ? NULL : &context.transform_[0];
+		if (shared_functions_ > 0) {
+			size_t pool_size = shared_functions_ * (key_size_ / 2);
+			projections_.project(vec, group * pool_size, pool_size, &context.half_keys_[group * pool_size], transform);
+			for (unsigned int i = first; i < last; ++i) {
+				assembleKey(i, &context.half_keys_[0], &context.key_[i * key_size_]);
+			}
+		}
+		else if (!context.cross_polytope_probes_.empty() && multi_probe_level_ > 0) {
+			// The runner-up vertices come with the rotations, for the multi-probe
+			projections_.projectCrossPolytope(vec, first * key_size_, table_number_ * key_size_, &context.key_[first * key_size_],
+			                                  transform, &context.cross_polytope_probes_[2 * first * key_size_]);
+		}
+		else {
+			projections_.project(vec, first * key_size_, table_number_ * key_size_, &context.key_[first * key_size_], transform);
+		}
+
+		for (unsigned int i = first; i < last; ++i) {
+			const lsh::LshTable<ElementType>& table = tables_[i];
+			context.bucket_keys_[i] = table.getBucketKey(&context.key_[i * key_size_]);
+			if (!addBucket(getBucket(i, context.bucket_keys_[i], vec, context, true), vec, result, context)) return false;
+		}
+
+		if (multi_probe_level_ == 0 || probe_number_ == 0) return true;
+
+		// Query-directed multi-probe (Lv et al.): the buckets next to the query are probed in the order of
+		// the distance of the query to the boundaries it crosses to reach them
+		if (global_probing_) {
+			context.probe_sets_.clear();
+			context.probe_heap_.clear();
+			for (unsigned int i = first; i < last; ++i) {
+				initProbes(i, context);
+			}
+			return probeBuckets(vec, result, context, probe_number_ * table_number_);
+		}
+		for (unsigned int i = first; i < last; ++i) {
+			context.probe_sets_.clear();
+			context.probe_heap_.clear();
+			initProbes(i, context);
+			if (!probeBuckets(vec, result, context, probe_number_)) return false;
+		}
+		return true;
     }
 
-    /** Performs the approximate nearest-neighbor search.
-     * This is a slower version than the above as it uses the ResultSet
-     * @param vec the feature to analyze
+    /** Searches the bit-sampling tables of one group, the buckets of the query then those whose keys
+     * differ from its keys by the xor masks, which flip the fewest bits first
+     * @return false if the search is to stop
      */
-	void getNeighbors(const ElementType* vec, KNNUniqueResultSet<DistanceType>& result) const
+	bool searchGroup(unsigned int group, const unsigned char* vec, ResultSet<DistanceType>& result, SearchContext& context) const
     {
-		typename std::vector<lsh::LshTable<ElementType> >::const_iterator table = tables_.begin();
-		typename std::vector<lsh::LshTable<ElementType> >::const_iterator table_end = tables_.end();
-		for (; table != table_end; ++table)
-		{
-			std::vector<float> key = table->getKey(vec);
-			std::vector<int> int_key(key_size_);
-			for (int i = 0; i < key_size_; i++)
-				int_key[i] = floor(key[i]);
-			int perturbation_step = key_size_;
-			
-			//int test = table->eatures_in_a_bucket();
-
-			const lsh::Bucket* bucket = table->getBucketFromKey(int_key);
-			if (bucket == 0)
-			{
+		unsigned int first = group * table_number_;
+		unsigned int last = first + table_number_;
 
-			}
-			else
-			{
-				std::vector<lsh::FeatureIndex>::const_iterator training_index = bucket->begin();
-				std::vector<lsh::FeatureIndex>::const_iterator last_training_index = bucket->end();
-				DistanceType L2_distance;
-
-				// Process the rest of the candidates
-				for (; training_index < last_training_index; ++training_index) 
-				{
-					if (removed_ && removed_points_.test(*training_index)) continue;
-					
-					//time_t time_begin = clock();
-					L2_distance = distance_(vec, points_[*training_index], veclen_);
-					//time_t time_end = clock();
-					//flann::distance_cal_time += time_end - time_begin;
-					//count_calculate_distance_++;
-					
-					result.addPoint(L2_distance, *training_index);
+		for (unsigned int i = first; i < last; ++i) {
+			context.bucket_keys_[i] = tables_[i].getSampledKey(vec);
+			if (!addBucket(tables_[i].getNearestBucket(context.bucket_keys_[i]), vec, result, context)) return false;
+		}
+
+		if (global_probing_) {
+			// Each mask in all the tables before the next one
+			for (size_t mask = 1; mask < xor_masks_.size(); ++mask) {
+				for (unsigned int i = first; i < last; ++i) {
+					if (!addBucket(tables_[i].getBucketFromKey(context.bucket_keys_[i] ^ xor_masks_[mask]), vec, result, context)) return false;
 				}
 			}
+			return true;
+		}
+		for (unsigned int i = first; i < last; ++i) {
+			for (size_t mask = 1; mask < xor_masks_.size(); ++mask) {
+				if (!addBucket(tables_[i].getBucketFromKey(context.bucket_keys_[i] ^ xor_masks_[mask]), vec, result, context)) return false;
+			}
+		}
+		return true;
+    }
 
-			/*Mutli probe = 1*/
-			if (multi_probe_level_ == 1)
+    /** Sorts the perturbations of one table and queues its first perturbation set
+     * Perturbation i (resp. i + key_size_) moves component i of the key down (resp. up) by one bucket,
+     * its score is the squared distance of the projection to the boundary it crosses
+     * @param table the table
+     * @param context the scratch memory of the query
+     */
+    void initProbes(unsigned int table, SearchContext& context) const
+    {
+		const float* key = &context.key_[table * key_size_];
+		std::pair<float, int>* perturbation_pair = &context.perturbations_[2 * table * key_size_];
+		if (!context.cross_polytope_probes_.empty()) {
+			// Perturbation i (resp. i + key_size_) moves function i to its first (resp. second) runner-up vertex
+			const lsh::CrossPolytopeProbe* probes = &context.cross_polytope_probes_[2 * table * key_size_];
+			for (unsigned int i = 0; i < key_size_; i++)
 			{
-				std::vector<std::pair<float, int>> perturbation_pair;
+				perturbation_pair[i] = std::make_pair(probes[2 * i].score_, i);
+				perturbation_pair[i + key_size_] = std::make_pair(probes[2 * i + 1].score_, i + key_size_);
+			}
+		}
+		else {
+			for (unsigned int i = 0; i < key_size_; i++)
+			{
+				float dis_to_floor = key[i] - floor(key[i]);
+				perturbation_pair[i] = std::make_pair(dis_to_floor * dis_to_floor, i);
+				perturbation_pair[i + key_size_] = std::make_pair((1.0f - dis_to_floor) * (1.0f - dis_to_floor), i + key_size_);
+			}
+		}
+		std::sort(perturbation_pair, perturbation_pair + 2 * key_size_);
 
-				for (int i = 0; i < key_size_; i++)
-				{
-					float dis_to_floor = key[i] - int_key[i];
-					perturbation_pair.push_back(std::make_pair(dis_to_floor, i));
-					perturbation_pair.push_back(std::make_pair(1.0 - dis_to_floor, i + key_size_));
-				}
+		typename SearchContext::ProbeSet first = { perturbation_pair[0].first, table, 0, 1, -1 };
+		pushProbeSet(first, context);
+    }
 
-				std::sort(perturbation_pair.begin(), perturbation_pair.end());
-
-				for (int PairIndex = 0; PairIndex < perturbation_step; PairIndex++)
-				{
-					std::vector<int> sub_key = int_key;
-					int ModifyIndex = perturbation_pair[PairIndex].second % key_size_;
-					sub_key[ModifyIndex] = sub_key[ModifyIndex] + 2 * (perturbation_pair[PairIndex].second / key_size_) - 1;
-					const lsh::Bucket* bucket = table->getBucketFromKey(sub_key);
-					if (bucket == 0) continue;
-
-					std::vector<lsh::FeatureIndex>::const_iterator training_index = bucket->begin();
-					std::vector<lsh::FeatureIndex>::const_iterator last_training_index = bucket->end();
-					DistanceType L2_distance;
-
-					// Process the rest of the candidates
-					for (; training_index < last_training_index; ++training_index) {
-						if (removed_ && removed_points_.test(*training_index)) continue;
-						
-						//time_t time_begin = clock();
-						L2_distance = distance_(vec, points_[*training_index], veclen_);
-						//time_t time_end = clock();
-						//flann::distance_cal_time += time_end - time_begin;
-						//count_calculate_distance_++;
-						
-						result.addPoint(L2_distance, *training_index);
-					}
+    /** Probes the buckets of the best perturbation sets until enough buckets were probed
+     * The sets are generated lazily: the successors of a set are its shift (its largest perturbation replaced
+     * by the next one) and its expansion (the next perturbation added), both scoring at least as much as it.
+     * @param vec the query
+     * @param result the result set receiving the candidates
+     * @param context the scratch memory of the query
+     * @param probe_number the number of buckets to probe
+     * @return false if the search must stop
+     */
+    bool probeBuckets(const ElementType* vec, ResultSet<DistanceType>& result, SearchContext& context, size_t probe_number) const
+    {
+		const unsigned int perturbation_number = 2 * key_size_;
+		size_t probed = 0;
+		while (probed < probe_number && !context.probe_heap_.empty()) {
+			std::pop_heap(context.probe_heap_.begin(), context.probe_heap_.end(), std::greater<std::pair<float, int> >());
+			int index = context.probe_heap_.back().second;
+			context.probe_heap_.pop_back();
+			typename SearchContext::ProbeSet set = context.probe_sets_[index];
+
+			if (set.last_ + 1 < perturbation_number) {
+				const std::pair<float, int>* perturbation_pair = &context.perturbations_[set.table_ * perturbation_number];
+				float next_score = perturbation_pair[set.last_ + 1].first;
+				typename SearchContext::ProbeSet shift = { set.score_ - perturbation_pair[set.last_].first + next_score,
+				                                           set.table_, set.last_ + 1, set.size_, set.prefix_ };
+				pushProbeSet(shift, context);
+				if (set.size_ < multi_probe_level_) {
+					typename SearchContext::ProbeSet expand = { set.score_ + next_score, set.table_, set.last_ + 1, set.size_ + 1, index };
+					pushProbeSet(expand, context);
 				}
 			}
+
+			lsh::BucketKey sub_key;
+			if (!getProbeKey(index, context, sub_key)) continue;
+			if (!addBucket(getBucket(set.table_, sub_key, vec, context), vec, result, context)) return false;
+			++probed;
 		}
+		return true;
+    }
+
+    /** Applies a perturbation set to the bucket of the query
+     * @param index the index of the set in the context
+     * @param context the scratch memory of the query
+     * @param key the key of the bucket to probe
+     * @return false if the set moves a component twice, in which case it does not correspond to a bucket
+     */
+    bool getProbeKey(int index, const SearchContext& context, lsh::BucketKey& key) const
+    {
+		const typename SearchContext::ProbeSet& set = context.probe_sets_[index];
+		const lsh::LshTable<ElementType>& table = tables_[set.table_];
+		const std::pair<float, int>* perturbation_pair = &context.perturbations_[set.table_ * 2 * key_size_];
+
+		key = context.bucket_keys_[set.table_];
+		for (int i = index; i >= 0; i = context.probe_sets_[i].prefix_) {
+			int perturbation = perturbation_pair[context.probe_sets_[i].last_].second;
+			int ModifyIndex = perturbation % key_size_;
+			for (int j = context.probe_sets_[i].prefix_; j >= 0; j = context.probe_sets_[j].prefix_) {
+				if (perturbation_pair[context.probe_sets_[j].last_].second % (int)key_size_ == ModifyIndex) return false;
+			}
+			key = table.perturbKey(key, ModifyIndex, getProbeDelta(set.table_, perturbation, context));
+		}
+		return true;
+    }
+
+    /** @return how much a perturbation moves its component of the key: one bucket down or up, or to a
+     * runner-up vertex for the cross-polytope functions
+     */
+    inline int getProbeDelta(unsigned int table, int perturbation, const SearchContext& context) const
+    {
+		if (context.cross_polytope_probes_.empty()) return (perturbation < (int)key_size_) ? -1 : 1;
+		int component = perturbation % key_size_;
+		return context.cross_polytope_probes_[2 * (table * key_size_ + component) + perturbation / key_size_].delta_;
+    }
+
+    /** Queues a perturbation set
+     */
+    void pushProbeSet(const typename SearchContext::ProbeSet& set, SearchContext& context) const
+    {
+		context.probe_sets_.push_back(set);
+		context.probe_heap_.push_back(std::make_pair(set.score_, (int)context.probe_sets_.size() - 1));
+		std::push_heap(context.probe_heap_.begin(), context.probe_heap_.end(), std::greater<std::pair<float, int> >());
+    }
+
+    /** Gets the points of a bucket that have to be checked
+     * For a heavy bucket, only the sub-bucket of the query is
+     * @param table the table of the bucket
+     * @param key the key of the bucket
+     * @param vec the query
+     * @param context the scratch memory of the query
+     * @param nearest whether an empty bucket is replaced by the one sharing the longest key prefix (sorted layout)
+     * @return the points to check
+     */
+    lsh::BucketRange getBucket(unsigned int table, lsh::BucketKey key, const ElementType* vec, SearchContext& context,
+                               bool nearest = false) const
+    {
+		const lsh::LshTable<ElementType>& lsh_table = tables_[table];
+		lsh::BucketRange bucket = nearest ? lsh_table.getNearestBucket(key) : lsh_table.getBucketFromKey(key);
+		if (!lsh_table.isHeavy(bucket)) return bucket;
+
+		if (!context.sub_key_ready_[table]) {
+			split_projections_.project(vec, table * split_key_size_, split_key_size_, &context.split_key_[0]);
+			context.sub_keys_[table] = lsh_table.getSubKey(&context.split_key_[0]);
+			context.sub_key_ready_[table] = 1;
+		}
+		return lsh_table.getSubBucket(bucket, context.sub_keys_[table]);
+    }
+
+    /** Computes the distance of the query to the points of a bucket that were not checked yet
+     * @param bucket the points of the bucket
+     * @param vec the query
+     * @param result the result set receiving the candidates
+     * @param context the scratch memory of the query
+     * @return false if the search must stop, the budget of distances or of unimproved buckets being spent
+     */
+    bool addBucket(const lsh::BucketRange& bucket, const ElementType* vec, ResultSet<DistanceType>& result,
+                   SearchContext& context) const
+    {
+		const lsh::FeatureIndex* points = bucket.begin();
+		size_t size = bucket.size();
+		if (bucket.compressed()) {
+			lsh::decodeBucket(bucket, &context.bucket_[0]);
+			points = &context.bucket_[0];
+		}
+		// The points of a bucket are sorted: a bucket too large to be checked in full is read from a
+		// position that depends on the query, so that the points it gets are not always the lowest ones
+		size_t start = (size > context.max_bucket_checks_) ? context.bucket_rotation_ % size : 0;
+		DistanceType L2_distance;
+		bool improved = false;
+		size_t bucket_checks = 0;
+
+		// Process the rest of the candidates
+		for (size_t i = 0; i < size; ++i)
+		{
+			lsh::FeatureIndex training_index = points[(start + i < size) ? start + i : start + i - size];
+			if (removed_ && removed_points_.test(training_index)) continue;
+			// A point is only marked as checked once its distance is computed, so that one left
+			// out of this bucket by the budgets can still be checked from another one
+			if (context.checks_ >= context.max_checks_) return false;
+			// Bound the work spent in a single bucket
+			if (bucket_checks == context.max_bucket_checks_) break;
+			if (!context.checked_.insert(training_index)) continue;
+			++context.checks_;
+			++bucket_checks;
+
+			//time_t time_begin = clock();
+			L2_distance = distance_(vec, points_[training_index], veclen_);
+			//time_t time_end = clock();
+			//flann::distance_cal_time += time_end - time_begin;
+			//count_calculate_distance_++;
+
+			if (L2_distance < result.worstDist()) improved = true;
+			result.addPoint(L2_distance, training_index);
+		}
+
+		if (improved) context.unimproved_buckets_ = 0;
+		else if (++context.unimproved_buckets_ >= context.max_unimproved_buckets_) return false;
+		return context.checks_ < context.max_checks_;
     }
 
 
@@ -797,25 +1447,100 @@ private:
     {
     	BaseClass::swap(other);
     	std::swap(tables_, other.tables_);
+    	std::swap(projections_, other.projections_);
+    	std::swap(split_projections_, other.split_projections_);
+    	std::swap(bucket_width_, other.bucket_width_);
     	std::swap(size_at_build_, other.size_at_build_);
     	std::swap(table_number_, other.table_number_);
     	std::swap(key_size_, other.key_size_);
     	std::swap(multi_probe_level_, other.multi_probe_level_);
+    	std::swap(probe_number_, other.probe_number_);
+    	std::swap(global_probing_, other.global_probing_);
+    	std::swap(bucket_size_limit_, other.bucket_size_limit_);
+    	std::swap(split_key_size_, other.split_key_size_);
+    	std::swap(compress_buckets_, other.compress_buckets_);
+    	std::swap(random_seed_, other.random_seed_);
+    	std::swap(projection_, other.projection_);
+    	std::swap(shared_functions_, other.shared_functions_);
+    	std::swap(table_halves_, other.table_halves_);
+    	std::swap(projection_precision_, other.projection_precision_);
+    	std::swap(shared_bias_, other.shared_bias_);
+    	std::swap(target_recall_, other.target_recall_);
+    	std::swap(candidate_budget_, other.candidate_budget_);
+    	std::swap(resolution_number_, other.resolution_number_);
+    	std::swap(resolution_factor_, other.resolution_factor_);
+    	std::swap(min_candidates_, other.min_candidates_);
+    	std::swap(sorted_layout_, other.sorted_layout_);
+    	std::swap(kmeans_cells_, other.kmeans_cells_);
     	std::swap(xor_masks_, other.xor_masks_);
+    	contexts_.swap(other.contexts_);
     }
 
-    /** The different hash tables */
+    /** The different hash tables, the table_number_ tables of each group one after the other */
     std::vector<lsh::LshTable<ElementType> > tables_;
+
+    /** The hash functions of all the tables, those of table i being rows [i*key_size_, (i+1)*key_size_)
+     * When the functions are shared, the key_size_/2 functions of each of the shared_functions_ half-keys instead */
+    lsh::ProjectionBank projections_;
+
+    /** The second-level hash functions splitting the heavy buckets, split_key_size_ per table */
+    lsh::ProjectionBank split_projections_;
+
+    /** Width W of the buckets of the hash functions, 0 until estimated if it is to be */
+    float bucket_width_;
+
+    /** Number of features projected at once when building the tables */
+    static const size_t kBuildBlockSize = 256;
+
+    /** Largest sample the learned functions and the k-means cells are trained on */
+    static const size_t kLearningSampleSize = 10000;
     
     /** table number */
     unsigned int table_number_;
     /** key size */
     unsigned int key_size_;
-    /** How far should we look for neighbors in multi-probe LSH */
+    /** How far should we look for neighbors in multi-probe LSH: most components perturbed by a probe */
     unsigned int multi_probe_level_;
-
-    /** The XOR masks to apply to a key to get the neighboring buckets */
-	std::vector<lsh::BucketKey> xor_masks_;
+    /** Number of additional buckets probed per table */
+    unsigned int probe_number_;
+    /** Whether the probes of all the tables are ordered together */
+    bool global_probing_;
+    /** Buckets with more points are split by a second level of hashing, 0 if none is */
+    unsigned int bucket_size_limit_;
+    /** Number of second-level hash functions per table */
+    unsigned int split_key_size_;
+    /** Whether the buckets are stored compressed */
+    bool compress_buckets_;
+    /** Seed of the hash functions, -1 if it is drawn at build time */
+    int random_seed_;
+    /** Kind of projection of the hash functions */
+    flann_lsh_projection_t projection_;
+    /** Number of shared half-keys per group of tables, 0 if the tables have their own functions */
+    unsigned int shared_functions_;
+    /** The two half-keys of each table, numbered over all the groups, when the functions are shared */
+    std::vector<unsigned int> table_halves_;
+    /** Precision of the copy of the weights the dense projection reads first */
+    flann_lsh_precision_t projection_precision_;
+    /** Whether the functions of a table share one offset */
+    bool shared_bias_;
+    /** Recall and most candidates per query the parameters are estimated for, when the width is 0 */
+    float target_recall_;
+    int candidate_budget_;
+    /** Number of groups of tables, and ratio of the bucket widths of consecutive groups */
+    unsigned int resolution_number_;
+    float resolution_factor_;
+    /** Candidates a query needs not to move on to the next group of tables */
+    unsigned int min_candidates_;
+    /** Whether the tables keep their buckets sorted by the Z-order of the keys */
+    bool sorted_layout_;
+    /** Number of k-means cells whose residuals are hashed, 0 if the points are */
+    unsigned int kmeans_cells_;
+    /** For binary features: the masks xored with the key of the query to get the multi-probe buckets,
+     * by increasing number of bits (the first one being 0) */
+    std::vector<lsh::BucketKey> xor_masks_;
+
+    /** Search contexts kept between the search calls, one per thread that searched at the same time */
+    mutable ContextPool<SearchContext> contexts_;
 
     //USING_BASECLASS_SYMBOLS
 };
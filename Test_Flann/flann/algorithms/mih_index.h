@@ -0,0 +1,622 @@
+/***********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ * Copyright 2008-2009  Marius Muja (mariusm@cs.ubc.ca). All rights reserved.
+ * Copyright 2008-2009  David G. Lowe (lowe@cs.ubc.ca). All rights reserved.
+ *
+ * THE BSD LICENSE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *************************************************************************/
+
+#ifndef FLANN_MIH_INDEX_H_
+#define FLANN_MIH_INDEX_H_
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "flann/general.h"
+#include "flann/util/matrix.h"
+#include "flann/util/result_set.h"
+#include "flann/util/lsh_table.h"
+#include "flann/util/visited_set.h"
+#include "flann/util/context_pool.h"
+#include "flann/util/saving.h"
+
+namespace flann
+{
+
+struct MihIndexParams : public IndexParams
+{
+    MihIndexParams(unsigned int substring_number = 0)
+    {
+        (*this)["algorithm"] = FLANN_INDEX_MIH;
+        // The number m of substrings the codes are split into, one table each (0 for about log2(n) bits per substring)
+        (*this)["substring_number"] = substring_number;
+    }
+};
+
+
+/**
+ * Multi-index hashing index (Norouzi et al.), exact Hamming nearest neighbors of binary codes
+ *
+ * The codes are split into m disjoint substrings, each one indexing the points in its own table. Two codes
+ * within r bits of each other are within r / m bits of each other in at least one substring: a query probes
+ * the substrings at increasing radius, until the distance of its k-th neighbor is certified by the radius.
+ * The distance is one of the Hamming ones of dist.h (Hamming, HammingPopcnt) on unsigned char codes.
+ */
+template<typename Distance>
+class MihIndex
+{
+public:
+    typedef typename Distance::ElementType ElementType;
+    typedef typename Distance::ResultType DistanceType;
+
+    /**
+     * Scratch memory of a search, so that queries do not allocate
+     * A context can be reused for any number of queries on the index it was created for,
+     * but only by one thread at a time.
+     */
+    struct SearchContext
+    {
+        SearchContext(const MihIndex& index) :
+            keys_(index.tables_.size()), checked_(index.size_)
+        {
+        }
+
+        /** Substrings of the query */
+        std::vector<lsh::BucketKey> keys_;
+        /** Points whose distance to the query was already computed */
+        VisitedSet checked_;
+        /** Number of distances computed for the query, and the most that can be */
+        size_t checks_;
+        size_t max_checks_;
+    };
+
+    /** Constructor
+     * @param params parameters passed to the multi-index hashing algorithm
+     * @param d the distance used
+     */
+    MihIndex(const IndexParams& params = MihIndexParams(), Distance d = Distance()) :
+		distance_(d), last_id_(0), size_(0), size_at_build_(0), veclen_(0),
+		index_params_(params), removed_(false), removed_count_(0), data_ptr_(NULL)
+    {
+        substring_number_ = get_param<unsigned int>(index_params_,"substring_number",0);
+    }
+
+
+    /** Constructor
+     * @param input_data dataset with the input features
+     * @param params parameters passed to the multi-index hashing algorithm
+     * @param d the distance used
+     */
+    MihIndex(const Matrix<ElementType>& input_data, const IndexParams& params = MihIndexParams(), Distance d = Distance()) :
+		distance_(d), last_id_(0), size_(0), size_at_build_(0), veclen_(0),
+		index_params_(params), removed_(false), removed_count_(0), data_ptr_(NULL)
+    {
+        substring_number_ = get_param<unsigned int>(index_params_,"substring_number",0);
+
+        setDataset(input_data);
+    }
+
+    MihIndex(const MihIndex& other) :
+		distance_(other.distance_), last_id_(other.last_id_), size_(other.size_), size_at_build_(other.size_at_build_),
+		veclen_(other.veclen_), index_params_(other.index_params_), removed_(other.removed_),
+		removed_points_(other.removed_points_), removed_count_(other.removed_count_), ids_(other.ids_),
+		points_(other.points_), data_ptr_(NULL),
+    	tables_(other.tables_),
+    	substring_bits_(other.substring_bits_),
+    	substring_number_(other.substring_number_)
+    {
+    }
+
+    MihIndex& operator=(MihIndex other)
+    {
+    	this->swap(other);
+    	return *this;
+    }
+
+    virtual ~MihIndex()
+    {
+    	freeIndex();
+    }
+
+	MihIndex* clone() const
+    {
+    	return new MihIndex(*this);
+    }
+
+	/*Copy from NN_Index*/
+	void buildIndex()
+	{
+		freeIndex();
+
+		cleanRemovedPoints();
+
+		buildIndexImpl();
+
+		size_at_build_ = size_;
+	}
+
+    flann_algorithm_t getType() const
+    {
+        return FLANN_INDEX_MIH;
+    }
+
+    template<typename Archive>
+    void serialize(Archive& ar)
+    {
+    	ar.setObject(this);
+
+    	ar & substring_number_;
+    	ar & substring_bits_;
+    	ar & tables_;
+
+    	if (Archive::is_loading::value) {
+            index_params_["algorithm"] = getType();
+            index_params_["substring_number"] = substring_number_;
+    	}
+    }
+
+    void saveIndex(FILE* stream)
+    {
+    	serialization::SaveArchive sa(stream);
+    	sa & *this;
+    }
+
+    void loadIndex(FILE* stream)
+    {
+    	freeIndex();
+    	serialization::LoadArchive la(stream);
+    	la & *this;
+    }
+
+    /**
+     * Computes the index memory usage
+     * Returns: memory used by the index
+     */
+    int usedMemory() const
+    {
+        return int(tables_.size() * size_ * sizeof(lsh::FeatureIndex));
+    }
+
+	/*inline function copy from NN_Index*/
+	inline size_t veclen() const
+	{
+		return veclen_;
+	}
+
+	/*copy from NN_Index: the parameters, with the number of substrings chosen at build time*/
+	IndexParams getParameters() const
+	{
+		return index_params_;
+	}
+
+    /**
+     * \brief Perform k-nearest neighbor search
+     * \param[in] queries The query points for which to find the nearest neighbors
+     * \param[out] indices The indices of the nearest neighbors found
+     * \param[out] dists Distances to the nearest neighbors found
+     * \param[in] knn Number of nearest neighbors to return
+     * \param[in] params Search parameters
+     */
+    int knnSearch(const Matrix<ElementType>& queries,
+						Matrix<size_t>& indices,
+    					Matrix<DistanceType>& dists,
+    					size_t knn,
+    					const SearchParams& params) const
+    {
+        assert(queries.cols == veclen_);
+        assert(indices.rows >= queries.rows);
+        assert(dists.rows >= queries.rows);
+        assert(indices.cols >= knn);
+        assert(dists.cols >= knn);
+
+        int count = 0;
+        if (params.use_heap==FLANN_True) {
+#pragma omp parallel num_threads(params.cores)
+        	{
+        		KNNResultSet2<DistanceType> resultSet(knn);
+        		PooledContext<SearchContext, MihIndex> context(contexts_, *this);
+#pragma omp for schedule(static) reduction(+:count)
+        		for (int i = 0; i < (int)queries.rows; i++) {
+        			resultSet.clear();
+        			findNeighbors(resultSet, queries[i], params, context.get());
+        			size_t n = std::min(resultSet.size(), knn);
+        			resultSet.copy(indices[i], dists[i], n, params.sorted);
+        			indices_to_ids(indices[i], indices[i], n);
+        			count += n;
+        		}
+        	}
+        }
+        else {
+#pragma omp parallel num_threads(params.cores)
+        	{
+        		KNNSimpleResultSet<DistanceType> resultSet(knn);
+        		PooledContext<SearchContext, MihIndex> context(contexts_, *this);
+#pragma omp for schedule(static) reduction(+:count)
+        		for (int i = 0; i < (int)queries.rows; i++) {
+        			resultSet.clear();
+        			findNeighbors(resultSet, queries[i], params, context.get());
+        			size_t n = std::min(resultSet.size(), knn);
+        			resultSet.copy(indices[i], dists[i], n, params.sorted);
+        			indices_to_ids(indices[i], indices[i], n);
+        			count += n;
+        		}
+        	}
+        }
+
+        return count;
+    }
+
+	/*Copy from above for size_t to int*/
+	int knnSearch(const Matrix<ElementType>& queries,
+		Matrix<int>& indices,
+		Matrix<DistanceType>& dists,
+		size_t knn,
+		const SearchParams& params) const
+	{
+		flann::Matrix<size_t> indices_(new size_t[indices.rows*indices.cols], indices.rows, indices.cols);
+
+		int result = knnSearch(queries, indices_, dists, knn, params);
+
+		for (size_t i = 0; i<indices.rows; ++i) {
+			for (size_t j = 0; j<indices.cols; ++j) {
+				indices[i][j] = indices_[i][j];
+			}
+		}
+		delete[] indices_.ptr();
+		return result;
+	}
+
+    /**
+     * Find set of nearest neighbors to vec. Their indices are stored inside
+     * the result object.
+     *
+     * Params:
+     *     result = the result object in which the indices of the nearest-neighbors are stored
+     *     vec = the vector for which to search the nearest neighbors
+     *     searchParams = mih_checks caps the number of distances computed (-1, the default, for an exact
+     *                    search); checks does not apply, so that the search is exact with the default parameters
+     */
+    void findNeighbors(ResultSet<DistanceType>& result, const ElementType* vec, const SearchParams& searchParams) const
+    {
+        PooledContext<SearchContext, MihIndex> context(contexts_, *this);
+        findNeighbors(result, vec, searchParams, context.get());
+    }
+
+    /**
+     * Same as above, but using the scratch memory of the caller instead of a context of the index's pool.
+     *
+     * Params:
+     *     context = scratch memory created for this index, owned by the calling thread
+     */
+    void findNeighbors(ResultSet<DistanceType>& result, const ElementType* vec, const SearchParams& searchParams,
+                       SearchContext& context) const
+    {
+        context.checks_ = 0;
+        context.max_checks_ = (searchParams.mih_checks < 0) ? std::numeric_limits<size_t>::max() : searchParams.mih_checks;
+        getNeighbors(vec, result, context);
+    }
+
+protected:
+
+    /**
+     * Builds the index
+     * The substrings are consecutive ranges of bits, their lengths differing by at most one bit
+     */
+    void buildIndexImpl()
+    {
+        size_t bit_number = veclen_ * CHAR_BIT;
+        unsigned int substring_number = substring_number_;
+        if (substring_number == 0) {
+            // Substrings of about log2(n) bits have about one point per bucket
+            double substring_bits = std::max(1.0, std::log((double)std::max(size_, size_t(2))) / std::log(2.0));
+            substring_number = (unsigned int)std::max(1.0, std::floor(bit_number / substring_bits + 0.5));
+            substring_number = std::max(substring_number, (unsigned int)((bit_number + kMaxSubstringBits - 1) / kMaxSubstringBits));
+            substring_number_ = substring_number;
+            index_params_["substring_number"] = substring_number;
+        }
+        if (substring_number > bit_number || (bit_number + substring_number - 1) / substring_number > kMaxSubstringBits) {
+            throw FLANNException("The substrings of multi-index hashing must have between 1 and 32 bits");
+        }
+
+        substring_bits_.resize(substring_number);
+        std::vector<std::vector<size_t> > bits(substring_number);
+        for (size_t s = 0, first = 0; s < substring_number; ++s) {
+            substring_bits_[s] = (unsigned int)(bit_number / substring_number + (s < bit_number % substring_number ? 1 : 0));
+            for (unsigned int i = 0; i < substring_bits_[s]; ++i) bits[s].push_back(first + i);
+            first += substring_bits_[s];
+        }
+
+        tables_.resize(substring_number);
+#pragma omp parallel
+        {
+            std::vector<std::pair<lsh::BucketKey, lsh::FeatureIndex> > features(size_);
+#pragma omp for schedule(dynamic)
+            for (int s = 0; s < (int)substring_number; ++s) {
+                lsh::LshTable<unsigned char>& table = tables_[s];
+                table = lsh::LshTable<unsigned char>((unsigned int)veclen_, bits[s]);
+                for (size_t j = 0; j < size_; ++j) {
+                    features[j] = std::make_pair(table.getSampledKey(points_[j]), lsh::FeatureIndex(j));
+                }
+                table.load(features);
+            }
+        }
+    }
+
+	/*Copy from NN_Index*/
+	void cleanRemovedPoints()
+	{
+		if (!removed_) return;
+
+		size_t last_idx = 0;
+		for (size_t i = 0; i<size_; ++i) {
+			if (!removed_points_.test(i)) {
+				points_[last_idx] = points_[i];
+				ids_[last_idx] = ids_[i];
+				removed_points_.reset(last_idx);
+				++last_idx;
+			}
+		}
+		points_.resize(last_idx);
+		ids_.resize(last_idx);
+		removed_points_.resize(last_idx);
+		size_ = last_idx;
+		removed_count_ = 0;
+	}//END_CleanRemovedPoints
+
+	/*Copy from NN_Index*/
+	void indices_to_ids(const size_t* in, size_t* out, size_t size) const
+	{
+		if (removed_) {
+			for (size_t i = 0; i<size; ++i) {
+				out[i] = ids_[in[i]];
+			}
+		}
+	}
+
+    void freeIndex()
+    {
+        // The contexts are sized for the index being freed
+        contexts_.clear();
+    }
+
+	/*---------------------NN_Index Parameters --------------------------*/
+
+	/**
+	* The distance functor
+	*/
+	Distance distance_;
+
+	/**
+	* Each index point has an associated ID. IDs are assigned sequentially in
+	* increasing order. This indicates the ID assigned to the last point added to the
+	* index.
+	*/
+	size_t last_id_;
+
+	/**
+	* Number of points in the index (and database)
+	*/
+	size_t size_;
+
+	/**
+	* Number of features in the dataset when the index was last built.
+	*/
+	size_t size_at_build_;
+
+	/**
+	* Size of one point in the index (and database)
+	*/
+	size_t veclen_;
+
+	/**
+	* Parameters of the index.
+	*/
+	IndexParams index_params_;
+
+	/**
+	* Flag indicating if at least a point was removed from the index
+	*/
+	bool removed_;
+
+	/**
+	* Array used to mark points removed from the index
+	*/
+	DynamicBitset removed_points_;
+
+	/**
+	* Number of points removed from the index
+	*/
+	size_t removed_count_;
+
+	/**
+	* Array of point IDs, returned by nearest-neighbour operations
+	*/
+	std::vector<size_t> ids_;
+
+	/**
+	* Point data
+	*/
+	std::vector<ElementType*> points_;
+
+	/**
+	* Pointer to dataset memory if allocated by this index, otherwise NULL
+	*/
+	ElementType* data_ptr_;
+
+private:
+
+	/*Copy from NN_Index*/
+	void setDataset(const Matrix<ElementType>& dataset)
+	{
+		size_ = dataset.rows;
+		veclen_ = dataset.cols;
+		last_id_ = 0;
+
+		ids_.clear();
+		removed_points_.clear();
+		removed_ = false;
+		removed_count_ = 0;
+
+		points_.resize(size_);
+		for (size_t i = 0; i<size_; ++i) {
+			points_[i] = dataset[i];
+		}
+	}//END_SETDATA
+
+    /** Performs the exact nearest-neighbor search.
+     * At radius r, the buckets whose key differs from the substring of the query by exactly r bits are probed
+     * in each substring in turn. Once substring s is done, a point not seen yet differs from the query by more
+     * than r bits in the substrings 0..s, and by at least r bits in the others: it is at least m * r + s + 1
+     * bits away. The search stops as soon as the k-th neighbor is not farther than that.
+     * When the neighbors are so far that probing the keys would cost more than checking all the points, the
+     * remaining points are checked linearly instead.
+     * @param vec the feature to analyze
+     * @param result the result set receiving the candidates
+     * @param context the scratch memory of the query
+     */
+	void getNeighbors(const ElementType* vec, ResultSet<DistanceType>& result, SearchContext& context) const
+    {
+		context.checked_.clear();
+		unsigned int substring_number = (unsigned int)tables_.size();
+		unsigned int max_radius = 0;
+		for (unsigned int s = 0; s < substring_number; ++s) {
+			context.keys_[s] = tables_[s].getSampledKey(vec);
+			max_radius = std::max(max_radius, substring_bits_[s]);
+		}
+
+		double probes = 0;
+		for (unsigned int radius = 0; radius <= max_radius; ++radius) {
+			for (unsigned int s = 0; s < substring_number; ++s) {
+				if (radius <= substring_bits_[s]) {
+					probes += binomial(substring_bits_[s], radius);
+					if (probes * kProbeCost > double(size_)) {
+						for (size_t index = 0; index < size_; ++index) {
+							if (!checkPoint(lsh::FeatureIndex(index), vec, result, context)) return;
+						}
+						return;
+					}
+					// Gosper's hack: the masks of radius bits out of substring_bits_[s], in increasing order
+					lsh::BucketKey end = lsh::BucketKey(1) << substring_bits_[s];
+					for (lsh::BucketKey mask = (lsh::BucketKey(1) << radius) - 1; mask < end; mask = nextCombination(mask)) {
+						if (!addBucket(tables_[s].getBucketFromKey(context.keys_[s] ^ mask), vec, result, context)) return;
+						if (mask == 0) break;
+					}
+				}
+				size_t bound = size_t(substring_number) * radius + s + 1;
+				if (result.full() && result.worstDist() <= DistanceType(bound)) return;
+			}
+		}
+    }
+
+    /** @return the next larger integer with as many bits set as mask, which is not 0
+     */
+    static inline lsh::BucketKey nextCombination(lsh::BucketKey mask)
+    {
+		lsh::BucketKey lowest = mask & (~mask + 1);
+		lsh::BucketKey ripple = mask + lowest;
+		return (((ripple ^ mask) >> 2) / lowest) | ripple;
+    }
+
+    /** @return the number of combinations of k out of n, as a double not to overflow
+     */
+    static inline double binomial(unsigned int n, unsigned int k)
+    {
+		double count = 1;
+		for (unsigned int i = 0; i < k; ++i) count = count * (n - i) / (i + 1);
+		return count;
+    }
+
+    /** Computes the distance of the query to the points of a bucket that were not checked yet
+     * @return false if the search is to stop, the budget of distances being spent
+     */
+    bool addBucket(const lsh::BucketRange& bucket, const ElementType* vec, ResultSet<DistanceType>& result,
+                   SearchContext& context) const
+    {
+		for (const lsh::FeatureIndex* index = bucket.begin(); index < bucket.end(); ++index) {
+			if (!checkPoint(*index, vec, result, context)) return false;
+		}
+		return true;
+    }
+
+    /** Computes the distance of the query to a point, if it was not checked yet
+     * @return false if the search is to stop, the budget of distances being spent
+     */
+    inline bool checkPoint(lsh::FeatureIndex index, const ElementType* vec, ResultSet<DistanceType>& result,
+                           SearchContext& context) const
+    {
+		if (!context.checked_.insert(index)) return true;
+		if (removed_ && removed_points_.test(index)) return true;
+		if (context.checks_ >= context.max_checks_) return false;
+		++context.checks_;
+
+		DistanceType dist = distance_(vec, points_[index], veclen_);
+		result.addPoint(dist, index);
+		return true;
+    }
+
+    void swap(MihIndex& other)
+    {
+    	std::swap(distance_, other.distance_);
+    	std::swap(last_id_, other.last_id_);
+    	std::swap(size_, other.size_);
+    	std::swap(size_at_build_, other.size_at_build_);
+    	std::swap(veclen_, other.veclen_);
+    	std::swap(index_params_, other.index_params_);
+    	std::swap(removed_, other.removed_);
+    	std::swap(removed_points_, other.removed_points_);
+    	std::swap(removed_count_, other.removed_count_);
+    	std::swap(ids_, other.ids_);
+    	std::swap(points_, other.points_);
+    	std::swap(data_ptr_, other.data_ptr_);
+    	std::swap(tables_, other.tables_);
+    	std::swap(substring_bits_, other.substring_bits_);
+    	std::swap(substring_number_, other.substring_number_);
+    	contexts_.swap(other.contexts_);
+    }
+
+    /** One table per substring, keyed by its bits */
+    std::vector<lsh::LshTable<unsigned char> > tables_;
+
+    /** Number of bits of each substring */
+    std::vector<unsigned int> substring_bits_;
+
+    /** Cost of probing a key, a random access to a table, in distances to sequential points */
+    static const unsigned int kProbeCost = 16;
+
+    /** Most bits of a substring, for the keys around the query to be enumerated at every radius */
+    static const size_t kMaxSubstringBits = 32;
+
+    /** Number of substrings, 0 until chosen at build time if it is to be */
+    unsigned int substring_number_;
+
+    /** Search contexts kept between the search calls, one per thread that searched at the same time */
+    mutable ContextPool<SearchContext> contexts_;
+};
+}
+
+#endif //FLANN_MIH_INDEX_H_
@@ -60,6 +60,18 @@
 #define FLANN_DEPRECATED
 #endif
 
+#ifdef FLANN_PREFETCH
+#undef FLANN_PREFETCH
+#endif
+#ifdef __GNUC__
+#define FLANN_PREFETCH(address) __builtin_prefetch(address)
+#elif defined(_MSC_VER)
+#include <xmmintrin.h>
+#define FLANN_PREFETCH(address) _mm_prefetch((const char*)(address), _MM_HINT_T0)
+#else
+#define FLANN_PREFETCH(address)
+#endif
+
 #undef FLANN_PLATFORM_64_BIT
 #undef FLANN_PLATFORM_32_BIT
 #if __amd64__ || __x86_64__ || _WIN64 || _M_X64
@@ -88,6 +100,8 @@ enum flann_algorithm_t
 #ifdef FLANN_USE_CUDA
     FLANN_INDEX_KDTREE_CUDA 	= 7,
 #endif
+    FLANN_INDEX_LSH_FOREST 		= 8,
+    FLANN_INDEX_MIH 			= 9,
     FLANN_INDEX_SAVED 			= 254,
     FLANN_INDEX_AUTOTUNED 		= 255,
 };
@@ -99,6 +113,23 @@ enum flann_centers_init_t
     FLANN_CENTERS_KMEANSPP = 2,
 };
 
+enum flann_lsh_projection_t
+{
+    FLANN_LSH_PROJECTION_GAUSSIAN = 0,
+    FLANN_LSH_PROJECTION_SPARSE = 1,
+    FLANN_LSH_PROJECTION_HADAMARD = 2,
+    FLANN_LSH_PROJECTION_PCA = 3,
+    FLANN_LSH_PROJECTION_ITQ = 4,
+    FLANN_LSH_PROJECTION_CROSS_POLYTOPE = 5,
+};
+
+enum flann_lsh_precision_t
+{
+    FLANN_LSH_PRECISION_FLOAT32 = 0,
+    FLANN_LSH_PRECISION_FLOAT16 = 1,
+    FLANN_LSH_PRECISION_INT8 = 2,
+};
+
 enum flann_log_level_t
 {
     FLANN_LOG_NONE = 0,
@@ -46,6 +46,8 @@
 //#include "flann/algorithms/all_indices.h"
 #include "flann/algorithms/kdtree_index.h"
 #include "flann/algorithms/lsh_index.h"
+#include "flann/algorithms/lsh_forest_index.h"
+#include "flann/algorithms/mih_index.h"
 #include "flann/util/logger.h"
 #include "flann/algorithms/dist.h"
 
@@ -0,0 +1,158 @@
+/***********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ * Copyright 2008-2009  Marius Muja (mariusm@cs.ubc.ca). All rights reserved.
+ * Copyright 2008-2009  David G. Lowe (lowe@cs.ubc.ca). All rights reserved.
+ *
+ * THE BSD LICENSE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *************************************************************************/
+
+#ifndef FLANN_CONTEXT_POOL_H_
+#define FLANN_CONTEXT_POOL_H_
+
+#include <mutex>
+#include <vector>
+
+namespace flann {
+
+/** Pool of the search contexts of an index, kept from one search call to the next
+ * A thread takes a context from the pool for its queries and gives it back afterwards, a
+ * context being created only when none is free. The scratch memory of the contexts, sized for
+ * the dataset, is thus allocated once per thread rather than once per call. The contexts are only
+ * valid for the index they were created for: the index clears its pool when it is rebuilt.
+ */
+template<typename Context>
+class ContextPool
+{
+public:
+    /** Default constructor
+     */
+    ContextPool()
+    {
+    }
+
+    /** The contexts belong to the index, so a copy of an index starts with an empty pool
+     */
+    ContextPool(const ContextPool&)
+    {
+    }
+
+    ContextPool& operator=(const ContextPool&)
+    {
+        clear();
+        return *this;
+    }
+
+    ~ContextPool()
+    {
+        clear();
+    }
+
+    /** Takes a free context, or creates one if there is none
+     * @param index the index the context is for
+     */
+    template<typename Index>
+    Context* acquire(const Index& index)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!free_.empty()) {
+                Context* context = free_.back();
+                free_.pop_back();
+                return context;
+            }
+        }
+        return new Context(index);
+    }
+
+    /** Gives a context back to the pool
+     */
+    void release(Context* context)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.push_back(context);
+    }
+
+    /** Deletes the free contexts
+     */
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < free_.size(); ++i) {
+            delete free_[i];
+        }
+        free_.clear();
+    }
+
+    /** Exchanges the contexts of two pools, along with the indexes they belong to
+     */
+    void swap(ContextPool& other)
+    {
+        std::lock(mutex_, other.mutex_);
+        std::lock_guard<std::mutex> lock(mutex_, std::adopt_lock);
+        std::lock_guard<std::mutex> other_lock(other.mutex_, std::adopt_lock);
+        free_.swap(other.free_);
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<Context*> free_;
+};
+
+/** A context of a pool, taken when it is first used and given back when it goes out of scope
+ * A thread of a search call that gets no query thus takes no context.
+ */
+template<typename Context, typename Index>
+class PooledContext
+{
+public:
+    PooledContext(ContextPool<Context>& pool, const Index& index) : pool_(pool), index_(index), context_(NULL)
+    {
+    }
+
+    ~PooledContext()
+    {
+        if (context_ != NULL) pool_.release(context_);
+    }
+
+    /** @return the context, taken from the pool on the first call
+     */
+    Context& get()
+    {
+        if (context_ == NULL) context_ = pool_.acquire(index_);
+        return *context_;
+    }
+
+private:
+    PooledContext(const PooledContext&);
+    PooledContext& operator=(const PooledContext&);
+
+    ContextPool<Context>& pool_;
+    const Index& index_;
+    Context* context_;
+};
+
+} // namespace flann
+
+#endif // FLANN_CONTEXT_POOL_H_
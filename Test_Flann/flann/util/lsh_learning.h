@@ -0,0 +1,345 @@
+/***********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ * Copyright 2008-2009  Marius Muja (mariusm@cs.ubc.ca). All rights reserved.
+ * Copyright 2008-2009  David G. Lowe (lowe@cs.ubc.ca). All rights reserved.
+ *
+ * THE BSD LICENSE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *************************************************************************/
+
+#ifndef FLANN_LSH_LEARNING_H_
+#define FLANN_LSH_LEARNING_H_
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "flann/util/lsh_tuning.h"
+
+namespace flann
+{
+
+namespace lsh
+{
+
+/** Eigen decomposition of a small symmetric matrix by cyclic Jacobi rotations
+ * @param matrix the n x n matrix, row major, destroyed
+ * @param n the size of the matrix
+ * @param values the n eigenvalues, in decreasing order
+ * @param vectors the n eigenvectors, one per row in the order of the eigenvalues
+ */
+inline void symmetricEigen(std::vector<double>& matrix, size_t n, std::vector<double>& values, std::vector<double>& vectors)
+{
+    const int kMaxSweeps = 50;
+    std::vector<double> v(n * n, 0.0);
+    for (size_t i = 0; i < n; ++i) v[i * n + i] = 1;
+
+    for (int sweep = 0; sweep < kMaxSweeps; ++sweep) {
+        double off_diagonal = 0, diagonal = 0;
+        for (size_t i = 0; i < n; ++i) {
+            diagonal += matrix[i * n + i] * matrix[i * n + i];
+            for (size_t j = i + 1; j < n; ++j) off_diagonal += matrix[i * n + j] * matrix[i * n + j];
+        }
+        if (off_diagonal <= 1e-24 * diagonal || off_diagonal == 0) break;
+
+        for (size_t p = 0; p < n; ++p) {
+            for (size_t q = p + 1; q < n; ++q) {
+                double apq = matrix[p * n + q];
+                if (apq == 0) continue;
+                // Rotation zeroing a_pq
+                double theta = (matrix[q * n + q] - matrix[p * n + p]) / (2 * apq);
+                double t = (theta >= 0 ? 1 : -1) / (std::fabs(theta) + std::sqrt(theta * theta + 1));
+                double c = 1 / std::sqrt(t * t + 1), s = t * c;
+                for (size_t k = 0; k < n; ++k) {
+                    double akp = matrix[k * n + p], akq = matrix[k * n + q];
+                    matrix[k * n + p] = c * akp - s * akq;
+                    matrix[k * n + q] = s * akp + c * akq;
+                }
+                for (size_t k = 0; k < n; ++k) {
+                    double apk = matrix[p * n + k], aqk = matrix[q * n + k];
+                    matrix[p * n + k] = c * apk - s * aqk;
+                    matrix[q * n + k] = s * apk + c * aqk;
+                }
+                for (size_t k = 0; k < n; ++k) {
+                    double vkp = v[k * n + p], vkq = v[k * n + q];
+                    v[k * n + p] = c * vkp - s * vkq;
+                    v[k * n + q] = s * vkp + c * vkq;
+                }
+            }
+        }
+    }
+
+    std::vector<std::pair<double, size_t> > order(n);
+    for (size_t i = 0; i < n; ++i) order[i] = std::make_pair(-matrix[i * n + i], i);
+    std::sort(order.begin(), order.end());
+    values.resize(n);
+    vectors.resize(n * n);
+    for (size_t i = 0; i < n; ++i) {
+        values[i] = -order[i].first;
+        for (size_t k = 0; k < n; ++k) vectors[i * n + k] = v[k * n + order[i].second];
+    }
+}
+
+/** Orthonormalizes the rows of a matrix in place (modified Gram-Schmidt)
+ * A row dependent on the previous ones is replaced by a random direction.
+ * @param rows the count x dimension matrix, row major
+ */
+template<typename Generator>
+void orthonormalizeRows(std::vector<double>& rows, size_t count, size_t dimension, Generator& gen)
+{
+    std::normal_distribution<> normal(0.0, 1.0);
+    for (size_t i = 0; i < count; ++i) {
+        double* row = &rows[i * dimension];
+        for (int attempt = 0; ; ++attempt) {
+            for (size_t j = 0; j < i; ++j) {
+                const double* previous = &rows[j * dimension];
+                double projection = 0;
+                for (size_t k = 0; k < dimension; ++k) projection += row[k] * previous[k];
+                for (size_t k = 0; k < dimension; ++k) row[k] -= projection * previous[k];
+            }
+            double norm = 0;
+            for (size_t k = 0; k < dimension; ++k) norm += row[k] * row[k];
+            norm = std::sqrt(norm);
+            if (norm > 1e-10 || attempt == 2) {
+                for (size_t k = 0; k < dimension; ++k) row[k] /= (norm > 0 ? norm : 1);
+                break;
+            }
+            for (size_t k = 0; k < dimension; ++k) row[k] = normal(gen);
+        }
+    }
+}
+
+/** Draws a uniformly random rotation
+ * @param dimension the size of the rotation
+ * @param gen the random generator
+ * @param rotation the dimension x dimension orthogonal matrix, row major
+ */
+template<typename Generator>
+void randomRotation(size_t dimension, Generator& gen, std::vector<double>& rotation)
+{
+    std::normal_distribution<> normal(0.0, 1.0);
+    rotation.resize(dimension * dimension);
+    for (size_t k = 0; k < rotation.size(); ++k) rotation[k] = normal(gen);
+    orthonormalizeRows(rotation, dimension, dimension, gen);
+}
+
+/** The leading principal directions of a centered sample, by subspace iteration on its covariance
+ * @param sample the count x dimension centered sample, row major
+ * @param components the number of directions, at most dimension
+ * @param gen the random generator of the starting subspace
+ * @param directions the components x dimension orthonormal directions, of decreasing variance
+ */
+template<typename Generator>
+void principalDirections(const std::vector<float>& sample, size_t count, size_t dimension, size_t components,
+                         Generator& gen, std::vector<double>& directions)
+{
+    const int kIterations = 100;
+
+    // Covariance, each thread filling its own rows
+    std::vector<double> covariance(dimension * dimension, 0.0);
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int)dimension; ++i) {
+        double* row = &covariance[i * dimension];
+        for (size_t n = 0; n < count; ++n) {
+            const float* x = &sample[n * dimension];
+            double xi = x[i];
+            for (size_t j = 0; j <= (size_t)i; ++j) row[j] += xi * x[j];
+        }
+    }
+    for (size_t i = 0; i < dimension; ++i) {
+        for (size_t j = 0; j <= i; ++j) covariance[j * dimension + i] = covariance[i * dimension + j];
+    }
+
+    std::normal_distribution<> normal(0.0, 1.0);
+    directions.resize(components * dimension);
+    for (size_t k = 0; k < directions.size(); ++k) directions[k] = normal(gen);
+    orthonormalizeRows(directions, components, dimension, gen);
+
+    std::vector<double> product(components * dimension);
+    for (int iteration = 0; iteration < kIterations; ++iteration) {
+        for (size_t c = 0; c < components; ++c) {
+            const double* q = &directions[c * dimension];
+            for (size_t i = 0; i < dimension; ++i) {
+                const double* row = &covariance[i * dimension];
+                double sum = 0;
+                for (size_t j = 0; j < dimension; ++j) sum += row[j] * q[j];
+                product[c * dimension + i] = sum;
+            }
+        }
+        directions.swap(product);
+        orthonormalizeRows(directions, components, dimension, gen);
+    }
+
+    // Rayleigh-Ritz: the directions of the subspace that diagonalize the covariance
+    std::vector<double> projected(components * components, 0.0);
+    for (size_t c = 0; c < components; ++c) {
+        const double* q = &directions[c * dimension];
+        for (size_t i = 0; i < dimension; ++i) {
+            const double* row = &covariance[i * dimension];
+            double sum = 0;
+            for (size_t j = 0; j < dimension; ++j) sum += row[j] * q[j];
+            product[c * dimension + i] = sum;
+        }
+    }
+    for (size_t a = 0; a < components; ++a) {
+        for (size_t b = 0; b < components; ++b) {
+            double sum = 0;
+            for (size_t i = 0; i < dimension; ++i) sum += directions[a * dimension + i] * product[b * dimension + i];
+            projected[a * components + b] = sum;
+        }
+    }
+    std::vector<double> values, vectors;
+    symmetricEigen(projected, components, values, vectors);
+    std::fill(product.begin(), product.end(), 0.0);
+    for (size_t c = 0; c < components; ++c) {
+        for (size_t b = 0; b < components; ++b) {
+            double weight = vectors[c * components + b];
+            for (size_t i = 0; i < dimension; ++i) product[c * dimension + i] += weight * directions[b * dimension + i];
+        }
+    }
+    directions.swap(product);
+}
+
+/** Iterative quantization (Gong and Lazebnik): refines a rotation of PCA codes so that the rotated codes
+ * are as close as possible to their signs, i.e. away from the hashing boundaries at 0.
+ * Alternates B = sign(V R) and R = the orthogonal polar factor of V^T B, which minimizes |B - V R|.
+ * @param codes the count x dimension projections of a centered sample on the principal directions
+ * @param iterations the number of alternations
+ * @param rotation the dimension x dimension rotation to start from, refined in place
+ */
+inline void iterativeQuantization(const std::vector<float>& codes, size_t count, size_t dimension, int iterations,
+                                  std::vector<double>& rotation)
+{
+    std::vector<double> correlation(dimension * dimension), gram(dimension * dimension);
+    std::vector<double> rotated(dimension), values, vectors;
+    for (int iteration = 0; iteration < iterations; ++iteration) {
+        // V^T B
+        std::fill(correlation.begin(), correlation.end(), 0.0);
+        for (size_t n = 0; n < count; ++n) {
+            const float* v = &codes[n * dimension];
+            for (size_t j = 0; j < dimension; ++j) {
+                double sum = 0;
+                for (size_t i = 0; i < dimension; ++i) sum += v[i] * rotation[i * dimension + j];
+                rotated[j] = (sum >= 0) ? 1 : -1;
+            }
+            for (size_t i = 0; i < dimension; ++i) {
+                for (size_t j = 0; j < dimension; ++j) correlation[i * dimension + j] += v[i] * rotated[j];
+            }
+        }
+
+        // Polar factor M (M^T M)^-1/2, from the eigen decomposition of M^T M
+        for (size_t a = 0; a < dimension; ++a) {
+            for (size_t b = 0; b < dimension; ++b) {
+                double sum = 0;
+                for (size_t i = 0; i < dimension; ++i) sum += correlation[i * dimension + a] * correlation[i * dimension + b];
+                gram[a * dimension + b] = sum;
+            }
+        }
+        symmetricEigen(gram, dimension, values, vectors);
+        if (values.empty() || values.back() <= 1e-12 * values.front()) break;
+        // (M^T M)^-1/2 = sum_k w_k w_k^T / sigma_k
+        std::fill(gram.begin(), gram.end(), 0.0);
+        for (size_t k = 0; k < dimension; ++k) {
+            double inverse = 1 / std::sqrt(values[k]);
+            const double* w = &vectors[k * dimension];
+            for (size_t a = 0; a < dimension; ++a) {
+                for (size_t b = 0; b < dimension; ++b) gram[a * dimension + b] += inverse * w[a] * w[b];
+            }
+        }
+        for (size_t i = 0; i < dimension; ++i) {
+            for (size_t j = 0; j < dimension; ++j) {
+                double sum = 0;
+                for (size_t k = 0; k < dimension; ++k) sum += correlation[i * dimension + k] * gram[k * dimension + j];
+                rotation[i * dimension + j] = sum;
+            }
+        }
+    }
+}
+
+/** Lloyd's k-means of a sample
+ * @param sample the count x dimension sample, row major
+ * @param cells the number of centers, at most count
+ * @param iterations the number of Lloyd iterations
+ * @param gen the random generator of the initial centers, and of those replacing the empty cells
+ * @param centers the cells x dimension centers
+ */
+template<typename Generator>
+void kmeans(const std::vector<float>& sample, size_t count, size_t dimension, size_t cells, int iterations,
+            Generator& gen, std::vector<float>& centers)
+{
+    // Distinct sample points as initial centers
+    std::vector<size_t> order(count);
+    for (size_t n = 0; n < count; ++n) order[n] = n;
+    for (size_t c = 0; c < cells; ++c) {
+        std::uniform_int_distribution<size_t> pick(c, count - 1);
+        std::swap(order[c], order[pick(gen)]);
+    }
+    centers.resize(cells * dimension);
+    for (size_t c = 0; c < cells; ++c) {
+        std::copy(&sample[order[c] * dimension], &sample[order[c] * dimension] + dimension, &centers[c * dimension]);
+    }
+
+    std::vector<unsigned int> assignment(count);
+    std::vector<double> sums(cells * dimension);
+    std::vector<size_t> sizes(cells);
+    std::uniform_int_distribution<size_t> pick(0, count - 1);
+    for (int iteration = 0; iteration < iterations; ++iteration) {
+#pragma omp parallel for schedule(static)
+        for (int n = 0; n < (int)count; ++n) {
+            const float* x = &sample[n * dimension];
+            float best = std::numeric_limits<float>::max();
+            for (size_t c = 0; c < cells; ++c) {
+                float distance = squaredDistance(x, &centers[c * dimension], dimension);
+                if (distance < best) {
+                    best = distance;
+                    assignment[n] = (unsigned int)c;
+                }
+            }
+        }
+        std::fill(sums.begin(), sums.end(), 0.0);
+        std::fill(sizes.begin(), sizes.end(), 0);
+        for (size_t n = 0; n < count; ++n) {
+            const float* x = &sample[n * dimension];
+            double* sum = &sums[assignment[n] * dimension];
+            for (size_t k = 0; k < dimension; ++k) sum[k] += x[k];
+            ++sizes[assignment[n]];
+        }
+        for (size_t c = 0; c < cells; ++c) {
+            float* center = &centers[c * dimension];
+            if (sizes[c] == 0) {
+                const float* x = &sample[pick(gen) * dimension];
+                std::copy(x, x + dimension, center);
+                continue;
+            }
+            for (size_t k = 0; k < dimension; ++k) center[k] = float(sums[c * dimension + k] / sizes[c]);
+        }
+    }
+}
+
+}
+}
+
+#endif /* FLANN_LSH_LEARNING_H_ */
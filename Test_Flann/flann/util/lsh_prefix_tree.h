@@ -0,0 +1,189 @@
+/***********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ * Copyright 2008-2009  Marius Muja (mariusm@cs.ubc.ca). All rights reserved.
+ * Copyright 2008-2009  David G. Lowe (lowe@cs.ubc.ca). All rights reserved.
+ *
+ * THE BSD LICENSE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *************************************************************************/
+
+#ifndef FLANN_LSH_PREFIX_TREE_H_
+#define FLANN_LSH_PREFIX_TREE_H_
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#include "flann/util/lsh_table.h"
+
+namespace flann
+{
+
+namespace lsh
+{
+
+/** The prefix tree of an LSH Forest (Bawa et al.)
+ * The label of a point is the sequence of its quantized projections on the functions of the tree, one
+ * component per level. The labels are packed in a 64 bit word, the first component in the highest bits,
+ * and only the lowest 64/depth bits of each component are kept (components further apart than that wrap
+ * around, which only merges far apart nodes). The points are stored sorted by label: the points below a
+ * node of the tree, i.e. sharing a prefix of their label, are then a contiguous range of that order.
+ */
+class PrefixTree
+{
+public:
+    PrefixTree() : depth_(0), component_bits_(0)
+    {
+    }
+
+    /** @param depth the number of components of the labels, at most 64
+     */
+    explicit PrefixTree(unsigned int depth) : depth_(depth), component_bits_(depth > 0 ? 64 / depth : 0)
+    {
+    }
+
+    /** Packs the quantized projections of a feature into its label
+     * @param projections the depth projections of the feature, divided by the bucket width
+     */
+    inline BucketKey getLabel(const float* projections) const
+    {
+        BucketKey label = 0;
+        BucketKey mask = componentMask();
+        for (unsigned int i = 0; i < depth_; ++i) {
+            BucketKey component = BucketKey((long long)std::floor(projections[i])) & mask;
+            label |= component << (64 - (i + 1) * component_bits_);
+        }
+        return label;
+    }
+
+    /** Sorts the points by label
+     * @param labels the label of each point with its index, reordered
+     */
+    void build(std::vector<std::pair<BucketKey, FeatureIndex> >& labels)
+    {
+        std::sort(labels.begin(), labels.end());
+        labels_.resize(labels.size());
+        indices_.resize(labels.size());
+        for (size_t i = 0; i < labels.size(); ++i) {
+            labels_[i] = labels[i].first;
+            indices_[i] = labels[i].second;
+        }
+    }
+
+    /** Descends the tree along a label
+     * @param label the label
+     * @param position set to where the label would be inserted in the order of the points
+     * @return the depth of the deepest node reached, the longest prefix the label shares with a point
+     */
+    unsigned int descend(BucketKey label, size_t& position) const
+    {
+        position = std::lower_bound(labels_.begin(), labels_.end(), label) - labels_.begin();
+        unsigned int depth = 0;
+        if (position < labels_.size()) depth = commonDepth(label, labels_[position]);
+        if (position > 0) depth = std::max(depth, commonDepth(label, labels_[position - 1]));
+        return depth;
+    }
+
+    /** The points below the node of a label at a given depth
+     * @param label the label
+     * @param depth the depth of the node, 0 for the root
+     * @param first set to the first point of the node
+     * @param last set to one past the last point of the node
+     */
+    void getRange(BucketKey label, unsigned int depth, size_t& first, size_t& last) const
+    {
+        if (depth == 0) {
+            first = 0;
+            last = labels_.size();
+            return;
+        }
+        BucketKey prefix_mask = ~BucketKey(0) << (64 - depth * component_bits_);
+        first = std::lower_bound(labels_.begin(), labels_.end(), label & prefix_mask) - labels_.begin();
+        last = std::upper_bound(labels_.begin() + first, labels_.end(), label | ~prefix_mask) - labels_.begin();
+    }
+
+    /** @return the index of the point at a position of the order
+     */
+    inline FeatureIndex getIndex(size_t position) const
+    {
+        return indices_[position];
+    }
+
+    /** @return the number of points in the tree
+     */
+    size_t size() const
+    {
+        return labels_.size();
+    }
+
+    /** @return the depth of the tree
+     */
+    unsigned int depth() const
+    {
+        return depth_;
+    }
+
+    template<typename Archive>
+    void serialize(Archive& ar)
+    {
+        ar & depth_;
+        ar & component_bits_;
+        ar & labels_;
+        ar & indices_;
+    }
+    friend struct serialization::access;
+
+private:
+    inline BucketKey componentMask() const
+    {
+        return (component_bits_ >= 64) ? ~BucketKey(0) : (BucketKey(1) << component_bits_) - 1;
+    }
+
+    /** Number of leading components two labels share
+     */
+    inline unsigned int commonDepth(BucketKey a, BucketKey b) const
+    {
+        BucketKey difference = a ^ b;
+        unsigned int depth = 0;
+        while (depth < depth_ && ((difference >> (64 - (depth + 1) * component_bits_)) & componentMask()) == 0) {
+            ++depth;
+        }
+        return depth;
+    }
+
+    /** Number of components of the labels */
+    unsigned int depth_;
+    /** Bits kept from each component */
+    unsigned int component_bits_;
+    /** The labels of the points, sorted */
+    std::vector<BucketKey> labels_;
+    /** The index of the point of each label */
+    std::vector<FeatureIndex> indices_;
+};
+
+}
+}
+
+#endif /* FLANN_LSH_PREFIX_TREE_H_ */
@@ -0,0 +1,1114 @@
+/***********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ * Copyright 2008-2009  Marius Muja (mariusm@cs.ubc.ca). All rights reserved.
+ * Copyright 2008-2009  David G. Lowe (lowe@cs.ubc.ca). All rights reserved.
+ *
+ * THE BSD LICENSE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *************************************************************************/
+
+#ifndef FLANN_LSH_PROJECTION_H_
+#define FLANN_LSH_PROJECTION_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <vector>
+
+#if defined(__FMA__) || (defined(_MSC_VER) && defined(__AVX2__))
+#include <immintrin.h>
+#define FLANN_LSH_USE_FMA 1
+#if defined(__F16C__) || defined(_MSC_VER)
+#define FLANN_LSH_USE_F16C 1
+#endif
+#endif
+
+#include "flann/general.h"
+#include "flann/util/saving.h"
+#include "flann/util/lsh_learning.h"
+
+namespace flann
+{
+
+namespace lsh
+{
+
+/** A runner-up vertex of a cross-polytope function, for multi-probe
+ */
+struct CrossPolytopeProbe
+{
+    /** Squared distance of the rotated query to the boundary with that vertex, relative to its squared norm */
+    float score_;
+    /** Difference between that vertex and the one of the query */
+    int delta_;
+};
+
+/** The p-stable hash functions of all the tables of an LSH index, stacked in one matrix
+ * Function r projects a feature x to (a_r.x + b_r) / W, whose floor is the component of the bucket key.
+ * The rows of the matrix are stored already divided by W, so that projecting a feature against every
+ * function of every table is a single matrix-vector product (matrix-matrix for a block of features).
+ *
+ * The dense product costs veclen multiply-adds per function. Two structured alternatives are cheaper:
+ * - FLANN_LSH_PROJECTION_SPARSE: each function only reads about sqrt(veclen) components of the feature,
+ *   with random signs (very sparse random projections). By the central limit theorem a.x stays close
+ *   to the N(0, |x|^2) of a Gaussian function as long as no few components dominate the feature.
+ * - FLANN_LSH_PROJECTION_HADAMARD: the feature is first spread by a randomized Walsh-Hadamard transform
+ *   y = H D x (D random signs), computed once in O(veclen log veclen) for all the functions. The energy
+ *   of y being evenly spread, each function then draws Gaussian weights for a few components of y only
+ *   (fast Johnson-Lindenstrauss transform). Given y, a.y is exactly Gaussian, so the functions stay
+ *   2-stable up to how evenly H D spread the feature.
+ *
+ * The dense functions can also be read from a copy of the matrix in fp16 or int8 (with a scale per
+ * function), halving or quartering the memory traffic of the products. The reduced weights are widened
+ * to fp32 before being multiplied with the feature, and the error of a projection is bounded by
+ * min(max_k |e_k| |x|_1, |e|_2 |x|_2), e being the weight errors of the function. Only when that bound
+ * reaches a bucket boundary is the projection recomputed from the fp32 weights, so that the keys are the
+ * same as with the fp32 functions.
+ *
+ * The dense functions can also be learned from a sample of the dataset (see train()) instead of drawn:
+ * - FLANN_LSH_PROJECTION_PCA: the functions of a table are a random rotation of the leading principal
+ *   directions of the sample (PCA hashing with random rotations, so that the tables differ).
+ * - FLANN_LSH_PROJECTION_ITQ: the rotation of each table is then refined by iterative quantization, which
+ *   moves the projections of the sample away from the boundaries at the mean.
+ * The learned functions are centered on the mean of the sample instead of being offset at random, and
+ * scaled to the norm of a Gaussian function so that W keeps its meaning.
+ * Any kind of function can also be applied to the residuals of the features to their nearest k-means
+ * center: the projection of a feature x of cell c is then a.(x - c) / W + b + o_c, o_c being a whole number
+ * of buckets drawn for each cell and function. Only points of the same cell can share a bucket, and within
+ * a cell the buckets are the ones of the residuals, so that multi-probe moves between neighbors as before.
+ *
+ * FLANN_LSH_PROJECTION_CROSS_POLYTOPE is a family for angular distances instead (Andoni et al.): each
+ * function rotates the feature with three randomized Hadamard transforms y = H D3 H D2 H D1 x, and hashes
+ * it to the closest vertex +-e_i of the cross-polytope, i.e. the coordinate of y of largest magnitude
+ * with its sign. The "projection" of a function is then that vertex (2i, or 2i + 1 for -e_i) plus 0.5,
+ * so that the tables can quantize it as any other. The width and the offsets play no part.
+ */
+class ProjectionBank
+{
+public:
+    /** Default constructor
+     */
+    ProjectionBank() : type_(FLANN_LSH_PROJECTION_GAUSSIAN), precision_(FLANN_LSH_PRECISION_FLOAT32),
+        veclen_(0), size_(0), padded_(0), nonzeros_(0), components_(0)
+    {
+    }
+
+    /** Allocates the functions, which are all 0 until randomize() (and randomizeTransform()) is called
+     * @param veclen the size of the features
+     * @param size the number of hash functions
+     * @param type the kind of projection
+     * @param precision the precision of the copy of the weights the dense projection reads first
+     */
+    ProjectionBank(size_t veclen, size_t size, flann_lsh_projection_t type = FLANN_LSH_PROJECTION_GAUSSIAN,
+                   flann_lsh_precision_t precision = FLANN_LSH_PRECISION_FLOAT32) :
+        type_(type), precision_(precision), veclen_(veclen), size_(size), padded_(veclen), nonzeros_(0), bias_(size),
+        components_(0)
+    {
+        switch (type_) {
+        case FLANN_LSH_PROJECTION_GAUSSIAN:
+        case FLANN_LSH_PROJECTION_PCA:
+        case FLANN_LSH_PROJECTION_ITQ:
+            matrix_.resize(veclen_ * size_);
+            if (precision_ == FLANN_LSH_PRECISION_FLOAT16) {
+                matrix_half_.resize(veclen_ * size_);
+            }
+            else if (precision_ == FLANN_LSH_PRECISION_INT8) {
+                matrix_int8_.resize(veclen_ * size_);
+            }
+            else if (precision_ != FLANN_LSH_PRECISION_FLOAT32) {
+                throw FLANNException("Unknown LSH projection precision");
+            }
+            if (precision_ != FLANN_LSH_PRECISION_FLOAT32) {
+                row_scale_.resize(size_);
+                row_error_.resize(2 * size_);
+            }
+            break;
+        case FLANN_LSH_PROJECTION_SPARSE:
+            nonzeros_ = std::min(veclen_, (size_t)std::ceil(std::sqrt((double)veclen_)));
+            break;
+        case FLANN_LSH_PROJECTION_HADAMARD:
+        case FLANN_LSH_PROJECTION_CROSS_POLYTOPE: {
+            padded_ = 1;
+            size_t log_padded = 0;
+            while (padded_ < veclen_) {
+                padded_ <<= 1;
+                ++log_padded;
+            }
+            if (type_ == FLANN_LSH_PROJECTION_HADAMARD) {
+                nonzeros_ = std::min(padded_, std::max<size_t>(8, 2 * log_padded));
+                signs_.resize(veclen_);
+            }
+            else {
+                // The signs D1 (on the features only), D2 and D3 of each function
+                signs_.resize((veclen_ + 2 * padded_) * size_);
+            }
+            break;
+        }
+        default:
+            throw FLANNException("Unknown LSH projection type");
+        }
+        columns_.resize(nonzeros_ * size_);
+        values_.resize(nonzeros_ * size_);
+    }
+
+    /** Learns from a sample of the dataset what the functions are then drawn from
+     * The k-means centers of the cells, if any, then the principal directions of the (residual) sample
+     * for the learned kinds of functions. To be called before randomize().
+     * @param sample the features of the sample
+     * @param count the size of the sample
+     * @param components the number of principal directions, the most learned functions randomize() can draw at once
+     * @param cells the number of k-means cells, 0 to hash the features themselves
+     * @param gen the random generator
+     */
+    template<typename Generator>
+    void train(const float* const* sample, size_t count, size_t components, size_t cells, Generator& gen)
+    {
+        std::vector<float> data(count * veclen_);
+        for (size_t n = 0; n < count; ++n) {
+            std::copy(sample[n], sample[n] + veclen_, &data[n * veclen_]);
+        }
+
+        centers_.clear();
+        cell_bias_.clear();
+        if (cells > 0 && type_ == FLANN_LSH_PROJECTION_CROSS_POLYTOPE) {
+            throw FLANNException("The cross-polytope LSH functions cannot hash k-means residuals");
+        }
+        if (cells > 0) {
+            if (cells > count) {
+                throw FLANNException("The LSH training sample is smaller than the number of k-means cells");
+            }
+            kmeans(data, count, veclen_, cells, kKmeansIterations, gen, centers_);
+            cell_bias_.resize(cells * size_);
+            for (size_t n = 0; n < count; ++n) {
+                const float* center = &centers_[nearestCell(&data[n * veclen_]) * veclen_];
+                for (size_t k = 0; k < veclen_; ++k) data[n * veclen_ + k] -= center[k];
+            }
+        }
+        if (!learned()) return;
+
+        if (components > veclen_ || components > count) {
+            throw FLANNException("Cannot learn more LSH functions than the dimension or the size of the sample");
+        }
+        mean_.assign(veclen_, 0.0f);
+        for (size_t k = 0; k < veclen_; ++k) {
+            double sum = 0;
+            for (size_t n = 0; n < count; ++n) sum += data[n * veclen_ + k];
+            mean_[k] = float(sum / count);
+        }
+        for (size_t n = 0; n < count; ++n) {
+            for (size_t k = 0; k < veclen_; ++k) data[n * veclen_ + k] -= mean_[k];
+        }
+
+        std::vector<double> directions;
+        principalDirections(data, count, veclen_, components, gen, directions);
+        components_ = components;
+        directions_.assign(directions.begin(), directions.end());
+        // The sample in the basis of the directions, which ITQ rotates
+        codes_.resize(count * components_);
+        for (size_t n = 0; n < count; ++n) {
+            for (size_t c = 0; c < components_; ++c) {
+                codes_[n * components_ + c] = dot(&directions_[c * veclen_], &data[n * veclen_]);
+            }
+        }
+    }
+
+    /** Draws Gaussian (2-stable) hash functions, or rotations of the learned ones
+     * The offsets are drawn uniformly in [0, W), either one for all the functions drawn, or one each
+     * @param first the first function to draw
+     * @param count the number of functions to draw
+     * @param width the width W of the buckets
+     * @param gen the random generator
+     * @param shared_bias whether the functions drawn share the same offset
+     */
+    template<typename Generator>
+    void randomize(size_t first, size_t count, float width, Generator& gen, bool shared_bias = true)
+    {
+        std::normal_distribution<> a_norm(0.0, 1.0);
+        std::uniform_real_distribution<> b_unif(0.0, width);
+
+        if (learned()) {
+            learnFunctions(first, count, width, gen);
+        }
+        else if (type_ == FLANN_LSH_PROJECTION_GAUSSIAN) {
+            for (size_t r = first; r < first + count; ++r) {
+                float* row = &matrix_[r * veclen_];
+                for (size_t k = 0; k < veclen_; ++k) {
+                    row[k] = float(a_norm(gen)) / width;
+                }
+            }
+        }
+        else if (type_ == FLANN_LSH_PROJECTION_CROSS_POLYTOPE) {
+            std::bernoulli_distribution coin;
+            size_t stride = veclen_ + 2 * padded_;
+            for (size_t k = first * stride; k < (first + count) * stride; ++k) {
+                signs_[k] = coin(gen) ? 1.0f : -1.0f;
+            }
+        }
+        else {
+            // Distinct components for each function, scaled so that the variance of a.x stays |x|^2
+            size_t dimension = (type_ == FLANN_LSH_PROJECTION_HADAMARD) ? padded_ : veclen_;
+            std::vector<unsigned int> components(dimension);
+            for (size_t k = 0; k < dimension; ++k) components[k] = (unsigned int)k;
+            float scale = (type_ == FLANN_LSH_PROJECTION_HADAMARD) ?
+                          float(1 / std::sqrt((double)nonzeros_)) : float(std::sqrt((double)veclen_ / nonzeros_));
+            std::bernoulli_distribution coin;
+
+            for (size_t r = first; r < first + count; ++r) {
+                for (size_t j = 0; j < nonzeros_; ++j) {
+                    std::uniform_int_distribution<size_t> pick(j, dimension - 1);
+                    std::swap(components[j], components[pick(gen)]);
+                }
+                std::sort(components.begin(), components.begin() + nonzeros_);
+                for (size_t j = 0; j < nonzeros_; ++j) {
+                    float a = (type_ == FLANN_LSH_PROJECTION_HADAMARD) ? float(a_norm(gen)) : (coin(gen) ? 1.0f : -1.0f);
+                    columns_[r * nonzeros_ + j] = components[j];
+                    values_[r * nonzeros_ + j] = a * scale / width;
+                }
+            }
+        }
+        // The learned functions were centered instead
+        if (!learned()) {
+            if (shared_bias) {
+                float bias = float(b_unif(gen)) / width;
+                std::fill(bias_.begin() + first, bias_.begin() + first + count, bias);
+            }
+            else {
+                for (size_t r = first; r < first + count; ++r) {
+                    bias_[r] = float(b_unif(gen)) / width;
+                }
+            }
+        }
+        if (dense() && precision_ != FLANN_LSH_PRECISION_FLOAT32) {
+            for (size_t r = first; r < first + count; ++r) quantize(r);
+        }
+        if (!centers_.empty()) randomizeCells(first, count, gen);
+    }
+
+    /** Draws the random signs of the Hadamard transform, which all the functions share
+     * Does nothing for the other kinds of projection.
+     * @param gen the random generator
+     */
+    template<typename Generator>
+    void randomizeTransform(Generator& gen)
+    {
+        if (type_ != FLANN_LSH_PROJECTION_HADAMARD) return;
+        std::bernoulli_distribution coin;
+        for (size_t k = 0; k < signs_.size(); ++k) {
+            signs_[k] = coin(gen) ? 1.0f : -1.0f;
+        }
+    }
+
+    /** @return the size of the buffer project() needs to transform a feature, 0 if it needs none
+     */
+    size_t workspaceSize() const
+    {
+        return (type_ == FLANN_LSH_PROJECTION_HADAMARD || type_ == FLANN_LSH_PROJECTION_CROSS_POLYTOPE) ? padded_ : 0;
+    }
+
+    /** Projects one feature against all the functions in one pass
+     * @param feature the feature
+     * @param projections the size() projections of the feature
+     */
+    void project(const float* feature, float* projections, float* workspace = NULL) const
+    {
+        project(feature, 0, size_, projections, workspace);
+    }
+
+    /** Projects one feature against a range of functions
+     * @param feature the feature
+     * @param first the first function
+     * @param count the number of functions
+     * @param projections the count projections of the feature
+     * @param workspace workspaceSize() floats to transform the feature in, allocated here if NULL
+     */
+    void project(const float* feature, size_t first, size_t count, float* projections, float* workspace = NULL) const
+    {
+        projectWith(feature, first, count, projections, workspace, biasOf(feature));
+    }
+
+    /** Projects a block of features against all the functions
+     * The product is blocked so that a block of features and a block of functions stay in cache
+     * while all the dot products between them are computed.
+     * @param features the features
+     * @param count the number of features
+     * @param projections the projections, size() per feature, one feature after the other
+     * @param cells the k-means cell of each feature (see nearestCell()), found here if NULL
+     */
+    void projectBlock(const float* const* features, size_t count, float* projections, const unsigned int* cells = NULL) const
+    {
+        projectBlock(features, count, 0, size_, projections, cells);
+    }
+
+    /** Projects a block of features against a range of functions
+     * The block product keeps its functions in cache, so it always reads the fp32 weights, which give
+     * the same keys as the reduced ones.
+     * @param features the features
+     * @param count the number of features
+     * @param first the first function
+     * @param functions the number of functions
+     * @param projections the projections, functions per feature, one feature after the other
+     * @param cells the k-means cell of each feature (see nearestCell()), found here if NULL
+     */
+    void projectBlock(const float* const* features, size_t count, size_t first, size_t functions, float* projections,
+                      const unsigned int* cells = NULL) const
+    {
+        if (!dense()) {
+            // The structured projections are cheap enough one feature at a time
+            std::vector<float> workspace(std::max<size_t>(workspaceSize(), 1));
+            for (size_t i = 0; i < count; ++i) {
+                const float* bias = cells ? cellBias(cells[i]) : biasOf(features[i]);
+                projectWith(features[i], first, functions, projections + i * functions, &workspace[0], bias);
+            }
+            return;
+        }
+
+        const float* matrix = &matrix_[first * veclen_];
+        // Blocks of functions of about 128KB, in multiples of the 4 rows of the kernels
+        size_t rows_per_block = std::max<size_t>(4, (kFunctionBlockBytes / (sizeof(float) * std::max<size_t>(veclen_, 1))) & ~size_t(3));
+
+        for (size_t first_feature = 0; first_feature < count; first_feature += kFeatureBlock) {
+            size_t last_feature = std::min(count, first_feature + kFeatureBlock);
+            for (size_t first_row = 0; first_row < functions; first_row += rows_per_block) {
+                size_t last_row = std::min(functions, first_row + rows_per_block);
+
+                size_t i = first_feature;
+                for (; i + 2 <= last_feature; i += 2) {
+                    float* out0 = projections + i * functions;
+                    float* out1 = out0 + functions;
+                    size_t r = first_row;
+                    for (; r + 4 <= last_row; r += 4) {
+                        dot4x2(matrix + r * veclen_, features[i], features[i + 1], out0 + r, out1 + r);
+                    }
+                    for (; r < last_row; ++r) {
+                        out0[r] = dot(matrix + r * veclen_, features[i]);
+                        out1[r] = dot(matrix + r * veclen_, features[i + 1]);
+                    }
+                }
+                for (; i < last_feature; ++i) {
+                    float* out = projections + i * functions;
+                    size_t r = first_row;
+                    for (; r + 4 <= last_row; r += 4) {
+                        dot4x1(matrix + r * veclen_, features[i], out + r);
+                    }
+                    for (; r < last_row; ++r) {
+                        out[r] = dot(matrix + r * veclen_, features[i]);
+                    }
+                }
+            }
+            for (size_t i = first_feature; i < last_feature; ++i) {
+                float* out = projections + i * functions;
+                const float* bias = cells ? cellBias(cells[i]) : biasOf(features[i]);
+                for (size_t r = 0; r < functions; ++r) {
+                    out[r] += bias[first + r];
+                }
+            }
+        }
+    }
+
+    /** Cross-polytope hashes of a feature, with the two runner-up vertices of each function
+     * The score of a runner-up vertex e_j is (|y_i| - |y_j|)^2 / (2 |y|^2), e_i being the vertex of the
+     * feature: the squared distance of y / |y| to the boundary between the two vertices.
+     * @param feature the feature
+     * @param first the first function
+     * @param count the number of functions
+     * @param projections the count vertices of the feature, plus 0.5
+     * @param workspace workspaceSize() floats to rotate the feature in, allocated here if NULL
+     * @param probes the 2 runner-up vertices of each function, not computed if NULL
+     */
+    void projectCrossPolytope(const float* feature, size_t first, size_t count, float* projections, float* workspace,
+                              CrossPolytopeProbe* probes) const
+    {
+        std::vector<float> buffer;
+        if (workspace == NULL) {
+            buffer.resize(padded_);
+            workspace = &buffer[0];
+        }
+        float* y = workspace;
+        size_t stride = veclen_ + 2 * padded_;
+        for (size_t r = 0; r < count; ++r) {
+            const float* signs = &signs_[(first + r) * stride];
+            for (size_t k = 0; k < veclen_; ++k) y[k] = signs[k] * feature[k];
+            std::fill(y + veclen_, y + padded_, 0.0f);
+            hadamard(y);
+            for (size_t round = 0; round < 2; ++round) {
+                const float* round_signs = signs + veclen_ + round * padded_;
+                for (size_t k = 0; k < padded_; ++k) y[k] *= round_signs[k];
+                hadamard(y);
+            }
+
+            // The three coordinates of largest magnitude
+            size_t best[3] = { 0, 0, 0 };
+            float magnitude[3] = { -1, -1, -1 };
+            float norm = 0;
+            for (size_t k = 0; k < padded_; ++k) {
+                float m = std::fabs(y[k]);
+                norm += y[k] * y[k];
+                if (m <= magnitude[2]) continue;
+                int slot = 2;
+                for (; slot > 0 && m > magnitude[slot - 1]; --slot) {
+                    magnitude[slot] = magnitude[slot - 1];
+                    best[slot] = best[slot - 1];
+                }
+                magnitude[slot] = m;
+                best[slot] = k;
+            }
+            int vertex = int(2 * best[0] + (y[best[0]] < 0));
+            projections[r] = vertex + 0.5f;
+            if (probes == NULL) continue;
+            for (int j = 1; j <= 2; ++j) {
+                CrossPolytopeProbe& probe = probes[2 * r + j - 1];
+                if (best[j] == best[0] || norm <= 0) {
+                    // Fewer than three coordinates: a probe that never comes first
+                    probe.score_ = std::numeric_limits<float>::max();
+                    probe.delta_ = 0;
+                    continue;
+                }
+                float gap = magnitude[0] - magnitude[j];
+                probe.score_ = gap * gap / (2 * norm);
+                probe.delta_ = int(2 * best[j] + (y[best[j]] < 0)) - vertex;
+            }
+        }
+    }
+
+    /** @return the k-means cell of a feature, 0 if the functions have no cells
+     */
+    unsigned int nearestCell(const float* feature) const
+    {
+        unsigned int cell = 0;
+        float best = std::numeric_limits<float>::max();
+        for (size_t c = 0; c < cellNumber(); ++c) {
+            float distance = squaredDistance(feature, &centers_[c * veclen_], veclen_);
+            if (distance < best) {
+                best = distance;
+                cell = (unsigned int)c;
+            }
+        }
+        return cell;
+    }
+
+    /** @return the number of k-means cells, 0 if the features are hashed themselves
+     */
+    size_t cellNumber() const
+    {
+        return veclen_ > 0 ? centers_.size() / veclen_ : 0;
+    }
+
+    /** @return the number of hash functions
+     */
+    size_t size() const
+    {
+        return size_;
+    }
+
+    /** @return the size of the features
+     */
+    size_t veclen() const
+    {
+        return veclen_;
+    }
+
+    /** @return the kind of projection
+     */
+    flann_lsh_projection_t type() const
+    {
+        return type_;
+    }
+
+    /** @return the precision of the weights the dense projection reads first
+     */
+    flann_lsh_precision_t precision() const
+    {
+        return precision_;
+    }
+
+    template<typename Archive>
+    void serialize(Archive& ar)
+    {
+        ar & type_;
+        ar & precision_;
+        ar & veclen_;
+        ar & size_;
+        ar & padded_;
+        ar & nonzeros_;
+        ar & matrix_;
+        ar & columns_;
+        ar & values_;
+        ar & signs_;
+        ar & matrix_half_;
+        ar & matrix_int8_;
+        ar & row_scale_;
+        ar & row_error_;
+        ar & bias_;
+        ar & components_;
+        ar & mean_;
+        ar & directions_;
+        ar & centers_;
+        ar & cell_bias_;
+    }
+    friend struct serialization::access;
+
+private:
+    /** Number of features projected together by projectBlock()
+     */
+    static const size_t kFeatureBlock = 64;
+
+    /** Size of the block of functions projectBlock() keeps in cache
+     */
+    static const size_t kFunctionBlockBytes = 128 * 1024;
+
+    /** Number of Lloyd iterations of the k-means cells
+     */
+    static const int kKmeansIterations = 10;
+
+    /** Number of iterations of ITQ
+     */
+    static const int kItqIterations = 50;
+
+    /** The offsets of the cells are whole numbers of buckets below this
+     */
+    static const int kCellOffsets = 256;
+
+    /** @return whether the functions are learned from the data
+     */
+    inline bool learned() const
+    {
+        return type_ == FLANN_LSH_PROJECTION_PCA || type_ == FLANN_LSH_PROJECTION_ITQ;
+    }
+
+    /** @return whether the functions are rows of the dense matrix
+     */
+    inline bool dense() const
+    {
+        return type_ == FLANN_LSH_PROJECTION_GAUSSIAN || learned();
+    }
+
+    /** @return the offsets of the functions for the features of a cell
+     */
+    inline const float* cellBias(unsigned int cell) const
+    {
+        return &cell_bias_[cell * size_];
+    }
+
+    /** @return the offsets of the functions for a feature, those of its cell if there are cells
+     */
+    inline const float* biasOf(const float* feature) const
+    {
+        return centers_.empty() ? &bias_[0] : cellBias(nearestCell(feature));
+    }
+
+    /** Draws learned functions: a random rotation of the principal directions, refined by ITQ if asked
+     * Function j is the combination of the directions given by column j of the rotation.
+     */
+    template<typename Generator>
+    void learnFunctions(size_t first, size_t count, float width, Generator& gen)
+    {
+        if (count > components_) {
+            throw FLANNException("More learned LSH functions are drawn at once than principal directions were trained");
+        }
+        std::vector<double> rotation;
+        randomRotation(components_, gen, rotation);
+        if (type_ == FLANN_LSH_PROJECTION_ITQ) {
+            iterativeQuantization(codes_, codes_.size() / components_, components_, kItqIterations, rotation);
+        }
+
+        float scale = float(std::sqrt((double)veclen_)) / width;
+        for (size_t j = 0; j < count; ++j) {
+            float* row = &matrix_[(first + j) * veclen_];
+            std::fill(row, row + veclen_, 0.0f);
+            for (size_t c = 0; c < components_; ++c) {
+                float weight = float(rotation[c * components_ + j]) * scale;
+                const float* direction = &directions_[c * veclen_];
+                for (size_t k = 0; k < veclen_; ++k) row[k] += weight * direction[k];
+            }
+            bias_[first + j] = -dot(row, &mean_[0]);
+        }
+    }
+
+    /** Offsets of a range of functions for every cell: b - a.c / W, shifted by a random whole number of buckets
+     */
+    template<typename Generator>
+    void randomizeCells(size_t first, size_t count, Generator& gen)
+    {
+        std::uniform_int_distribution<int> shift(0, kCellOffsets - 1);
+        std::vector<float> projections(count), workspace(std::max<size_t>(workspaceSize(), 1));
+        for (size_t c = 0; c < cellNumber(); ++c) {
+            projectWith(&centers_[c * veclen_], first, count, &projections[0], &workspace[0], &bias_[0]);
+            float* bias = &cell_bias_[c * size_];
+            for (size_t r = 0; r < count; ++r) {
+                bias[first + r] = 2 * bias_[first + r] - projections[r] + float(shift(gen));
+            }
+        }
+    }
+
+    /** Projects one feature against a range of functions, with given offsets
+     * @param bias the offsets of all the functions
+     */
+    void projectWith(const float* feature, size_t first, size_t count, float* projections, float* workspace,
+                     const float* bias) const
+    {
+        if (precision_ != FLANN_LSH_PRECISION_FLOAT32 && dense()) {
+            projectReduced(feature, first, count, projections, bias);
+            return;
+        }
+        if (type_ == FLANN_LSH_PROJECTION_CROSS_POLYTOPE) {
+            projectCrossPolytope(feature, first, count, projections, workspace, NULL);
+            return;
+        }
+        if (!dense()) {
+            std::vector<float> buffer;
+            if (type_ == FLANN_LSH_PROJECTION_HADAMARD) {
+                if (workspace == NULL) {
+                    buffer.resize(padded_);
+                    workspace = &buffer[0];
+                }
+                transform(feature, workspace);
+                feature = workspace;
+            }
+            projectSparse(feature, first, count, projections, bias);
+            return;
+        }
+
+        const float* rows = &matrix_[first * veclen_];
+        size_t r = 0;
+        for (; r + 4 <= count; r += 4) {
+            dot4x1(rows + r * veclen_, feature, projections + r);
+        }
+        for (; r < count; ++r) {
+            projections[r] = dot(rows + r * veclen_, feature);
+        }
+        for (r = 0; r < count; ++r) {
+            projections[r] += bias[first + r];
+        }
+    }
+
+    /** Converts a float of magnitude at most 1 to the bits of the nearest fp16 value
+     */
+    static unsigned short floatToHalf(float value)
+    {
+        unsigned int bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        unsigned short sign = (unsigned short)((bits >> 16) & 0x8000);
+        float magnitude = std::fabs(value);
+        if (magnitude < 6.103515625e-05f) {
+            // Subnormal: a multiple of 2^-24
+            return sign | (unsigned short)(magnitude * 16777216.0f + 0.5f);
+        }
+        // Rounds the 13 dropped bits of the mantissa to nearest even, then rebiases the exponent
+        unsigned int magnitude_bits = bits & 0x7fffffff;
+        magnitude_bits += 0x00000fff + ((magnitude_bits >> 13) & 1);
+        return sign | (unsigned short)((magnitude_bits >> 13) - ((127 - 15) << 10));
+    }
+
+    static float halfToFloat(unsigned short half)
+    {
+        unsigned int exponent = (half >> 10) & 0x1f;
+        unsigned int mantissa = half & 0x3ff;
+        float value;
+        if (exponent == 0) {
+            value = mantissa / 16777216.0f;
+        }
+        else {
+            unsigned int bits = ((exponent + 127 - 15) << 23) | (mantissa << 13);
+            std::memcpy(&value, &bits, sizeof(value));
+        }
+        return (half & 0x8000) ? -value : value;
+    }
+
+    /** Fills the reduced copy of a function, and the largest error of its weights
+     */
+    void quantize(size_t r)
+    {
+        const float* row = &matrix_[r * veclen_];
+        float max_weight = 0;
+        for (size_t k = 0; k < veclen_; ++k) {
+            max_weight = std::max(max_weight, std::fabs(row[k]));
+        }
+        float scale = (max_weight > 0) ? max_weight : 1.0f;
+        float max_error = 0;
+        double square_error = 0;
+        if (precision_ == FLANN_LSH_PRECISION_FLOAT16) {
+            // Scaled to [-1, 1], away from both ends of the fp16 range
+            unsigned short* half_row = &matrix_half_[r * veclen_];
+            for (size_t k = 0; k < veclen_; ++k) {
+                half_row[k] = floatToHalf(row[k] / scale);
+                float error = std::fabs(halfToFloat(half_row[k]) * scale - row[k]);
+                max_error = std::max(max_error, error);
+                square_error += double(error) * error;
+            }
+        }
+        else {
+            scale /= 127;
+            signed char* int8_row = &matrix_int8_[r * veclen_];
+            for (size_t k = 0; k < veclen_; ++k) {
+                int8_row[k] = (signed char)std::floor(row[k] / scale + 0.5f);
+                float error = std::fabs(int8_row[k] * scale - row[k]);
+                max_error = std::max(max_error, error);
+                square_error += double(error) * error;
+            }
+        }
+        row_scale_[r] = scale;
+        // Margin for the rounding of the fp32 sums, which are not accumulated in the same order
+        float margin = max_weight * float(veclen_) * 1e-6f;
+        row_error_[2 * r] = max_error + margin;
+        row_error_[2 * r + 1] = float(std::sqrt(square_error)) + margin;
+    }
+
+    /** Widens 8 reduced weights to fp32
+     */
+#ifdef FLANN_LSH_USE_FMA
+    static inline __m256 loadReduced(const unsigned short* weights)
+    {
+#ifdef FLANN_LSH_USE_F16C
+        return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)weights));
+#else
+        float values[8];
+        for (int i = 0; i < 8; ++i) values[i] = halfToFloat(weights[i]);
+        return _mm256_loadu_ps(values);
+#endif
+    }
+
+    static inline __m256 loadReduced(const signed char* weights)
+    {
+        return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)weights)));
+    }
+#endif
+
+    static inline float widen(unsigned short weight)
+    {
+        return halfToFloat(weight);
+    }
+
+    static inline float widen(signed char weight)
+    {
+        return weight;
+    }
+
+    /** Dot products of the reduced copies of 1 or 4 consecutive functions with a feature,
+     * before the scales of the functions
+     */
+    template<typename Weight>
+    inline float dotReduced(const Weight* row, const float* x) const
+    {
+        size_t k = 0;
+        float result = 0;
+#ifdef FLANN_LSH_USE_FMA
+        __m256 acc = _mm256_setzero_ps();
+        for (; k + 8 <= veclen_; k += 8) {
+            acc = _mm256_fmadd_ps(loadReduced(row + k), _mm256_loadu_ps(x + k), acc);
+        }
+        result = horizontalSum(acc);
+#endif
+        for (; k < veclen_; ++k) {
+            result += widen(row[k]) * x[k];
+        }
+        return result;
+    }
+
+    template<typename Weight>
+    inline void dot4x1Reduced(const Weight* rows, const float* x, float* out) const
+    {
+        const Weight* a0 = rows;
+        const Weight* a1 = a0 + veclen_;
+        const Weight* a2 = a1 + veclen_;
+        const Weight* a3 = a2 + veclen_;
+        size_t k = 0;
+        float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+#ifdef FLANN_LSH_USE_FMA
+        __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+        __m256 acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+        for (; k + 8 <= veclen_; k += 8) {
+            __m256 xv = _mm256_loadu_ps(x + k);
+            acc0 = _mm256_fmadd_ps(loadReduced(a0 + k), xv, acc0);
+            acc1 = _mm256_fmadd_ps(loadReduced(a1 + k), xv, acc1);
+            acc2 = _mm256_fmadd_ps(loadReduced(a2 + k), xv, acc2);
+            acc3 = _mm256_fmadd_ps(loadReduced(a3 + k), xv, acc3);
+        }
+        s0 = horizontalSum(acc0); s1 = horizontalSum(acc1);
+        s2 = horizontalSum(acc2); s3 = horizontalSum(acc3);
+#endif
+        for (; k < veclen_; ++k) {
+            s0 += widen(a0[k]) * x[k]; s1 += widen(a1[k]) * x[k];
+            s2 += widen(a2[k]) * x[k]; s3 += widen(a3[k]) * x[k];
+        }
+        out[0] = s0; out[1] = s1; out[2] = s2; out[3] = s3;
+    }
+
+    /** Projections of a feature on a range of dense functions from their reduced weights, recomputed
+     * from the fp32 weights when the error bound does not rule out a different bucket
+     */
+    void projectReduced(const float* feature, size_t first, size_t count, float* projections, const float* bias) const
+    {
+        if (precision_ == FLANN_LSH_PRECISION_FLOAT16) {
+            projectReduced(&matrix_half_[0], feature, first, count, projections, bias);
+        }
+        else {
+            projectReduced(&matrix_int8_[0], feature, first, count, projections, bias);
+        }
+    }
+
+    template<typename Weight>
+    void projectReduced(const Weight* matrix, const float* feature, size_t first, size_t count, float* projections,
+                        const float* bias) const
+    {
+        float norm1 = 0, norm2 = 0;
+        for (size_t k = 0; k < veclen_; ++k) {
+            norm1 += std::fabs(feature[k]);
+            norm2 += feature[k] * feature[k];
+        }
+        norm2 = std::sqrt(norm2);
+
+        const Weight* rows = matrix + first * veclen_;
+        size_t r = 0;
+        for (; r + 4 <= count; r += 4) {
+            dot4x1Reduced(rows + r * veclen_, feature, projections + r);
+        }
+        for (; r < count; ++r) {
+            projections[r] = dotReduced(rows + r * veclen_, feature);
+        }
+        for (r = 0; r < count; ++r) {
+            size_t function = first + r;
+            float projection = projections[r] * row_scale_[function] + bias[function];
+            float bound = std::min(row_error_[2 * function] * norm1, row_error_[2 * function + 1] * norm2);
+            float offset = projection - std::floor(projection);
+            if (offset < bound || 1 - offset < bound) {
+                projection = dot(&matrix_[function * veclen_], feature) + bias[function];
+            }
+            projections[r] = projection;
+        }
+    }
+
+    /** Randomized Walsh-Hadamard transform of a feature, y = H D x, with x padded with zeros to padded_
+     * H is not normalized, so |y|^2 = padded_ |x|^2 and each component of y is about |x| in magnitude.
+     */
+    void transform(const float* feature, float* y) const
+    {
+        for (size_t k = 0; k < veclen_; ++k) {
+            y[k] = signs_[k] * feature[k];
+        }
+        std::fill(y + veclen_, y + padded_, 0.0f);
+        hadamard(y);
+    }
+
+    /** In-place unnormalized Walsh-Hadamard transform of padded_ values
+     */
+    void hadamard(float* y) const
+    {
+        size_t half = 1;
+        if (padded_ >= 4) {
+            // The first two levels together, their butterflies being too short to vectorize
+            for (size_t i = 0; i < padded_; i += 4) {
+                float a = y[i] + y[i + 1], b = y[i] - y[i + 1];
+                float c = y[i + 2] + y[i + 3], d = y[i + 2] - y[i + 3];
+                y[i] = a + c; y[i + 1] = b + d;
+                y[i + 2] = a - c; y[i + 3] = b - d;
+            }
+            half = 4;
+        }
+        for (; half < padded_; half <<= 1) {
+            for (size_t i = 0; i < padded_; i += 2 * half) {
+                size_t j = i;
+#ifdef FLANN_LSH_USE_FMA
+                for (; j + 8 <= i + half; j += 8) {
+                    __m256 a = _mm256_loadu_ps(y + j);
+                    __m256 b = _mm256_loadu_ps(y + j + half);
+                    _mm256_storeu_ps(y + j, _mm256_add_ps(a, b));
+                    _mm256_storeu_ps(y + j + half, _mm256_sub_ps(a, b));
+                }
+#endif
+                for (; j < i + half; ++j) {
+                    float a = y[j];
+                    float b = y[j + half];
+                    y[j] = a + b;
+                    y[j + half] = a - b;
+                }
+            }
+        }
+    }
+
+    /** Projections of a (transformed) feature on a range of sparse functions, with the given offsets
+     */
+    void projectSparse(const float* x, size_t first, size_t count, float* projections, const float* bias) const
+    {
+        const unsigned int* columns = &columns_[first * nonzeros_];
+        const float* values = &values_[first * nonzeros_];
+        for (size_t r = 0; r < count; ++r) {
+            // Independent sums so that the gathers are not serialized by the additions
+            float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+            size_t j = 0;
+            for (; j + 4 <= nonzeros_; j += 4) {
+                s0 += values[j] * x[columns[j]];
+                s1 += values[j + 1] * x[columns[j + 1]];
+                s2 += values[j + 2] * x[columns[j + 2]];
+                s3 += values[j + 3] * x[columns[j + 3]];
+            }
+            for (; j < nonzeros_; ++j) {
+                s0 += values[j] * x[columns[j]];
+            }
+            projections[r] = bias[first + r] + ((s0 + s1) + (s2 + s3));
+            columns += nonzeros_;
+            values += nonzeros_;
+        }
+    }
+
+#ifdef FLANN_LSH_USE_FMA
+    static inline float horizontalSum(__m256 v)
+    {
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+        return _mm_cvtss_f32(sum);
+    }
+#endif
+
+    /** Dot product of one function with a feature
+     */
+    inline float dot(const float* row, const float* x) const
+    {
+        size_t k = 0;
+        float result = 0;
+#ifdef FLANN_LSH_USE_FMA
+        __m256 acc = _mm256_setzero_ps();
+        for (; k + 8 <= veclen_; k += 8) {
+            acc = _mm256_fmadd_ps(_mm256_loadu_ps(row + k), _mm256_loadu_ps(x + k), acc);
+        }
+        result = horizontalSum(acc);
+#endif
+        for (; k < veclen_; ++k) {
+            result += row[k] * x[k];
+        }
+        return result;
+    }
+
+    /** Dot products of 4 consecutive functions with a feature, the feature being loaded once for all 4
+     */
+    inline void dot4x1(const float* rows, const float* x, float* out) const
+    {
+        const float* a0 = rows;
+        const float* a1 = a0 + veclen_;
+        const float* a2 = a1 + veclen_;
+        const float* a3 = a2 + veclen_;
+        size_t k = 0;
+        float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+#ifdef FLANN_LSH_USE_FMA
+        __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+        __m256 acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+        for (; k + 8 <= veclen_; k += 8) {
+            __m256 xv = _mm256_loadu_ps(x + k);
+            acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a0 + k), xv, acc0);
+            acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a1 + k), xv, acc1);
+            acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(a2 + k), xv, acc2);
+            acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(a3 + k), xv, acc3);
+        }
+        s0 = horizontalSum(acc0); s1 = horizontalSum(acc1);
+        s2 = horizontalSum(acc2); s3 = horizontalSum(acc3);
+#endif
+        for (; k < veclen_; ++k) {
+            s0 += a0[k] * x[k]; s1 += a1[k] * x[k];
+            s2 += a2[k] * x[k]; s3 += a3[k] * x[k];
+        }
+        out[0] = s0; out[1] = s1; out[2] = s2; out[3] = s3;
+    }
+
+    /** Dot products of 4 consecutive functions with 2 features, each row being loaded once for both
+     */
+    inline void dot4x2(const float* rows, const float* x, const float* y, float* out_x, float* out_y) const
+    {
+        const float* a0 = rows;
+        const float* a1 = a0 + veclen_;
+        const float* a2 = a1 + veclen_;
+        const float* a3 = a2 + veclen_;
+        size_t k = 0;
+        float sx0 = 0, sx1 = 0, sx2 = 0, sx3 = 0;
+        float sy0 = 0, sy1 = 0, sy2 = 0, sy3 = 0;
+#ifdef FLANN_LSH_USE_FMA
+        __m256 x0 = _mm256_setzero_ps(), x1 = _mm256_setzero_ps(), x2 = _mm256_setzero_ps(), x3 = _mm256_setzero_ps();
+        __m256 y0 = _mm256_setzero_ps(), y1 = _mm256_setzero_ps(), y2 = _mm256_setzero_ps(), y3 = _mm256_setzero_ps();
+        for (; k + 8 <= veclen_; k += 8) {
+            __m256 xv = _mm256_loadu_ps(x + k);
+            __m256 yv = _mm256_loadu_ps(y + k);
+            __m256 av = _mm256_loadu_ps(a0 + k);
+            x0 = _mm256_fmadd_ps(av, xv, x0); y0 = _mm256_fmadd_ps(av, yv, y0);
+            av = _mm256_loadu_ps(a1 + k);
+            x1 = _mm256_fmadd_ps(av, xv, x1); y1 = _mm256_fmadd_ps(av, yv, y1);
+            av = _mm256_loadu_ps(a2 + k);
+            x2 = _mm256_fmadd_ps(av, xv, x2); y2 = _mm256_fmadd_ps(av, yv, y2);
+            av = _mm256_loadu_ps(a3 + k);
+            x3 = _mm256_fmadd_ps(av, xv, x3); y3 = _mm256_fmadd_ps(av, yv, y3);
+        }
+        sx0 = horizontalSum(x0); sx1 = horizontalSum(x1); sx2 = horizontalSum(x2); sx3 = horizontalSum(x3);
+        sy0 = horizontalSum(y0); sy1 = horizontalSum(y1); sy2 = horizontalSum(y2); sy3 = horizontalSum(y3);
+#endif
+        for (; k < veclen_; ++k) {
+            sx0 += a0[k] * x[k]; sx1 += a1[k] * x[k]; sx2 += a2[k] * x[k]; sx3 += a3[k] * x[k];
+            sy0 += a0[k] * y[k]; sy1 += a1[k] * y[k]; sy2 += a2[k] * y[k]; sy3 += a3[k] * y[k];
+        }
+        out_x[0] = sx0; out_x[1] = sx1; out_x[2] = sx2; out_x[3] = sx3;
+        out_y[0] = sy0; out_y[1] = sy1; out_y[2] = sy2; out_y[3] = sy3;
+    }
+
+    /** Kind of projection */
+    flann_lsh_projection_t type_;
+    /** Precision of the copy of the dense weights read first */
+    flann_lsh_precision_t precision_;
+    /** Size of the features */
+    size_t veclen_;
+    /** Number of hash functions */
+    size_t size_;
+    /** Size of the Hadamard transform, the power of 2 at or above veclen_ */
+    size_t padded_;
+    /** Number of components each sparse function reads */
+    size_t nonzeros_;
+    /** The projection vectors divided by W, one row per function (dense projection) */
+    std::vector<float> matrix_;
+    /** The components each function reads and their weights divided by W, nonzeros_ per function (sparse and Hadamard) */
+    std::vector<unsigned int> columns_;
+    std::vector<float> values_;
+    /** The random signs D of the Hadamard transform, or D1, D2 and D3 of each cross-polytope function */
+    std::vector<float> signs_;
+    /** The dense weights divided by the scale of their function, in fp16 or int8 */
+    std::vector<unsigned short> matrix_half_;
+    std::vector<signed char> matrix_int8_;
+    /** Scale of each function for the reduced weights, and the largest and L2 norm of its weight errors */
+    std::vector<float> row_scale_;
+    std::vector<float> row_error_;
+    /** The offsets divided by W, one per function */
+    std::vector<float> bias_;
+    /** Number of principal directions the learned functions combine */
+    size_t components_;
+    /** Mean of the (residual) training sample, and its principal directions, one per row */
+    std::vector<float> mean_;
+    std::vector<float> directions_;
+    /** The training sample in the basis of the principal directions, which ITQ rotates (not saved) */
+    std::vector<float> codes_;
+    /** The k-means centers, one per row, and the offsets of all the functions for the features of each cell */
+    std::vector<float> centers_;
+    std::vector<float> cell_bias_;
+};
+
+}
+}
+
+#endif /* FLANN_LSH_PROJECTION_H_ */
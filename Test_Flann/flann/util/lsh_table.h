@@ -48,11 +48,13 @@
 #endif
 #include <math.h>
 #include <stddef.h>
+#include <string.h>
 #include <fstream>
 
 #include "flann/flann.hpp"
 #include "flann/util/dynamic_bitset.h"
 #include "flann/util/matrix.h"
+#include "flann/util/stream_vbyte.h"
 
 namespace flann
 {
@@ -66,15 +68,93 @@ namespace lsh
  */
 typedef uint32_t FeatureIndex;
 /** The id from which we can get a bucket back in an LSH table
+ * The quantized components are packed in a single word, or hashed into it if there are too many of them
  */
-typedef std::vector<int>  BucketKey;
-
-typedef std::vector<float>  BucketKey_float;
+typedef uint64_t BucketKey;
 
 /** A bucket in an LSH table
  */
 typedef std::vector<FeatureIndex> Bucket;
 
+/** A bucket as returned by a lookup: a range of feature indices.
+ * Once the table is frozen, it points into the single contiguous array of the table, or to the
+ * encoded indices if the table is compressed (decode them with decodeBucket())
+ */
+struct BucketRange
+{
+    BucketRange() : begin_(0), end_(0), data_(0), size_(0)
+    {
+    }
+
+    BucketRange(const FeatureIndex* begin, const FeatureIndex* end) : begin_(begin), end_(end), data_(0), size_(end - begin)
+    {
+    }
+
+    BucketRange(const unsigned char* data, size_t size) : begin_(0), end_(0), data_(data), size_(size)
+    {
+    }
+
+    const FeatureIndex* begin() const
+    {
+        return begin_;
+    }
+
+    const FeatureIndex* end() const
+    {
+        return end_;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+
+    bool compressed() const
+    {
+        return data_ != 0;
+    }
+
+    const unsigned char* data() const
+    {
+        return data_;
+    }
+
+    const FeatureIndex* begin_;
+    const FeatureIndex* end_;
+    const unsigned char* data_;
+    size_t size_;
+};
+
+/** Decodes the feature indices of a compressed bucket
+ * @param bucket the bucket
+ * @param indices the bucket.size() indices of the bucket
+ */
+inline void decodeBucket(const BucketRange& bucket, FeatureIndex* indices)
+{
+    StreamVByte::decode(bucket.data(), bucket.size(), indices);
+}
+
+/** A slot of the open-addressing directory of a frozen table: a key and the bucket it maps to
+ * Also used for the sub-buckets of the heavy buckets, bucket_ being then the offset of the sub-bucket
+ */
+struct DirectorySlot
+{
+    BucketKey key_;
+    unsigned int bucket_;
+
+    template<typename Archive>
+    void serialize(Archive& ar)
+    {
+        ar & key_;
+        ar & bucket_;
+    }
+};
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /** POD for stats about an LSH table
@@ -125,6 +205,9 @@ inline std::ostream& operator <<(std::ostream& out, const LshStats& stats)
  * the size of it is pretty small, we keep it as a continuous memory array.
  * The value is an index in the corpus of features (we keep it as an unsigned
  * int for pure memory reasons, it could be a size_t)
+ * For float features, the projections are computed for all the tables at once by the
+ * ProjectionBank of the index: the table only quantizes them into bucket keys.
+ * For binary (unsigned char) features, the key is a random sample of key_size bits of the feature.
  */
 template<typename ElementType>
 class LshTable
@@ -139,8 +222,9 @@ public:
 #endif
 
     /** A container of all the feature indices. Optimized for speed
+     * Offsets of each bucket in the contiguous array of feature indices
      */
-    typedef std::vector<Bucket> BucketsSpeed;
+    typedef std::vector<unsigned int> BucketsSpeed;
 
     /** Default constructor
      */
@@ -159,17 +243,53 @@ public:
         throw;
     }
 
-    /** Add a feature to the table
+    /** Constructor drawing the random parts of the table from the generator of the caller
+     * Only the keys are drawn here for the tables whose features are projected by a ProjectionBank,
+     * and the sampled bits for the binary features
+     * @param feature_size the size of the feature (considered as a ElementType[])
+     * @param key_size the number of components of a key
+     * @param gen the random generator
+     */
+    template<typename Generator>
+    LshTable(unsigned int feature_size, unsigned int key_size, Generator& gen)
+    {
+        initialize(key_size);
+        initializeSampling(feature_size, gen, static_cast<const ElementType*>(0));
+        initializeKeyHash(gen);
+    }
+
+    /** Constructor of a table of binary features keyed by given bits of the features, the partitions of
+     * the bits of multi-index hashing for instance
+     * @param feature_size the number of bytes of a feature
+     * @param bits the indices of the bits of the key, which are packed in increasing order
+     */
+    LshTable(unsigned int feature_size, const std::vector<size_t>& bits)
+    {
+        initialize(bits.size());
+        setSampledBits(feature_size, bits);
+    }
+
+    /** Add a binary feature to the table, under the bits it samples
+     * Only possible as long as the table has not been frozen by optimize(). The keys of the other
+     * features come from the hash functions of the index (see ProjectionBank): they are added by key.
      * @param value the value to store for that feature
      * @param feature the feature itself
      */
-    void add(unsigned int value, const ElementType* feature)
+    void add(unsigned int /*value*/, const ElementType* /*feature*/)
     {
-        // Add the value to the corresponding bucket
-        BucketKey_float key_float = getKey(feature);
-		BucketKey key(key_size_);
-		for (int i = 0; i < key_size_; i++)
-			key[i] = floor(key_float[i]);
+        throw FLANNException("Only binary features can be added to an LSH table without their bucket key");
+    }
+
+    /** Add a feature to the table given its bucket key
+     * Only possible as long as the table has not been frozen by optimize()
+     * @param value the value to store for that feature
+     * @param key the key of the bucket of the feature
+     */
+    void add(unsigned int value, BucketKey key)
+    {
+        if (frozen_) {
+            throw FLANNException("Cannot add a feature to a frozen LSH table");
+        }
 		/*
 		ofstream RecordFile;
 		RecordFile.open("LSH_buckets.txt", ios::app);
@@ -177,102 +297,354 @@ public:
 			RecordFile << key[i] << ' ';
 		RecordFile << std::endl;
 		*/
-        switch (speed_level_) {
-        case kArray:
-            // That means we get the buckets from an array
-			//put it here temporaryly
-            //buckets_speed_[key].push_back(value);
-			throw;
-            break;
-        case kBitsetHash:
-            // That means we can check the bitset for the presence of a key
-			//put it here temporary
-            //key_bitset_.set(key);
-            //buckets_space_[key].push_back(value);
-			throw;
-            break;
-        case kHash:
-        {
-            // That means we have to check for the hash table for the presence of a key
-            buckets_space_[key].push_back(value);
-            break;
+        // That means we have to check for the hash table for the presence of a key
+        buckets_space_[key].push_back(value);
+    }
+
+    /** Store the frozen table as its buckets sorted by the Z-order of their keys, instead of an array or
+     * a directory. A lookup is then a binary search, the buckets of nearby keys are next to each other, and
+     * the table is only flat arrays (that could be mapped from a file as they are). Only packed keys can be
+     * interleaved: the keys must have at most 64 / kMinKeyBits components.
+     * To be called before the table is filled
+     */
+    void useSortedLayout()
+    {
+        if (frozen_) {
+            throw FLANNException("The layout of a frozen LSH table cannot change");
         }
+        if (key_bits_ == 0) {
+            throw FLANNException("The sorted LSH table layout needs keys of at most 16 components");
         }
+        sorted_layout_ = true;
     }
 
-	void add(unsigned int value, const ElementType* feature, unsigned int vec_len)
-	{
-		// Add the value to the corresponding bucket
-		BucketKey_float key_float = getKey(feature);
-		BucketKey key(key_size_);
-		for (int i = 0; i < key_size_; i++)
-			key[i] = floor(key_float[i]);
+    /** Number of bits of each component of the packed keys of a given size
+     * @param key_size the number of components of a key
+     * @return the bits per component, 0 if there are too many components to pack (the keys are then hashed)
+     */
+    static unsigned int packedKeyBits(size_t key_size)
+    {
+        unsigned int key_bits = (key_size > 0) ? std::min(64 / (unsigned int)key_size, 32u) : 0;
+        return (key_bits < kMinKeyBits) ? 0 : key_bits;
+    }
 
-	}
+    /** Fill the table with all its features at once, and freeze it
+     * Sort-based bulk load: the (key, feature) pairs are radix sorted by key, which keeps the features of a
+     * bucket in their order, and the buckets are then emitted in one pass.
+     * @param features the bucket key of each feature, sorted in place
+     */
+    void load(std::vector<std::pair<BucketKey, FeatureIndex> >& features)
+    {
+        if (frozen_ || !buckets_space_.empty()) {
+            throw FLANNException("Only an empty LSH table can be bulk loaded");
+        }
+        sortByKey(features);
 
+        std::vector<BucketKey> keys;
+        std::vector<unsigned int> offsets(1, 0);
+        feature_indices_.resize(features.size());
+        for (size_t i = 0; i < features.size(); ++i) {
+            if (i > 0 && features[i].first != features[i - 1].first) {
+                keys.push_back(features[i - 1].first);
+                offsets.push_back((unsigned int)i);
+            }
+            feature_indices_[i] = features[i].second;
+        }
+        if (!features.empty()) {
+            keys.push_back(features.back().first);
+            offsets.push_back((unsigned int)features.size());
+        }
+        freeze(keys, offsets);
+    }
 
-    /** Add a set of features to the table
-     * @param dataset the values to store
+    /** Optimize the table for speed/space
+     * The buckets are moved from the map to one contiguous array of feature indices. A bucket is then
+     * found either directly from its key (kArray) if the key space is small enough, or through an
+     * open-addressing directory of key fingerprints (kHash). The table cannot be added to afterwards.
      */
-	
-    void add(const std::vector< std::pair<size_t, ElementType*> >& features)
+    void optimize()
     {
-#if USE_UNORDERED_MAP
-        buckets_space_.rehash((buckets_space_.size() + features.size()) * 1.2);
-#endif
-        // Add the features to the table
-        for (size_t i = 0; i < features.size(); ++i) {
-        	add(features[i].first, features[i].second);
+        // If we are already using the fast storage, no need to do anything
+        if (frozen_) return;
+
+        // Fill the contiguous array, the buckets keep the (sorted) order of the map
+        std::vector<BucketKey> keys;
+        std::vector<unsigned int> offsets(1, 0);
+        keys.reserve(buckets_space_.size());
+        offsets.reserve(buckets_space_.size() + 1);
+        feature_indices_.clear();
+        for (BucketsSpace::const_iterator key_bucket = buckets_space_.begin(); key_bucket != buckets_space_.end(); ++key_bucket) {
+            keys.push_back(key_bucket->first);
+            feature_indices_.insert(feature_indices_.end(), key_bucket->second.begin(), key_bucket->second.end());
+            offsets.push_back((unsigned int)feature_indices_.size());
         }
-        // Now that the table is full, optimize it for speed/space
-        optimize();
+
+        // Empty the hash table
+        BucketsSpace().swap(buckets_space_);
+        freeze(keys, offsets);
     }
-	
+
     /** Get a bucket given the key
      * @param key
-     * @return
+     * @return the range of feature indices in the bucket, empty if there is no such bucket
      */
-    inline const Bucket* getBucketFromKey(BucketKey key) const
+    inline BucketRange getBucketFromKey(BucketKey key) const
     {
+        if (!frozen_) {
+            // The table is still being filled, the buckets are in the map
+            BucketsSpace::const_iterator bucket_it = buckets_space_.find(key);
+            if (bucket_it == buckets_space_.end()) return BucketRange();
+            return BucketRange(&bucket_it->second[0], &bucket_it->second[0] + bucket_it->second.size());
+        }
+
         // Generate other buckets
         switch (speed_level_) {
         case kArray:
+        {
             // That means we get the buckets from an array
-			//put it here temporaryly
-            //return &buckets_speed_[key];
-			throw;
-            break;
+            size_t index = 0;
+            for (unsigned int i = 0; i < key_size_; ++i) {
+                // A component out of the range seen at build time cannot have a bucket
+                unsigned int component = (unsigned int)getKeyField(key, i) - key_min_[i];
+                if (component >= key_extent_[i]) return BucketRange();
+                index += component * key_stride_[i];
+            }
+            return bucketRange(index);
+        }
         case kBitsetHash:
-            // That means we can check the bitset for the presence of a key
-			//put it here temporaryly
-            //if (key_bitset_.test(key)) return &buckets_space_.find(key)->second;
-            //else return 0;
-			throw;
-            break;
+            // That means we can check the bitset for the presence of a key, before the directory
+            if (!key_bitset_.test((size_t)key)) return BucketRange();
+            // Fall through
         case kHash:
         {
             // That means we have to check for the hash table for the presence of a key
-            BucketsSpace::const_iterator bucket_it, bucket_end = buckets_space_.end();
-            bucket_it = buckets_space_.find(key);
-            // Stop here if that bucket does not exist
-            if (bucket_it == bucket_end) return 0;
-            else return &bucket_it->second;
-            break;
+            for (size_t slot = getSlot(key); ; slot = (slot + 1) & directory_mask_) {
+                const DirectorySlot& entry = directory_[slot];
+                // Stop here if that bucket does not exist
+                if (entry.bucket_ == kEmptySlot) return BucketRange();
+                if (entry.key_ == key) return bucketRange(entry.bucket_);
+            }
+        }
+        case kSorted:
+        {
+            // Binary search of the interleaved key
+            BucketKey z_key = zOrder(key);
+            size_t index = std::lower_bound(sorted_keys_.begin(), sorted_keys_.end(), z_key) - sorted_keys_.begin();
+            if (index == n_buckets_ || sorted_keys_[index] != z_key) return BucketRange();
+            return bucketRange(index);
         }
         }
-        return 0;
+        return BucketRange();
     }
 
-    /** Compute the sub-signature of a feature
+    /** Get the bucket of a key or, if it is empty, the bucket whose key shares the longest prefix with it
+     * in the Z-order: the search then degrades to a nearby bucket instead of finding nothing.
+     * Only the sorted layout can do so, the other ones return the bucket of the key.
+     * @param key
+     * @return the range of feature indices in the bucket, empty only if the table is
      */
-	std::vector<float> getKey(const ElementType* /*feature*/) const
+    inline BucketRange getNearestBucket(BucketKey key) const
     {
-        //std::cerr << "LSH is not implemented for that type" << std::endl;
-		std::cerr << "This changed LSH is not implemented for unsigned char" << std::endl;
-        throw;
-        return 1;
+        if (!frozen_ || speed_level_ != kSorted) return getBucketFromKey(key);
+        if (n_buckets_ == 0) return BucketRange();
+
+        BucketKey z_key = zOrder(key);
+        size_t index = std::lower_bound(sorted_keys_.begin(), sorted_keys_.end(), z_key) - sorted_keys_.begin();
+        // Of the keys around z_key, the one sharing the longer prefix with it differs from it by a smaller xor
+        if (index == n_buckets_ || (index > 0 && (sorted_keys_[index - 1] ^ z_key) < (sorted_keys_[index] ^ z_key))) {
+            --index;
+        }
+        return bucketRange(index);
+    }
+
+    /** Split the buckets holding more than limit features with a second level of hashing
+     * The features of such a heavy bucket are reordered in place by their sub-key, and the offset of each
+     * sub-bucket is stored: a query landing in the bucket only has to check its own sub-bucket.
+     * @param limit the largest bucket that is not split, 0 to split none
+     * @param split_key_size the number of second-level hash functions
+     * @param get_sub_key functor giving the sub-key of a feature index
+     */
+    template<typename SubKeyFunction>
+    void splitBuckets(size_t limit, unsigned int split_key_size, SubKeyFunction get_sub_key)
+    {
+        if (!frozen_) {
+            throw FLANNException("The buckets of an LSH table can only be split once it is frozen");
+        }
+        heavy_limit_ = limit;
+        split_key_size_ = split_key_size;
+        heavy_offsets_.clear();
+        heavy_sub_buckets_.clear();
+        sub_buckets_.clear();
+        if (limit == 0) return;
+
+        std::vector<std::pair<BucketKey, FeatureIndex> > features;
+        for (size_t index = 0; index + 1 < buckets_speed_.size(); ++index) {
+            unsigned int begin = buckets_speed_[index], end = buckets_speed_[index + 1];
+            if (end - begin <= limit) continue;
+
+            features.clear();
+            for (unsigned int i = begin; i < end; ++i) {
+                features.push_back(std::make_pair(get_sub_key(feature_indices_[i]), feature_indices_[i]));
+            }
+            std::sort(features.begin(), features.end());
+
+            heavy_offsets_.push_back(begin);
+            heavy_sub_buckets_.push_back((unsigned int)sub_buckets_.size());
+            for (unsigned int i = 0; i < features.size(); ++i) {
+                feature_indices_[begin + i] = features[i].second;
+                if (i == 0 || features[i].first != features[i - 1].first) {
+                    DirectorySlot sub_bucket = { features[i].first, begin + i };
+                    sub_buckets_.push_back(sub_bucket);
+                }
+            }
+        }
+        heavy_sub_buckets_.push_back((unsigned int)sub_buckets_.size());
+    }
+
+    /** Compress the feature indices of the frozen table
+     * The indices of each bucket (of each sub-bucket for the heavy buckets) are sorted and encoded with
+     * StreamVByte, after their number. The offsets of the buckets and sub-buckets then count bytes.
+     */
+    void compress()
+    {
+        if (!frozen_) {
+            throw FLANNException("An LSH table can only be compressed once it is frozen");
+        }
+        if (compressed_) return;
+
+        std::vector<unsigned char> data;
+        std::vector<FeatureIndex> segment;
+        size_t heavy = 0;
+        max_bucket_size_ = 0;
+        for (size_t index = 0; index + 1 < buckets_speed_.size(); ++index) {
+            unsigned int begin = buckets_speed_[index], end = buckets_speed_[index + 1];
+            buckets_speed_[index] = (unsigned int)data.size();
+            writeSize(end - begin, data);
+
+            if (heavy < heavy_offsets_.size() && heavy_offsets_[heavy] == begin && end - begin > heavy_limit_) {
+                // One segment per sub-bucket, which are the only ranges queries will decode
+                heavy_offsets_[heavy] = (unsigned int)data.size();
+                unsigned int last_sub_bucket = heavy_sub_buckets_[heavy + 1];
+                for (unsigned int sub_bucket = heavy_sub_buckets_[heavy]; sub_bucket < last_sub_bucket; ++sub_bucket) {
+                    unsigned int sub_begin = sub_buckets_[sub_bucket].bucket_;
+                    unsigned int sub_end = (sub_bucket + 1 < last_sub_bucket) ? sub_buckets_[sub_bucket + 1].bucket_ : end;
+                    sub_buckets_[sub_bucket].bucket_ = (unsigned int)data.size();
+                    writeSize(sub_end - sub_begin, data);
+                    encodeSegment(sub_begin, sub_end, segment, data);
+                }
+                ++heavy;
+            }
+            else {
+                encodeSegment(begin, end, segment, data);
+            }
+        }
+        if (!buckets_speed_.empty()) buckets_speed_.back() = (unsigned int)data.size();
+
+        // The decoder may read a little past the last bucket
+        data.resize(data.size() + StreamVByte::kPadding, 0);
+        compressed_data_.swap(data);
+        std::vector<FeatureIndex>().swap(feature_indices_);
+        compressed_ = true;
+    }
+
+    /** @return the size of the largest range of feature indices a lookup can return in a compressed table
+     * (the sub-buckets and not the heavy buckets themselves, which are never decoded whole)
+     */
+    size_t maxBucketSize() const
+    {
+        return max_bucket_size_;
+    }
+
+    /** @return whether a bucket was split by splitBuckets()
+     */
+    inline bool isHeavy(const BucketRange& bucket) const
+    {
+        return heavy_limit_ > 0 && bucket.size() > heavy_limit_;
+    }
+
+    /** Get the part of a heavy bucket holding the features with a given sub-key
+     * @param bucket a bucket for which isHeavy() is true
+     * @param sub_key the sub-key, from getSubKey()
+     * @return the range of feature indices in the sub-bucket, empty if there is no such sub-bucket
+     */
+    inline BucketRange getSubBucket(const BucketRange& bucket, BucketKey sub_key) const
+    {
+        unsigned int offset = bucket.compressed() ? (unsigned int)(bucket.data() - &compressed_data_[0])
+                                                  : (unsigned int)(bucket.begin() - &feature_indices_[0]);
+        size_t heavy = std::lower_bound(heavy_offsets_.begin(), heavy_offsets_.end(), offset) - heavy_offsets_.begin();
+
+        const DirectorySlot* first = &sub_buckets_[0] + heavy_sub_buckets_[heavy];
+        const DirectorySlot* last = &sub_buckets_[0] + heavy_sub_buckets_[heavy + 1];
+        const DirectorySlot* sub_bucket = std::lower_bound(first, last, sub_key, CompareSlotKey());
+        if (sub_bucket == last || sub_bucket->key_ != sub_key) return BucketRange();
+        if (compressed_) return segmentRange(sub_bucket->bucket_);
+
+        const FeatureIndex* end = (sub_bucket + 1 == last) ? bucket.end() : &feature_indices_[0] + (sub_bucket + 1)->bucket_;
+        return BucketRange(&feature_indices_[0] + sub_bucket->bucket_, end);
+    }
+
+    /** Quantize the projections of a feature on the second-level hash functions into its sub-key
+     * @param projections the split_key_size projections of the feature, divided by the bucket width
+     * @return the sub-key
+     */
+    inline BucketKey getSubKey(const float* projections) const
+    {
+        BucketKey key = 0;
+        for (unsigned int i = 0; i < split_key_size_; ++i) {
+            key = (key ^ BucketKey(floorToInt(projections[i]))) * 0x9E3779B97F4A7C15ULL;
+        }
+        return key;
+    }
+
+    /** Quantize the projections of a feature into its bucket key.
+     * If key_size_ components fit, each one is floored and stored, offset by a bias, in its own
+     * key_bits_ wide field. The p-stable components further than 2^(key_bits_-1) buckets from 0 wrap around,
+     * which only merges far apart buckets; the cross-polytope vertex ids must fit the field, as the index checks
+     * before building. Otherwise the key is the universal hash sum(r_i * component_i) mod 2^64
+     * E2LSH-style: the word is the fingerprint checked in the directory, the directory slot being a hash of it.
+     * @param projections the key_size_ projections of the feature, divided by the bucket width
+     * @return the key
+     */
+    inline BucketKey getBucketKey(const float* projections) const
+    {
+        BucketKey key = 0;
+        if (key_bits_ > 0) {
+            for (unsigned int i = 0; i < key_size_; ++i) {
+                key |= ((BucketKey(floorToInt(projections[i])) + key_field_bias_) & key_field_mask_) << (i * key_bits_);
+            }
+        }
+        else {
+            for (unsigned int i = 0; i < key_size_; ++i) {
+                key += key_coefficients_[i] * BucketKey(floorToInt(projections[i]));
+            }
+        }
+        return key;
+    }
+
+    /** Get the key of the bucket next to another one along one component
+     * @param key the key to start from
+     * @param component the component to change
+     * @param delta how much to change it by
+     * @return the key in which that component is moved by delta
+     */
+    inline BucketKey perturbKey(BucketKey key, unsigned int component, int delta) const
+    {
+        if (key_bits_ > 0) {
+            unsigned int shift = component * key_bits_;
+            BucketKey field = (getKeyField(key, component) + BucketKey(delta)) & key_field_mask_;
+            return (key & ~(key_field_mask_ << shift)) | (field << shift);
+        }
+        return key + key_coefficients_[component] * BucketKey(delta);
+    }
+
+    /** Compute the key of a binary feature: its bits sampled by the table, packed in order
+     * @param feature the feature to analyze
+     * @return the key
+     */
+    BucketKey getSampledKey(const ElementType* /*feature*/) const
+    {
+        throw FLANNException("Bit-sampling LSH is only implemented for unsigned char features");
     }
-	
 
     /** Get statistics about the table
      * @return
@@ -282,16 +654,25 @@ public:
 
 	long usedMemory()
 	{
-		return buckets_space_.size();
+		return frozen_ ? n_buckets_ : buckets_space_.size();
 	}
 
 	int features_in_a_bucket()
 	{
-		BucketsSpace::const_iterator bucket_begin = buckets_space_.begin(), bucket_end = buckets_space_.end();
+		if (!frozen_) {
+			BucketsSpace::const_iterator bucket_begin = buckets_space_.begin(), bucket_end = buckets_space_.end();
+
+			for (; bucket_begin != bucket_end; bucket_begin++)
+			{
+				std::cout << bucket_begin->second.size() << std::endl;
+			}
+			return 2;
+		}
 
-		for (; bucket_begin != bucket_end; bucket_begin++)
+		for (size_t i = 0; i + 1 < buckets_speed_.size(); i++)
 		{
-			std::cout << bucket_begin->second.size() << std::endl;
+			if (buckets_speed_[i + 1] != buckets_speed_[i])
+				std::cout << buckets_speed_[i + 1] - buckets_speed_[i] << std::endl;
 		}
 		
 		return 2;
@@ -300,73 +681,372 @@ public:
 private:
     /** defines the speed fo the implementation
      * kArray uses a vector for storing data
-     * kBitsetHash uses a hash map but checks for the validity of a key with a bitset
+     * kBitsetHash uses a hash map but checks for the validity of a key with a bitset (binary features only)
      * kHash uses a hash map only
+     * kSorted keeps the buckets sorted by the Z-order of their keys, found by binary search
+     * kArray, kHash and kSorted are only used once the table is frozen, before that the buckets are in a std::map
      */
     enum SpeedLevel
     {
-		//I only used the kHash manner
-        kArray, kBitsetHash, kHash
+        kArray, kBitsetHash, kHash, kSorted
     };
 
+    /** Marks an unused slot of the directory
+     */
+    static const unsigned int kEmptySlot = UINT_MAX;
+
+    /** Fewest bits a packed key component can have, keys with more components are hashed
+     */
+    static const unsigned int kMinKeyBits = 4;
+
+    /** Largest key space of the binary features that can be checked with a bitset, as a power of 2
+     */
+    static const unsigned int kMaxBitsetKeySize = 32;
+
     /** Initialize some variables
      */
     void initialize(size_t key_size)
     {
         speed_level_ = kHash;
         key_size_ = key_size;
+        feature_size_ = 0;
+        mask_.clear();
+        frozen_ = false;
+        sorted_layout_ = false;
+        n_buckets_ = 0;
+        directory_mask_ = 0;
+        directory_shift_ = 63;
+        heavy_limit_ = 0;
+        split_key_size_ = 0;
+        compressed_ = false;
+        max_bucket_size_ = 0;
+
+        key_bits_ = packedKeyBits(key_size_);
+        key_field_mask_ = key_bits_ ? (BucketKey(1) << key_bits_) - 1 : 0;
+        key_field_bias_ = key_bits_ ? BucketKey(1) << (key_bits_ - 1) : 0;
     }
 
-    /** Optimize the table for speed/space
+    /** Draw the key_size_ bits of the binary features sampled by the table
+     * Each sampled bit is then a one-bit component of the packed key, so that the frozen layouts and
+     * perturbKey() apply as they are
+     * @param feature_size the number of bytes of a feature
+     * @param gen the random generator of the table
      */
-    void optimize()
+    template<typename Generator>
+    void initializeSampling(unsigned int feature_size, Generator& gen, const unsigned char*)
     {
-		/*Do nothing here*/
+        const size_t bit_number = size_t(feature_size) * CHAR_BIT;
+        if (key_size_ > bit_number) {
+            throw FLANNException("A bit-sampling LSH key cannot have more bits than the features");
+        }
+        // Partial Fisher-Yates shuffle of the bit indices, whose first key_size_ are sampled
+        std::vector<size_t> indices(bit_number);
+        for (size_t i = 0; i < bit_number; ++i) indices[i] = i;
+        for (unsigned int i = 0; i < key_size_; ++i) {
+            std::uniform_int_distribution<size_t> pick(i, bit_number - 1);
+            std::swap(indices[i], indices[pick(gen)]);
+        }
+        indices.resize(key_size_);
+        setSampledBits(feature_size, indices);
+    }
 
-		/*put it here temporaryly*/
-		/*
-        // If we are already using the fast storage, no need to do anything
-		if (speed_level_ == kArray)
-		{
-			return;
-		}
-		
-        // Use an array if it will be more than half full
-        if (buckets_space_.size() > (unsigned int)((1 << key_size_) / 2)) {
-            speed_level_ = kArray;
-            // Fill the array version of it
-            buckets_speed_.resize(1 << key_size_);
-			for (BucketsSpace::const_iterator key_bucket = buckets_space_.begin(); key_bucket != buckets_space_.end(); ++key_bucket)
-			{
-				BucketIDKeyMap[key_bucket->first] = BucketIDTemp;
-				BucketIDTemp++;
-				buckets_speed_[BucketIDTemp] = key_bucket->second;
-				//buckets_speed_[key_bucket->first] = key_bucket->second;
-			}
+    /** Nothing is sampled from the other features
+     */
+    template<typename Generator, typename T>
+    void initializeSampling(unsigned int /*feature_size*/, Generator& /*gen*/, const T*)
+    {
+    }
+
+    /** Set the bits of the binary features the keys are made of
+     * @param feature_size the number of bytes of a feature
+     * @param bits the indices of the key_size_ distinct bits
+     */
+    void setSampledBits(unsigned int feature_size, const std::vector<size_t>& bits)
+    {
+        const size_t bit_number = size_t(feature_size) * CHAR_BIT;
+        if (key_size_ == 0 || key_size_ > 64) {
+            throw FLANNException("A bit-sampling LSH key needs between 1 and 64 bits");
+        }
+        feature_size_ = feature_size;
+        key_bits_ = 1;
+        key_field_mask_ = 1;
+        key_field_bias_ = 0;
+
+        const size_t block_bits = CHAR_BIT * sizeof(size_t);
+        mask_.assign((bit_number + block_bits - 1) / block_bits, 0);
+        for (size_t i = 0; i < bits.size(); ++i) {
+            if (bits[i] >= bit_number) {
+                throw FLANNException("A bit-sampling LSH key bit is past the end of the features");
+            }
+            mask_[bits[i] / block_bits] |= size_t(1) << (bits[i] % block_bits);
+        }
+    }
 
-            // Empty the hash table
-            buckets_space_.clear();
+    /** Draw the coefficients of the universal hash used when the components cannot be packed
+     * @param gen the random generator of the table
+     */
+    template<typename Generator>
+    void initializeKeyHash(Generator& gen)
+    {
+        key_coefficients_.clear();
+        if (key_bits_ > 0) return;
+        for (unsigned int i = 0; i < key_size_; ++i) {
+            // Odd coefficients keep every component difference visible in the hash
+            key_coefficients_.push_back(((BucketKey(gen()) << 32) ^ BucketKey(gen())) | 1);
+        }
+    }
+
+    /** Move the buckets to the frozen layout
+     * feature_indices_ holds the features of the buckets, one bucket after the other
+     * @param keys the keys of the buckets, in increasing order
+     * @param offsets the offset of each bucket in feature_indices_, and its end
+     */
+    void freeze(const std::vector<BucketKey>& keys, std::vector<unsigned int>& offsets)
+    {
+        n_buckets_ = keys.size();
+
+        if (sorted_layout_) {
+            speed_level_ = kSorted;
+            // The buckets are reordered by their interleaved key
+            std::vector<std::pair<BucketKey, unsigned int> > order(n_buckets_);
+            for (size_t bucket = 0; bucket < n_buckets_; ++bucket) {
+                order[bucket] = std::make_pair(zOrder(keys[bucket]), (unsigned int)bucket);
+            }
+            std::sort(order.begin(), order.end());
+            sorted_keys_.resize(n_buckets_);
+            buckets_speed_.assign(n_buckets_ + 1, 0);
+            std::vector<FeatureIndex> features(feature_indices_.size());
+            for (size_t index = 0; index < n_buckets_; ++index) {
+                unsigned int bucket = order[index].second;
+                sorted_keys_[index] = order[index].first;
+                std::copy(feature_indices_.begin() + offsets[bucket], feature_indices_.begin() + offsets[bucket + 1],
+                          features.begin() + buckets_speed_[index]);
+                buckets_speed_[index + 1] = buckets_speed_[index] + offsets[bucket + 1] - offsets[bucket];
+            }
+            feature_indices_.swap(features);
+            frozen_ = true;
             return;
         }
-		
-        // If the bitset is going to use less than 10% of the RAM of the hash map (at least 1 size_t for the key and two
-        // for the vector) or less than 512MB (key_size_ <= 30)
-        if (((std::max(buckets_space_.size(), buckets_speed_.size()) * CHAR_BIT * 3 * sizeof(BucketKey)) / 10
-             >= size_t(1 << key_size_)) || (key_size_ <= 32)) {
-            speed_level_ = kBitsetHash;
-            key_bitset_.resize(1 << key_size_);
-            key_bitset_.reset();
-            // Try with the BucketsSpace
-			for (BucketsSpace::const_iterator key_bucket = buckets_space_.begin(); key_bucket != buckets_space_.end(); ++key_bucket)
-			{
-				//key_bitset_.set(key_bucket->first);
-			}
+
+        // Use an array if it will be more than half full (only packed keys can be addressed directly)
+        if (key_bits_ > 0 && computeKeySpace(keys) <= 2 * n_buckets_) {
+            speed_level_ = kArray;
+            buckets_speed_.assign(key_space_ + 1, 0);
+            for (size_t bucket = 0; bucket < n_buckets_; ++bucket) {
+                buckets_speed_[getArrayIndex(keys[bucket]) + 1] = offsets[bucket + 1] - offsets[bucket];
+            }
+            for (size_t index = 0; index < key_space_; ++index) {
+                buckets_speed_[index + 1] += buckets_speed_[index];
+            }
+            // The buckets are now in the order of their array index
+            std::vector<FeatureIndex> features(feature_indices_.size());
+            for (size_t bucket = 0; bucket < n_buckets_; ++bucket) {
+                std::copy(feature_indices_.begin() + offsets[bucket], feature_indices_.begin() + offsets[bucket + 1],
+                          features.begin() + buckets_speed_[getArrayIndex(keys[bucket])]);
+            }
+            feature_indices_.swap(features);
         }
         else {
             speed_level_ = kHash;
-            key_bitset_.clear();
+            // Keep the directory at most half full so that probe sequences stay short
+            size_t directory_size = 2;
+            directory_shift_ = 63;
+            while (directory_size < 2 * n_buckets_) {
+                directory_size <<= 1;
+                --directory_shift_;
+            }
+            directory_mask_ = directory_size - 1;
+            DirectorySlot empty_slot;
+            empty_slot.key_ = 0;
+            empty_slot.bucket_ = kEmptySlot;
+            directory_.assign(directory_size, empty_slot);
+
+            for (size_t bucket = 0; bucket < n_buckets_; ++bucket) {
+                size_t slot = getSlot(keys[bucket]);
+                while (directory_[slot].bucket_ != kEmptySlot) slot = (slot + 1) & directory_mask_;
+                directory_[slot].key_ = keys[bucket];
+                directory_[slot].bucket_ = (unsigned int)bucket;
+            }
+            buckets_speed_.swap(offsets);
+
+            // The keys of the binary features are their sampled bits: a bitset of the keys present saves the
+            // directory lookup of the empty buckets, which most multi-probe buckets are, if it is not larger
+            if (!mask_.empty() && key_size_ <= kMaxBitsetKeySize &&
+                (BucketKey(1) << key_size_) / CHAR_BIT <= directory_size * sizeof(DirectorySlot)) {
+                speed_level_ = kBitsetHash;
+                key_bitset_.resize(size_t(1) << key_size_);
+                key_bitset_.reset();
+                for (size_t bucket = 0; bucket < n_buckets_; ++bucket) {
+                    key_bitset_.set((size_t)keys[bucket]);
+                }
+            }
         }
-		*/
+
+        frozen_ = true;
+    }
+
+    /** Stable LSD radix sort of (key, feature) pairs on their key, one byte at a time
+     * The bytes that are the same in all the keys are skipped.
+     */
+    static void sortByKey(std::vector<std::pair<BucketKey, FeatureIndex> >& features)
+    {
+        if (features.size() < 2) return;
+        BucketKey varying = 0;
+        for (size_t i = 1; i < features.size(); ++i) {
+            varying |= features[i].first ^ features[0].first;
+        }
+
+        std::vector<std::pair<BucketKey, FeatureIndex> > sorted(features.size());
+        for (unsigned int shift = 0; shift < 64; shift += 8) {
+            if (((varying >> shift) & 0xFF) == 0) continue;
+
+            size_t count[257] = { 0 };
+            for (size_t i = 0; i < features.size(); ++i) {
+                ++count[((features[i].first >> shift) & 0xFF) + 1];
+            }
+            for (unsigned int digit = 0; digit < 256; ++digit) {
+                count[digit + 1] += count[digit];
+            }
+            for (size_t i = 0; i < features.size(); ++i) {
+                sorted[count[(features[i].first >> shift) & 0xFF]++] = features[i];
+            }
+            features.swap(sorted);
+        }
+    }
+
+    /** Computes the range of each key component over the buckets, and the number of keys
+     * that range allows. The count saturates as soon as it exceeds what an array could hold
+     * @param keys the keys of the buckets
+     * @return the size of the key space
+     */
+    size_t computeKeySpace(const std::vector<BucketKey>& keys)
+    {
+        key_min_.assign(key_size_, UINT_MAX);
+        std::vector<unsigned int> key_max(key_size_, 0);
+        for (size_t bucket = 0; bucket < keys.size(); ++bucket) {
+            for (unsigned int i = 0; i < key_size_; ++i) {
+                unsigned int component = (unsigned int)getKeyField(keys[bucket], i);
+                key_min_[i] = std::min(key_min_[i], component);
+                key_max[i] = std::max(key_max[i], component);
+            }
+        }
+
+        const size_t max_key_space = 2 * n_buckets_ + 1;
+        key_extent_.resize(key_size_);
+        key_stride_.resize(key_size_);
+        key_space_ = 1;
+        for (int i = int(key_size_) - 1; i >= 0; --i) {
+            key_extent_[i] = key_max[i] - key_min_[i] + 1;
+            key_stride_[i] = key_space_;
+            if (n_buckets_ == 0 || key_extent_[i] > max_key_space / key_space_) {
+                key_space_ = max_key_space;
+                return key_space_;
+            }
+            key_space_ *= key_extent_[i];
+        }
+        return key_space_;
+    }
+
+    /** @return the feature indices of the bucket starting at the given offset index
+     */
+    inline BucketRange bucketRange(size_t index) const
+    {
+        if (compressed_) return segmentRange(buckets_speed_[index]);
+        return BucketRange(&feature_indices_[0] + buckets_speed_[index], &feature_indices_[0] + buckets_speed_[index + 1]);
+    }
+
+    /** @return the compressed range whose size is written at a given offset
+     */
+    inline BucketRange segmentRange(size_t offset) const
+    {
+        const unsigned char* data = &compressed_data_[0] + offset;
+        size_t size = 0;
+        for (unsigned int shift = 0; ; shift += 7) {
+            size |= size_t(*data & 0x7F) << shift;
+            if (!(*data++ & 0x80)) break;
+        }
+        return BucketRange(data, size);
+    }
+
+    /** Appends the number of indices of a range, 7 bits per byte
+     */
+    static void writeSize(size_t size, std::vector<unsigned char>& data)
+    {
+        for (; size >= 0x80; size >>= 7) {
+            data.push_back((unsigned char)(size | 0x80));
+        }
+        data.push_back((unsigned char)size);
+    }
+
+    /** Appends the sorted and encoded feature indices in [begin, end)
+     */
+    void encodeSegment(unsigned int begin, unsigned int end, std::vector<FeatureIndex>& segment, std::vector<unsigned char>& data)
+    {
+        segment.assign(feature_indices_.begin() + begin, feature_indices_.begin() + end);
+        std::sort(segment.begin(), segment.end());
+        if (!segment.empty()) StreamVByte::encode(&segment[0], segment.size(), data);
+        max_bucket_size_ = std::max(max_bucket_size_, segment.size());
+    }
+
+    /** Orders the sub-buckets of a heavy bucket by key
+     */
+    struct CompareSlotKey
+    {
+        bool operator()(const DirectorySlot& slot, BucketKey key) const
+        {
+            return slot.key_ < key;
+        }
+    };
+
+    /** @return the index of a packed key in the kArray offsets
+     */
+    inline size_t getArrayIndex(BucketKey key) const
+    {
+        size_t index = 0;
+        for (unsigned int i = 0; i < key_size_; ++i) {
+            index += ((unsigned int)getKeyField(key, i) - key_min_[i]) * key_stride_[i];
+        }
+        return index;
+    }
+
+    /** Interleaves the bits of the components of a packed key, the most significant bits first (Z-order)
+     * Keys close in every component then share a long prefix, and their buckets are close in the sorted layout
+     */
+    inline BucketKey zOrder(BucketKey key) const
+    {
+        BucketKey z_key = 0;
+        unsigned int shift = 64;
+        for (int bit = int(key_bits_) - 1; bit >= 0; --bit) {
+            for (unsigned int i = 0; i < key_size_; ++i) {
+                z_key |= ((key >> (i * key_bits_ + bit)) & 1) << --shift;
+            }
+        }
+        return z_key;
+    }
+
+    /** @return the biased value of a component of a packed key
+     */
+    inline BucketKey getKeyField(BucketKey key, unsigned int component) const
+    {
+        return (key >> (component * key_bits_)) & key_field_mask_;
+    }
+
+    /** First level of the directory hashing: multiplicative (Fibonacci) hashing of the key word to a slot.
+     * Its high bits depend on every bit of the key, unlike the low bits of a packed or universal hash key.
+     * Two different keys of a table are assumed to never share a word: for hashed keys the odds are
+     * about n_buckets^2 / 2^64 and it would only mix two buckets
+     */
+    inline size_t getSlot(BucketKey key) const
+    {
+        return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> directory_shift_);
+    }
+
+    /** Branch-free floor, that the compiler can vectorize
+     */
+    static inline int floorToInt(float value)
+    {
+        int truncated = (int)value;
+        return truncated - (value < (float)truncated);
     }
 
     template<typename Archive>
@@ -383,27 +1063,141 @@ private:
 
     	ar & key_size_;
     	ar & mask_;
-
+    	ar & feature_size_;
+    	ar & key_bits_;
+    	ar & key_field_mask_;
+    	ar & key_field_bias_;
+    	ar & key_coefficients_;
+    	ar & frozen_;
+
+    	if (!frozen_) {
+    		ar & buckets_space_;
+    		return;
+    	}
+    	ar & n_buckets_;
+    	ar & feature_indices_;
+    	ar & buckets_speed_;
     	if (speed_level_==kArray) {
-    		ar & buckets_speed_;
+    		ar & key_min_;
+    		ar & key_extent_;
+    		ar & key_stride_;
+    		ar & key_space_;
     	}
     	if (speed_level_==kBitsetHash || speed_level_==kHash) {
-    		ar & buckets_space_;
+    		ar & directory_;
+    		ar & directory_mask_;
+    		ar & directory_shift_;
+    	}
+    	if (speed_level_==kSorted) {
+    		ar & sorted_keys_;
     	}
+    	ar & heavy_limit_;
+    	ar & split_key_size_;
+    	ar & heavy_offsets_;
+    	ar & heavy_sub_buckets_;
+    	ar & sub_buckets_;
+    	ar & compressed_;
+    	ar & compressed_data_;
+    	ar & max_bucket_size_;
 		if (speed_level_==kBitsetHash) {
 			ar & key_bitset_;
 		}
     }
     friend struct serialization::access;
 
-    /** The vector of all the buckets if they are held for speed
+    /** The offsets of the buckets in feature_indices_: by key in kArray, by bucket in kHash and kSorted
      */
     BucketsSpeed buckets_speed_;
 
-    /** The hash table of all the buckets in case we cannot use the speed version
+    /** The hash table of all the buckets while the table is being filled
      */
     BucketsSpace buckets_space_;
 
+    /** The feature indices of all the buckets once frozen, one bucket after the other
+     */
+    std::vector<FeatureIndex> feature_indices_;
+
+    /** Open-addressing directory (linear probing) from keys to buckets, for kHash
+     */
+    std::vector<DirectorySlot> directory_;
+
+    /** For kSorted: the interleaved keys of the buckets, in increasing order
+     */
+    std::vector<BucketKey> sorted_keys_;
+
+    /** Whether the table is to be frozen in the sorted layout
+     */
+    bool sorted_layout_;
+
+    /** directory_.size() - 1, the directory size being a power of 2
+     */
+    size_t directory_mask_;
+
+    /** 64 - log2(directory_.size())
+     */
+    unsigned int directory_shift_;
+
+    /** Size above which the buckets were split, 0 if none was
+     */
+    size_t heavy_limit_;
+
+    /** Number of components of the sub-keys of the heavy buckets
+     */
+    unsigned int split_key_size_;
+
+    /** Offset in feature_indices_ of each heavy bucket, and the index of its first sub-bucket (one more for the end)
+     */
+    std::vector<unsigned int> heavy_offsets_;
+    std::vector<unsigned int> heavy_sub_buckets_;
+
+    /** Sub-key and offset in feature_indices_ of the sub-buckets, sorted by key within each heavy bucket
+     */
+    std::vector<DirectorySlot> sub_buckets_;
+
+    /** Whether the feature indices were moved to compressed_data_ by compress()
+     * All the offsets (buckets, heavy buckets, sub-buckets) then count bytes of compressed_data_.
+     */
+    bool compressed_;
+
+    /** The encoded feature indices of all the buckets, one bucket after the other
+     */
+    std::vector<unsigned char> compressed_data_;
+
+    /** Size of the largest range of feature indices of a compressed table
+     */
+    size_t max_bucket_size_;
+
+    /** Number of bits of each component in a packed key, 0 if the components are hashed
+     */
+    unsigned int key_bits_;
+
+    /** Mask and bias of a packed component
+     */
+    BucketKey key_field_mask_;
+    BucketKey key_field_bias_;
+
+    /** Coefficients of the universal hash, if the components are hashed
+     */
+    std::vector<BucketKey> key_coefficients_;
+
+    /** For kArray: smallest value, number of values and stride of each packed key component
+     */
+    std::vector<unsigned int> key_min_;
+    std::vector<unsigned int> key_extent_;
+    std::vector<size_t> key_stride_;
+
+    /** For kArray: number of keys that can be addressed
+     */
+    size_t key_space_;
+
+    /** Number of non-empty buckets
+     */
+    size_t n_buckets_;
+
+    /** Whether the buckets have been moved to the frozen layout
+     */
+    bool frozen_;
+
     /** What is used to store the data */
     SpeedLevel speed_level_;
 
@@ -422,15 +1216,12 @@ private:
      */
     std::vector<size_t> mask_;
 
-	std::vector<size_t> probe_;
-
-	Matrix<float> Hash_Matrix_;
-
-	float Hash_Bias_;
-
-	int vec_len;
+    /** The number of bytes of a feature, for the mask not to read past its end
+     * Only used in the unsigned char case
+     */
+    unsigned int feature_size_;
 
-	float Hash_W_;
+	std::vector<size_t> probe_;
 
 };
 
@@ -438,58 +1229,55 @@ private:
 
 
 template<>
-inline LshTable<float>::LshTable(unsigned int feature_size, unsigned int subsignature_size)
+inline LshTable<float>::LshTable(unsigned int /*feature_size*/, unsigned int subsignature_size)
 {
 	/*Init hash table*/
 	initialize(subsignature_size);
 
-	int M = subsignature_size;
-	Hash_W_ = 1000;
-
-	vec_len = feature_size;
 	std::random_device rd;
 	std::mt19937 gen(rd());
-	std::normal_distribution<> a_norm(0.0, 1.0);
-	std::uniform_real_distribution<> b_unif(0.0, Hash_W_);
-
-	Hash_Matrix_ = Matrix<float>(new float[vec_len * M], vec_len, M);
-
-	for (int j = 0; j < M; j++)
-	{
-		for (int k = 0; k < vec_len; k++)
-		{
-			*(Hash_Matrix_[j] + k) = a_norm(gen);
-		}
-	}
-	Hash_Bias_ = b_unif(gen);
+	initializeKeyHash(gen);
 }
 
-
-/** Return the Subsignature of a float feature
-* @param feature the feature to analyze
-*/
 template<>
-inline std::vector<float> LshTable<float>::getKey(const float* feature) const
+inline LshTable<unsigned char>::LshTable(unsigned int feature_size, unsigned int subsignature_size)
 {
-	const float* feature_block_ptr = feature;
+    initialize(subsignature_size);
 
-	std::vector<float> subsignature(key_size_);
-	
-	float sum_upper = 0;
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    initializeSampling(feature_size, gen, static_cast<const unsigned char*>(0));
+}
 
-	for (int j = 0; j < key_size_; j++)
-	{
-		sum_upper = 0;
-		for (int k = 0; k < vec_len; k++)
-		{
-			//std::cout << *(Hash_Matrix_[j] + k) << ' ' << *(feature_block_ptr + k) << std::endl;
-			sum_upper += *(Hash_Matrix_[j] + k) * *(feature_block_ptr + k);
-		}
-		sum_upper += Hash_Bias_;
-		subsignature[j] = sum_upper / Hash_W_;
-	}
+template<>
+inline BucketKey LshTable<unsigned char>::getSampledKey(const unsigned char* feature) const
+{
+    // Given the feature ABCDEF, and the mask 001011, the output will be CEF
+    // The feature is read a word at a time, only the words with sampled bits
+    BucketKey key = 0;
+    BucketKey key_bit = 1;
+    for (size_t block = 0; block < mask_.size(); ++block) {
+        size_t mask_block = mask_[block];
+        if (mask_block == 0) continue;
+        // The last word of the feature may be partial
+        size_t offset = block * sizeof(size_t);
+        size_t feature_block = 0;
+        memcpy(&feature_block, feature + offset, std::min(sizeof(size_t), size_t(feature_size_) - offset));
+        while (mask_block) {
+            // Get the lowest set bit in the mask block
+            size_t lowest_bit = mask_block & (~mask_block + 1);
+            if (feature_block & lowest_bit) key |= key_bit;
+            mask_block ^= lowest_bit;
+            key_bit <<= 1;
+        }
+    }
+    return key;
+}
 
-	return subsignature;
+template<>
+inline void LshTable<unsigned char>::add(unsigned int value, const unsigned char* feature)
+{
+    add(value, getSampledKey(feature));
 }
 
 /*We will not use it here*/
@@ -0,0 +1,233 @@
+/***********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ * Copyright 2008-2009  Marius Muja (mariusm@cs.ubc.ca). All rights reserved.
+ * Copyright 2008-2009  David G. Lowe (lowe@cs.ubc.ca). All rights reserved.
+ *
+ * THE BSD LICENSE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *************************************************************************/
+
+#ifndef FLANN_LSH_TUNING_H_
+#define FLANN_LSH_TUNING_H_
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+namespace flann
+{
+
+namespace lsh
+{
+
+/** Probability that two points at a given distance land in the same bucket of a 2-stable (Gaussian)
+ * hash function of width W with a uniform offset (Datar et al.)
+ * @param distance the Euclidean distance between the points
+ * @param width the width W of the buckets
+ */
+inline double collisionProbability(double distance, double width)
+{
+    if (distance <= 0) return 1;
+    double t = width / distance;
+    return 1 - std::erfc(t / std::sqrt(2.0)) - 2 / (std::sqrt(2 * 3.14159265358979323846) * t) * (1 - std::exp(-t * t / 2));
+}
+
+/** Average over the near neighbors of the probability that one of L tables puts them with the query
+ * @param collisions the probability for each neighbor of colliding with the query in one table
+ * @param table_number the number L of tables
+ */
+inline double expectedRecall(const std::vector<double>& collisions, unsigned int table_number)
+{
+    double recall = 0;
+    for (size_t j = 0; j < collisions.size(); ++j) {
+        recall += 1 - std::pow(1 - collisions[j], (double)table_number);
+    }
+    return recall / collisions.size();
+}
+
+/** Squared Euclidean distance between two features
+ */
+template<typename ElementType>
+inline float squaredDistance(const ElementType* a, const ElementType* b, size_t veclen)
+{
+    // Independent sums, which the compiler can keep in vector registers
+    float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    size_t k = 0;
+    for (; k + 4 <= veclen; k += 4) {
+        float d0 = float(a[k]) - float(b[k]), d1 = float(a[k + 1]) - float(b[k + 1]);
+        float d2 = float(a[k + 2]) - float(b[k + 2]), d3 = float(a[k + 3]) - float(b[k + 3]);
+        s0 += d0 * d0; s1 += d1 * d1; s2 += d2 * d2; s3 += d3 * d3;
+    }
+    for (; k < veclen; ++k) {
+        float d = float(a[k]) - float(b[k]);
+        s0 += d * d;
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+/** Bucket width, key size and number of tables chosen for a dataset, with what they are expected to give
+ */
+struct LshParameters
+{
+    LshParameters() : width_(0), key_size_(0), table_number_(0), recall_(0), candidates_(0)
+    {
+    }
+
+    float width_;
+    unsigned int key_size_;
+    unsigned int table_number_;
+    /** Expected fraction of the near neighbors sharing a bucket with the query in some table */
+    double recall_;
+    /** Expected number of points in the buckets of the query, over all the tables */
+    double candidates_;
+};
+
+/** Picks W, k and L for E2LSH from a sample of the dataset
+ * Some points are taken as queries. Their kNeighbors nearest neighbors in the dataset, and a random sample
+ * of the dataset, give the distributions of the near and of the ordinary distances. For a width W and k
+ * functions per table, a near neighbor at distance r collides with the query in a table with
+ * probability p(r)^k, so L tables find it with probability 1 - (1 - p(r)^k)^L, while a table holds
+ * about size * E[p(c)^k] other points in the bucket of the query.
+ * The parameters are those with the least hashing and candidate cost (L * k + candidates, in dot products)
+ * that reach the target recall within the candidate budget, or those of best recall if none does. The
+ * model ignores multi-probe, which only adds to the recall. The width is 0 if no parameters fit the budget.
+ * @param points the dataset
+ * @param veclen the size of the features
+ * @param target_recall the fraction of the near neighbors to find
+ * @param candidate_budget the most candidates a query can get, negative for no limit
+ * @param max_key_size the largest key size to consider
+ * @param key_size_step the key sizes considered are the multiples of key_size_step
+ * @param max_table_number the largest number of tables to consider
+ * @param gen the random generator of the sample
+ */
+template<typename ElementType, typename Generator>
+LshParameters estimateParameters(const std::vector<ElementType*>& points, size_t veclen, float target_recall,
+                                 double candidate_budget, unsigned int max_key_size, unsigned int key_size_step,
+                                 unsigned int max_table_number, Generator& gen)
+{
+    const size_t kQueries = 100;
+    const size_t kNeighbors = 10;
+    const size_t kOthers = 1000;
+
+    LshParameters best;
+    size_t size = points.size();
+    if (size < 2 || max_key_size < key_size_step || max_table_number == 0) return best;
+
+    size_t queries = std::min(kQueries, size);
+    size_t neighbors = std::min(kNeighbors, size - 1);
+    size_t others = std::min(kOthers, size);
+    std::uniform_int_distribution<size_t> pick(0, size - 1);
+    std::vector<size_t> query_indices(queries), other_indices(others);
+    for (size_t i = 0; i < queries; ++i) query_indices[i] = pick(gen);
+    for (size_t i = 0; i < others; ++i) other_indices[i] = pick(gen);
+
+    // Euclidean distances, which are what the p-stable functions preserve
+    std::vector<double> near(queries * neighbors), far(queries * others);
+#pragma omp parallel for schedule(dynamic)
+    for (int q = 0; q < (int)queries; ++q) {
+        const ElementType* query = points[query_indices[q]];
+        double* nearest = &near[q * neighbors];
+        std::fill(nearest, nearest + neighbors, std::numeric_limits<double>::max());
+        for (size_t i = 0; i < size; ++i) {
+            if (i == query_indices[q]) continue;
+            double distance = squaredDistance(points[i], query, veclen);
+            // Insertion into the sorted neighbors
+            if (distance < nearest[neighbors - 1]) {
+                size_t j = neighbors - 1;
+                for (; j > 0 && nearest[j - 1] > distance; --j) nearest[j] = nearest[j - 1];
+                nearest[j] = distance;
+            }
+        }
+        for (size_t j = 0; j < neighbors; ++j) nearest[j] = std::sqrt(nearest[j]);
+        for (size_t i = 0; i < others; ++i) {
+            far[q * others + i] = std::sqrt((double)squaredDistance(points[other_indices[i]], query, veclen));
+        }
+    }
+
+    // The widths tried are around the typical near neighbor distance
+    std::vector<double> sorted_near(near);
+    std::sort(sorted_near.begin(), sorted_near.end());
+    double base = sorted_near[sorted_near.size() / 2];
+    if (base <= 0) base = *std::max_element(far.begin(), far.end());
+    if (base <= 0) base = 1;
+
+    double best_cost = std::numeric_limits<double>::max();
+    bool feasible = false;
+    std::vector<double> near_p(near.size()), far_p(far.size()), near_pk(near.size()), far_pk(far.size());
+    for (int step = -8; step <= 16; ++step) {
+        double width = base * std::pow(2.0, step / 4.0);
+        for (size_t j = 0; j < near.size(); ++j) {
+            near_p[j] = std::pow(collisionProbability(near[j], width), (double)key_size_step);
+            near_pk[j] = 1;
+        }
+        for (size_t j = 0; j < far.size(); ++j) {
+            far_p[j] = std::pow(collisionProbability(far[j], width), (double)key_size_step);
+            far_pk[j] = 1;
+        }
+
+        for (unsigned int key_size = key_size_step; key_size <= max_key_size; key_size += key_size_step) {
+            double far_mean = 0;
+            for (size_t j = 0; j < far.size(); ++j) {
+                far_pk[j] *= far_p[j];
+                far_mean += far_pk[j];
+            }
+            far_mean /= far.size();
+            for (size_t j = 0; j < near.size(); ++j) near_pk[j] *= near_p[j];
+
+            // The recall grows with L: the fewest tables reaching the target, or all of them
+            unsigned int low = 1, high = max_table_number;
+            while (low < high) {
+                unsigned int middle = (low + high) / 2;
+                if (expectedRecall(near_pk, middle) >= target_recall) high = middle;
+                else low = middle + 1;
+            }
+            unsigned int table_number = low;
+            double recall = expectedRecall(near_pk, table_number);
+            double candidates = table_number * size * far_mean;
+            if (candidate_budget >= 0 && candidates > candidate_budget) continue;
+
+            double cost = double(table_number) * key_size + candidates;
+            bool reaches = recall >= target_recall;
+            if ((reaches && (!feasible || cost < best_cost)) ||
+                (!reaches && !feasible && (recall > best.recall_ || (recall == best.recall_ && cost < best_cost)))) {
+                feasible = reaches;
+                best_cost = cost;
+                best.width_ = float(width);
+                best.key_size_ = key_size;
+                best.table_number_ = table_number;
+                best.recall_ = recall;
+                best.candidates_ = candidates;
+            }
+        }
+    }
+    return best;
+}
+
+
+}
+}
+
+#endif /* FLANN_LSH_TUNING_H_ */
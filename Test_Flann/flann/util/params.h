@@ -43,6 +43,8 @@ namespace anyimpl
 {
 SMALL_POLICY(flann_algorithm_t);
 SMALL_POLICY(flann_centers_init_t);
+SMALL_POLICY(flann_lsh_projection_t);
+SMALL_POLICY(flann_lsh_precision_t);
 SMALL_POLICY(flann_log_level_t);
 SMALL_POLICY(flann_datatype_t);
 }
@@ -67,6 +69,9 @@ struct SearchParams
     	use_heap = FLANN_Undefined;
     	cores = 4;
     	matrices_in_gpu_ram = false;
+    	max_unimproved_buckets = -1;
+    	max_bucket_checks = -1;
+    	mih_checks = -1;
     }
 
     // how many leafs to visit when searching for neighbours (-1 for unlimited)
@@ -83,6 +88,12 @@ struct SearchParams
     int cores;
     // for GPU search indicates if matrices are already in GPU ram
     bool matrices_in_gpu_ram;
+    // LSH search stops after that many buckets in a row did not improve the neighbours (-1 for unlimited)
+    int max_unimproved_buckets;
+    // most distances an LSH search computes in a single bucket (-1 for unlimited)
+    int max_bucket_checks;
+    // most distances a multi-index hashing search computes, which is only exact without a limit (default: -1 for unlimited)
+    int mih_checks;
 };
 
 
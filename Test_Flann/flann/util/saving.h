@@ -126,6 +126,8 @@ namespace serialization
 {
 ENUM_SERIALIZER(flann_algorithm_t);
 ENUM_SERIALIZER(flann_centers_init_t);
+ENUM_SERIALIZER(flann_lsh_projection_t);
+ENUM_SERIALIZER(flann_lsh_precision_t);
 ENUM_SERIALIZER(flann_log_level_t);
 ENUM_SERIALIZER(flann_datatype_t);
 }
@@ -80,6 +80,7 @@ struct Serializer<type>\
 
 // declare serializers for simple types
 BASIC_TYPE_SERIALIZER(char);
+BASIC_TYPE_SERIALIZER(signed char);
 BASIC_TYPE_SERIALIZER(unsigned char);
 BASIC_TYPE_SERIALIZER(short);
 BASIC_TYPE_SERIALIZER(unsigned short);
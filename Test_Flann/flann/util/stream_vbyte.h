@@ -0,0 +1,163 @@
+/***********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ * Copyright 2008-2009  Marius Muja (mariusm@cs.ubc.ca). All rights reserved.
+ * Copyright 2008-2009  David G. Lowe (lowe@cs.ubc.ca). All rights reserved.
+ *
+ * THE BSD LICENSE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *************************************************************************/
+
+#ifndef FLANN_STREAM_VBYTE_H_
+#define FLANN_STREAM_VBYTE_H_
+
+#include <vector>
+#include <stddef.h>
+#ifdef _MSC_VER
+typedef unsigned __int32 uint32_t;
+#else
+#include <stdint.h>
+#endif
+
+#if defined(__SSSE3__) || defined(__AVX__)
+#include <tmmintrin.h>
+#define FLANN_STREAM_VBYTE_USE_SSSE3 1
+#endif
+
+namespace flann
+{
+
+/** Codec for sorted lists of integers (Lemire et al., Stream VByte)
+ * The differences between consecutive values are stored on 1 to 4 bytes each. The 2-bit lengths of 4
+ * values are packed in one control byte, all the control bytes coming before the data bytes, so that
+ * 4 values are decoded at once with a single byte shuffle followed by a prefix sum.
+ */
+class StreamVByte
+{
+public:
+    /** Number of bytes the decoder may read past the end of an encoded list
+     */
+    static const size_t kPadding = 16;
+
+    /** Appends a list to a buffer
+     * @param values the values, in increasing order
+     * @param count the number of values
+     * @param out the buffer
+     */
+    static void encode(const uint32_t* values, size_t count, std::vector<unsigned char>& out)
+    {
+        size_t control = out.size();
+        out.resize(out.size() + (count + 3) / 4, 0);
+
+        uint32_t previous = 0;
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t delta = values[i] - previous;
+            previous = values[i];
+            unsigned int code = (delta < (1u << 8)) ? 0 : (delta < (1u << 16)) ? 1 : (delta < (1u << 24)) ? 2 : 3;
+            out[control + i / 4] |= (unsigned char)(code << (2 * (i % 4)));
+            for (unsigned int b = 0; b <= code; ++b) {
+                out.push_back((unsigned char)(delta >> (8 * b)));
+            }
+        }
+    }
+
+    /** Decodes a list
+     * Up to kPadding bytes after the end of the list may be read, the buffer must hold them.
+     * @param data the encoded list
+     * @param count the number of values
+     * @param out the values
+     * @return the end of the encoded list
+     */
+    static const unsigned char* decode(const unsigned char* data, size_t count, uint32_t* out)
+    {
+        const unsigned char* control = data;
+        const unsigned char* bytes = data + (count + 3) / 4;
+        uint32_t previous = 0;
+        size_t i = 0;
+
+#ifdef FLANN_STREAM_VBYTE_USE_SSSE3
+        const Tables& tables = getTables();
+        __m128i prefix = _mm_setzero_si128();
+        for (; i + 4 <= count; i += 4) {
+            unsigned char code = control[i / 4];
+            __m128i deltas = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)bytes),
+                                              _mm_loadu_si128((const __m128i*)tables.shuffle_[code]));
+            bytes += tables.length_[code];
+            // Inclusive prefix sum of the 4 deltas, plus the last value of the previous group
+            deltas = _mm_add_epi32(deltas, _mm_slli_si128(deltas, 4));
+            deltas = _mm_add_epi32(deltas, _mm_slli_si128(deltas, 8));
+            prefix = _mm_add_epi32(deltas, prefix);
+            _mm_storeu_si128((__m128i*)(out + i), prefix);
+            prefix = _mm_shuffle_epi32(prefix, 0xFF);
+        }
+        if (i > 0) previous = out[i - 1];
+#endif
+        for (; i < count; ++i) {
+            unsigned int code = (control[i / 4] >> (2 * (i % 4))) & 3;
+            uint32_t delta = 0;
+            for (unsigned int b = 0; b <= code; ++b) {
+                delta |= uint32_t(bytes[b]) << (8 * b);
+            }
+            bytes += code + 1;
+            previous += delta;
+            out[i] = previous;
+        }
+        return bytes;
+    }
+
+private:
+#ifdef FLANN_STREAM_VBYTE_USE_SSSE3
+    /** For each control byte, the shuffle gathering the 4 values and the number of data bytes they use
+     */
+    struct Tables
+    {
+        Tables()
+        {
+            for (unsigned int code = 0; code < 256; ++code) {
+                unsigned char byte = 0;
+                for (unsigned int v = 0; v < 4; ++v) {
+                    unsigned int length = ((code >> (2 * v)) & 3) + 1;
+                    for (unsigned int b = 0; b < 4; ++b) {
+                        shuffle_[code][4 * v + b] = (b < length) ? (char)(byte + b) : (char)0x80;
+                    }
+                    byte += length;
+                }
+                length_[code] = byte;
+            }
+        }
+
+        char shuffle_[256][16];
+        unsigned char length_[256];
+    };
+
+    static const Tables& getTables()
+    {
+        static const Tables tables;
+        return tables;
+    }
+#endif
+};
+
+}
+
+#endif /* FLANN_STREAM_VBYTE_H_ */
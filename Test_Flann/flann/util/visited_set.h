@@ -0,0 +1,122 @@
+/***********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ * Copyright 2008-2009  Marius Muja (mariusm@cs.ubc.ca). All rights reserved.
+ * Copyright 2008-2009  David G. Lowe (lowe@cs.ubc.ca). All rights reserved.
+ *
+ * THE BSD LICENSE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *************************************************************************/
+
+#ifndef FLANN_VISITED_SET_H_
+#define FLANN_VISITED_SET_H_
+
+#include <algorithm>
+#include <vector>
+
+namespace flann {
+
+/** Set of visited indices that can be cleared in constant time
+ * Every index carries the stamp of the last search that visited it: clearing
+ * the set only starts a new stamp, so one instance can be kept by a thread and
+ * reused for all its queries instead of allocating or zeroing a bitset each time.
+ */
+class VisitedSet
+{
+public:
+    /** Default constructor
+     */
+    VisitedSet() : stamp_(1)
+    {
+    }
+
+    /** @param size the number of indices the set can contain
+     */
+    VisitedSet(size_t size) : stamp_(1)
+    {
+        resize(size);
+    }
+
+    /** Resizes the set so that it contains size indices, and clears it
+     * @param size
+     */
+    void resize(size_t size)
+    {
+        stamps_.assign(size, 0);
+        stamp_ = 1;
+    }
+
+    /** Removes all the indices from the set
+     * The stamps are only zeroed when the counter wraps around
+     */
+    void clear()
+    {
+        if (++stamp_ == 0) {
+            std::fill(stamps_.begin(), stamps_.end(), 0);
+            stamp_ = 1;
+        }
+    }
+
+    /** @return the number of indices the set can contain
+     */
+    size_t size() const
+    {
+        return stamps_.size();
+    }
+
+    /** @param index the index to check
+     * @return true if the index was visited since the last clear()
+     */
+    bool test(size_t index) const
+    {
+        return stamps_[index] == stamp_;
+    }
+
+    /** @param index the index to mark as visited
+     */
+    void set(size_t index)
+    {
+        stamps_[index] = stamp_;
+    }
+
+    /** Marks an index as visited
+     * @param index the index to mark
+     * @return true if it was not visited yet
+     */
+    bool insert(size_t index)
+    {
+        if (stamps_[index] == stamp_) return false;
+        stamps_[index] = stamp_;
+        return true;
+    }
+
+private:
+    /** Stamp of the last search that visited each index */
+    std::vector<unsigned int> stamps_;
+    /** Stamp of the current search */
+    unsigned int stamp_;
+};
+
+} // namespace flann
+
+#endif // FLANN_VISITED_SET_H_
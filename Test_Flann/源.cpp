@@ -193,7 +193,7 @@ void Research_For_LSH(string InputFileName, string OutputFileName,
 	SIZE_T virtualMemUsedByMe = pmc.WorkingSetSize;//Physical Memory currently used by current process
 
 	start2 = clock();
-	index.knnSearch(query, indices, dists, nn, flann::SearchParams());
+	index.knnSearch(query, indices, dists, nn, flann::SearchParams(FLANN_CHECKS_UNLIMITED));
 	end = clock();
 	cout << "Find_nn_end" << endl;
 